@@ -0,0 +1,176 @@
+#ifndef _A4_COLUMNS_H_
+#define _A4_COLUMNS_H_
+
+#include <string>
+#include <vector>
+#include <iosfwd>
+
+#include <a4/types.h>
+
+namespace google {
+namespace protobuf {
+    class Descriptor;
+    class FieldDescriptor;
+    class Message;
+}
+}
+
+namespace a4 {
+namespace io {
+
+    class InputStream;
+    class A4Message;
+
+    /// The values of one numeric field for a batch of messages,
+    /// stored in one contiguous array.
+
+    /// Unset optional fields contribute their default value.
+    /// For repeated fields, the values of message i are
+    /// values<T>()[offsets()[i]] up to (excluding) values<T>()[offsets()[i+1]].
+    class Column
+    {
+        public:
+            enum Type { INT32 = 1, INT64, UINT32, UINT64, FLOAT, DOUBLE, BOOL };
+
+            Column(const google::protobuf::FieldDescriptor* field);
+
+            const std::string& name() const { return _name; }
+            Type type() const { return _type; }
+            bool repeated() const { return _repeated; }
+
+            /// Size of one value in bytes
+            size_t value_size() const { return _value_size; }
+
+            /// Number of values in the column
+            size_t size() const { return _values.size() / _value_size; }
+
+            /// Pointer to the values; T must match type(), enums are INT32
+            /// and BOOL is stored as uint8_t.
+            template<typename T> const T* values() const;
+
+            const char* data() const { return _values.data(); }
+
+            /// One offset per message plus one if repeated(), otherwise empty
+            const std::vector<uint64_t>& offsets() const { return _offsets; }
+
+            /// Type of numeric fields, false if the field can not be a column
+            static bool type_of(const google::protobuf::FieldDescriptor* field, Type& type);
+
+        private:
+            friend class ColumnBatch;
+            void add(const google::protobuf::Message& msg);
+            void clear();
+            void set_field(const google::protobuf::FieldDescriptor* field);
+            template<typename T> void push(T value);
+
+            /// Append the default value of a field that is not repeated
+            void add_default();
+            /// Decode a value of the field's wire type, or a packed array of them
+            const uint8_t* decode(const uint8_t* p, const uint8_t* end);
+            const uint8_t* decode_packed(const uint8_t* p, const uint8_t* end);
+
+            const google::protobuf::FieldDescriptor* _field;
+            std::string _name;
+            Type _type;
+            bool _repeated;
+            size_t _value_size;
+            int _wire_type;
+            bool _zigzag;
+            uint64_t _default;
+            std::vector<char> _values;
+            std::vector<uint64_t> _offsets;
+    };
+
+    template<typename T> struct ColumnType;
+    template<> struct ColumnType<int32_t> { static const Column::Type type = Column::INT32; };
+    template<> struct ColumnType<int64_t> { static const Column::Type type = Column::INT64; };
+    template<> struct ColumnType<uint32_t> { static const Column::Type type = Column::UINT32; };
+    template<> struct ColumnType<uint64_t> { static const Column::Type type = Column::UINT64; };
+    template<> struct ColumnType<float> { static const Column::Type type = Column::FLOAT; };
+    template<> struct ColumnType<double> { static const Column::Type type = Column::DOUBLE; };
+    template<> struct ColumnType<uint8_t> { static const Column::Type type = Column::BOOL; };
+
+    template<typename T> const T* Column::values() const {
+        if (ColumnType<T>::type != _type)
+            FATAL("Column ", _name, " has a different type");
+        return reinterpret_cast<const T*>(_values.data());
+    }
+
+    /// Struct-of-arrays representation of a batch of messages of one class
+
+    /// Has a Column per numeric (integer, floating point, bool and enum)
+    /// top level field of the class, or for the selected fields only.
+    /// Fields of other types are not represented.
+    /// The batch takes its class from the first message added to it.
+    class ColumnBatch
+    {
+        public:
+            /// Columns for the given fields, or all numeric fields if empty
+            ColumnBatch(const std::vector<std::string>& fields=std::vector<std::string>());
+
+            /// Clear the batch and read up to max_messages regular messages
+            /// from the stream into it. Messages of other classes are skipped.
+            /// The messages are not parsed, the columns are decoded from their
+            /// serialized form in the input buffers (InputStream::set_hint_copy
+            /// is set while reading and restored afterwards).
+            /// Returns the number of messages in the batch, which is 0 at the
+            /// end of the stream.
+            size_t read(InputStream& stream, size_t max_messages);
+
+            /// Append the values of a message.
+            /// Returns false and ignores messages of a different class.
+            bool add(const google::protobuf::Message& msg);
+
+            /// Append the values of a serialized message of the given class,
+            /// decoding only the fields of the columns. Packed repeated fields
+            /// are decoded in bulk, see varint.h.
+            /// Returns false and ignores messages of a different class.
+            bool add_serialized(const google::protobuf::Descriptor* d,
+                                const void* data, size_t size);
+
+            /// Remove all messages, keeping class and columns
+            void clear();
+
+            /// Number of messages in the batch
+            size_t size() const { return _size; }
+
+            /// Class of the messages, NULL before the first message
+            const google::protobuf::Descriptor* descriptor() const { return _descriptor; }
+
+            const std::vector<Column>& columns() const { return _columns; }
+
+            /// Column with the given field name, NULL if there is none
+            const Column* column(const std::string& name) const;
+
+            /// Append the batch to a column file, see below. Returns false on error.
+
+            /// A column file is a sequence of batches, which consist of
+            /// 64 bit aligned, little endian, native sized fields:
+            ///   char[8] "A4COLS01", uint64 batch size in bytes (including this header),
+            ///   uint64 messages, uint64 columns, then per column
+            ///     uint32 name length and the name, padded to 8 bytes,
+            ///     uint32 type (Column::Type), uint32 repeated,
+            ///     uint64 number of values, uint64 position of the values,
+            ///     uint64 position of the offsets (0 if not repeated),
+            /// followed by the values and offsets arrays, each padded to 8 bytes.
+            /// Positions are relative to the start of the batch, so the arrays
+            /// can be used in place when the file is memory-mapped.
+            bool write(std::ostream& out) const;
+
+        private:
+            bool set_class(const google::protobuf::Descriptor* d);
+            /// Append a message read with set_hint_copy, from the input buffer if possible
+            bool add_unread(const A4Message& msg);
+
+            std::vector<std::string> _fields;
+            const google::protobuf::Descriptor* _descriptor;
+            std::vector<Column> _columns;
+            /// Column index + 1 by field number, for small field numbers
+            std::vector<size_t> _by_number;
+            size_t _size;
+    };
+
+}
+}
+
+#endif
@@ -0,0 +1,101 @@
+#ifndef _A4_FIELD_PATH_H_
+#define _A4_FIELD_PATH_H_
+
+#include <string>
+#include <vector>
+
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/message.h>
+
+#include <a4/types.h>
+
+namespace a4 {
+namespace io {
+
+    /// Path to a field of a message class, possibly in sub messages
+    /// (e.g. "tracks.pt"), resolved once so that the values of many messages
+    /// can be read without looking up fields by name or allocating.
+
+    /// Every repeated field along the path multiplies the values: "tracks.pt"
+    /// has one value per track. Unset fields and sub messages have no values.
+    class FieldPath
+    {
+        public:
+            FieldPath() : _descriptor(NULL), _number(NULL), _repeated_number(NULL) {}
+
+            /// Resolve the dot separated path in the given class.
+            /// Fails if a field does not exist or is not a message in the middle of the path.
+            static FieldPath compile(const google::protobuf::Descriptor* d, const std::string& path);
+
+            const std::string& path() const { return _path; }
+
+            /// Class the path starts at, NULL for an empty FieldPath
+            const google::protobuf::Descriptor* descriptor() const { return _descriptor; }
+
+            /// Fields along the path, the last one holds the values
+            const std::vector<const google::protobuf::FieldDescriptor*>& fields() const { return _fields; }
+            const google::protobuf::FieldDescriptor* field() const { return _fields.back(); }
+
+            /// True if the values can be read as double (integers, floating
+            /// point numbers, bools and enums)
+            bool numeric() const { return _number; }
+
+            /// Call f(double) for every value of a numeric path in m,
+            /// which has to be of the class descriptor()
+            template<typename F> void for_each(const google::protobuf::Message& m, F f) const {
+                assert(numeric() && m.GetDescriptor() == _descriptor);
+                for_each_parent(m, 0, [this, &f](const google::protobuf::Message& parent) {
+                    const google::protobuf::FieldDescriptor* leaf = _fields.back();
+                    const google::protobuf::Reflection* r = parent.GetReflection();
+                    if (leaf->is_repeated()) {
+                        int size = r->FieldSize(parent, leaf);
+                        for (int i = 0; i < size; i++)
+                            f(_repeated_number(parent, leaf, i));
+                    } else if (r->HasField(parent, leaf)) {
+                        f(_number(parent, leaf));
+                    }
+                });
+            }
+
+            /// Number of values in m
+            size_t count(const google::protobuf::Message& m) const;
+
+            /// The values in m in string representation (see FieldContent::str()),
+            /// concatenated like A4Message::field_as_string(). Unset fields that
+            /// are not repeated give their default value.
+            std::string str(const google::protobuf::Message& m) const;
+
+        private:
+            typedef double (*Number)(const google::protobuf::Message& m,
+                                     const google::protobuf::FieldDescriptor* f);
+            typedef double (*RepeatedNumber)(const google::protobuf::Message& m,
+                                             const google::protobuf::FieldDescriptor* f, int i);
+
+            /// Call f with every message that contains the last field of the path
+            template<typename F> void for_each_parent(const google::protobuf::Message& m, size_t depth, const F& f) const {
+                if (depth + 1 == _fields.size()) {
+                    f(m);
+                    return;
+                }
+                const google::protobuf::FieldDescriptor* field = _fields[depth];
+                const google::protobuf::Reflection* r = m.GetReflection();
+                if (field->is_repeated()) {
+                    int size = r->FieldSize(m, field);
+                    for (int i = 0; i < size; i++)
+                        for_each_parent(r->GetRepeatedMessage(m, field, i), depth + 1, f);
+                } else if (r->HasField(m, field)) {
+                    for_each_parent(r->GetMessage(m, field), depth + 1, f);
+                }
+            }
+
+            std::string _path;
+            const google::protobuf::Descriptor* _descriptor;
+            std::vector<const google::protobuf::FieldDescriptor*> _fields;
+            Number _number;
+            RepeatedNumber _repeated_number;
+    };
+
+}
+}
+
+#endif
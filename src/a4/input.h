@@ -1,11 +1,13 @@
 #ifndef _A4_INPUT_H_
 #define _A4_INPUT_H_
 
+#include <atomic>
 #include <deque>
 #include <set>
 #include <unordered_set>
 
 #include <boost/thread.hpp>
+#include <boost/thread/tss.hpp>
 
 #include <a4/types.h>
 
@@ -31,6 +33,14 @@ namespace io {
             A4Input& add_stream(shared<InputStream>); 
             /// Add a file to be processed, Returns this object again.
             A4Input& add_file(const std::string& filename, bool check_duplicates=true);
+            /// Hand out files in parts of one metadata block each (see InputStream::split),
+            /// so that single large files can be processed by several threads.
+            A4Input& set_split_files(bool split=true) { _split_files = split; return *this; };
+            /// Schedule files on the given number of worker queues, largest first.
+            /// Each thread calling get_stream() takes work from its own queue and
+            /// steals the largest remaining unit from other queues when it runs dry.
+            /// Has to be called before the first call to get_stream().
+            A4Input& set_work_stealing(int workers);
 
             /// Get a stream resource for processing,
             /// returns NULL if none are left (threadsafe).
@@ -39,8 +49,25 @@ namespace io {
             /// if it is needed.
             shared<InputStream> get_stream();
         private:
+            /// File or part of a file, with its estimated size in bytes
+            struct WorkUnit {
+                uint64_t size;
+                std::string filename;
+                shared<InputStream> stream;
+            };
+            struct WorkQueue {
+                boost::mutex mutex;
+                std::deque<WorkUnit> units; // ordered by size, largest first
+                void push(const WorkUnit& unit);
+            };
+
             static void report_finished(A4Input *, InputStream* _s);
-            InputStream* pop_file();
+            InputStream* pop_file(boost::unique_lock<boost::mutex>& lock);
+            shared<InputStream> make_stream(InputStream* s);
+            void distribute_files();
+            bool take_unit(size_t worker, WorkUnit& unit);
+            void split_done();
+            shared<InputStream> get_stream_work_stealing();
             std::deque<std::string> _filenames;
             std::unordered_set<std::string> _filenames_set;
             std::vector<shared<InputStream>> _streams;
@@ -49,6 +76,15 @@ namespace io {
             std::set<InputStream*> _finished;
             std::set<InputStream*> _error;
             std::map<InputStream*,int> _resched_count;
+            bool _split_files;
+            std::atomic<int> _splitting; // files taken but not yet split
+            boost::condition_variable _work_added;
+
+            // work stealing scheduler
+            std::vector<shared<WorkQueue>> _queues;
+            bool _distributed;
+            size_t _next_worker;
+            boost::thread_specific_ptr<size_t> _worker;
             mutable boost::mutex _mutex;
     };
 
@@ -28,6 +28,11 @@ namespace io {
     /// Get the next non-metadata message by calling next(),
     /// after that you can get the current_metadata().
     /// Alternatively, call next(true)
+    ///
+    /// If the environment variable A4_DISCOVERY_CACHE is set to a directory,
+    /// the footers, ProtoClasses and metadata offsets found when opening a
+    /// local file are cached there, so that opening it again needs no scan
+    /// of the file.
     class InputStream
     {
         public:
@@ -56,12 +61,29 @@ namespace io {
             /// \internal Return the next bare message (includes stream messages)
             shared<A4Message> next_bare_message();
 
-            /// Return the currently applicable metadata message.
+            /// Return the currently applicable metadata message. Metadata that
+            /// is not read with the messages (backward metadata, or after a
+            /// seek) is read on demand, and the most recently used are kept.
             shared<const A4Message> current_metadata();
 
             /// Skip the current block until the next metadata
             bool skip_to_next_metadata();
 
+            /// Seek so that next() returns the n-th regular message of the file
+            /// (counting from 0). Fast if the file was written with an event index
+            /// (see OutputStream::set_event_index), otherwise the messages are read.
+            /// Returns false if there are not that many messages.
+            bool seek_to_event(uint64_t n);
+
+            /// Split into independent streams that read one metadata block each
+            /// (per header in concatenated files), or one chunk of it if the file
+            /// was written with OutputStream::set_chunk_size, with correct
+            /// current_metadata() for forward and backward metadata. The parts can be read on
+            /// different threads. Returns an empty vector if the stream can not
+            /// be split, e.g. if it is not a memory-mapped file.
+            /// Do not read from this stream after calling split().
+            std::vector<shared<InputStream>> split();
+
             /// True if new metadata has appeared since the last call to this function.
             bool new_metadata();
 
@@ -81,11 +103,55 @@ namespace io {
             std::string str();
             
             /// Return a vector containing a vector of metadata per x.
+            /// All metadata is read on the first call.
             const std::vector<std::vector<shared<a4::io::A4Message>>>& all_metadata();
             
             const std::vector<StreamFooter>& footers();
             
             std::vector<const google::protobuf::FileDescriptor*> get_filedescriptors();
+
+            /// Decompress LZ4/Snappy sections on the given number of threads,
+            /// keeping up to readahead_blocks blocks in flight (default: 2*threads).
+            /// Has no effect on zlib sections or unseekable streams; 0 disables it.
+            void set_parallel_decompression(int threads, int readahead_blocks=0);
+
+            /// If set, messages are only parsed when accessed. Messages written
+            /// to an OutputStream before the next message is read are then copied
+            /// without parsing or intermediate copies. Such a message is consumed
+            /// by the write: it can not be read, copied or written again
+            /// afterwards (see A4Message::consumed). Access it before writing
+            /// it if it is still needed.
+            void set_hint_copy(bool hint_copy);
+            bool hint_copy() const;
+
+            /// If set, the message returned by next() and its protobuf message
+            /// are reused for a later message once no reference to it is held
+            /// outside this stream. Keep the shared<A4Message> to keep a message;
+            /// pointers from message() or as<T>() are only valid as long as it
+            /// is held. Do not drop messages that are still used on other threads.
+            /// Ignored while set_hint_copy is active.
+            void set_recycle_messages(bool recycle);
+
+            /// Only parse the given fields of regular messages, e.g. "event_number"
+            /// or "jets.pt" for a field of a sub message. The other fields are
+            /// skipped without decoding them and are unset in the returned messages.
+            /// Classes that have none of the fields are parsed completely, as are
+            /// metadata and messages read with set_hint_copy.
+            /// An empty list switches the projection off.
+            void set_projection(const std::vector<std::string>& fields);
+
+            /// Skip the metadata blocks in which the given field has no value in
+            /// [min, max], according to the zone maps written with
+            /// OutputStream::set_zone_map_fields. Several filters must all match.
+            /// Blocks are read if the file has no zone map for the field, and
+            /// the messages of blocks that are read are not filtered. Messages
+            /// without the field count as not matching. Also applies to split().
+            /// Has to be called before reading; ignored on unseekable streams.
+            void add_zone_filter(const std::string& field, double min, double max);
+
+            /// Number of bytes the operating system is asked to read ahead of
+            /// the current position in the background (default 16 MB, 0 disables).
+            void set_readahead(size_t bytes);
             
         private:
             bool _new_metadata;
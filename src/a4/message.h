@@ -11,16 +11,15 @@ namespace protobuf {
     class Descriptor;
     class DescriptorPool;
     class Message;
-    namespace io {
-        class CodedInputStream;
-    }
 }
 }
 
 namespace a4 {
 namespace io {
+    class FrameReader;
     class ProtoClassPool;
     class ConstDynamicField;
+    class FieldPath;
     using google::protobuf::Message;
 
     /// Wrapped message returned from the InputStream
@@ -30,7 +29,7 @@ namespace io {
     class A4Message {
         public:
             /// Construct an A4Message of given size going to be read from the given stream
-            A4Message(uint32_t class_id, size_t size, weak_shared<google::protobuf::io::CodedInputStream> coded_in, shared<ProtoClassPool> pool);
+            A4Message(uint32_t class_id, size_t size, weak_shared<FrameReader> frames, shared<ProtoClassPool> pool);
 
             /// Constructs an read A4Message connected to a ProtoClassPool
             A4Message(uint32_t class_id, shared<Message> msg, shared<ProtoClassPool> pool);
@@ -99,8 +98,15 @@ namespace io {
             /// Invalidate any stream that is saved internally and force bytes to be read
             void invalidate_stream() const;
 
+            /// True if the message was copied from the input buffer without
+            /// reading it (see OutputStream::write), it can not be accessed anymore
+            bool consumed() const { return _consumed; }
+
             /// Return a field of this message in string representation
             std::string field_as_string(const std::string& field_name) const;
+            /// Same for a path compiled for the class of this message, which
+            /// avoids the lookup by name (see FieldPath)
+            std::string field_as_string(const FieldPath& path) const;
             std::string assert_field_is_single_value(const std::string& field_name) const;
             /// Returns true if the field specified by `field_name` can be merged in the two messages
             bool check_key_mergable(const A4Message& rhs, const std::string& field_name) const;
@@ -133,8 +139,8 @@ namespace io {
             /// is always a valid protobuf message.
             mutable bool _valid_bytes;
 
-            /// Coded input stream that this message can be read from
-            mutable weak_shared<google::protobuf::io::CodedInputStream> _coded_in;
+            /// Frame reader of the input stream that this message can be read from
+            mutable weak_shared<FrameReader> _frames;
 
             /// Encoded Message
             mutable std::string _bytes;
@@ -145,7 +151,19 @@ namespace io {
             /// True if the input stream has been read
             mutable bool _instream_read;
 
+            /// True if the bytes were taken from the input stream without keeping them
+            mutable bool _consumed;
+
+            /// Mark the bytes of an unread message as taken from the input buffer
+            void consume() const;
+
+            /// Turn this into a read message with the given contents, keeping
+            /// the allocated buffers (see InputStream::set_recycle_messages)
+            void recycle(uint32_t class_id, shared<Message> msg, shared<ProtoClassPool> pool);
+
             friend class OutputStream;
+            friend class InputStreamImpl;
+            friend class ColumnBatch;
     };
 };};
 
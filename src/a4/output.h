@@ -11,6 +11,7 @@ namespace a4 {
 namespace io {
 
     class OutputStream;
+    class SectionSink;
 
     /// Provides output streams to threads, and makes sure they are merged eventually.
     //
@@ -28,6 +29,20 @@ namespace io {
             bool close();
             /// Get a stream to write to (threadsafe).
             shared<OutputStream> get_stream(std::string postfix="", bool forward_metadata=false);
+            /// Let all streams write directly into the output file, instead of
+            /// into one temporary file each that is concatenated by close().
+            /// Every stream appends self-contained sections of about
+            /// section_bytes, ending at a metadata message, which it buffers
+            /// in memory (see OutputStream::set_section_sink for streams
+            /// without metadata). Has to be called before get_stream().
+            /// Ignored if the output is not a regular file.
+            void set_shared_file(uint64_t section_bytes = 16*1024*1024);
+            /// Let all streams hand their sections (see set_shared_file) to a
+            /// queue of at most queued_sections sections, from which a single
+            /// writer thread writes them to the output file. Streams wait while
+            /// the queue is full. Unlike the default, this allows any number of
+            /// streams on a fifo or stdout. Has to be called before get_stream().
+            void set_single_writer(uint64_t section_bytes = 16*1024*1024, size_t queued_sections = 4);
         private:
             static void report_finished(A4Output *, OutputStream* _s);
             bool concatenate(const std::vector<std::string>& filenames, const std::string target);
@@ -37,6 +52,9 @@ namespace io {
             std::string _description;
             std::map<std::string, std::vector<shared<OutputStream>>> _out_streams;
             std::map<std::string, std::vector<std::string>> _filenames;
+            uint64_t _section_bytes;
+            size_t _queued_sections;
+            std::map<std::string, shared<SectionSink>> _sinks;
             mutable boost::mutex _mutex;
     };
 
@@ -13,6 +13,7 @@
 namespace google {
 namespace protobuf {
     class Descriptor;
+    class FieldDescriptor;
     class Message;
     
     namespace io {
@@ -31,6 +32,8 @@ namespace io {
 
     class A4Message;
     class BaseCompressedOutputStream;
+    class SectionSink;
+    class ThreadPool;
 
     /// Class to write Messages to files or streams.
     /// To write a message belonging to a certain class
@@ -47,10 +50,17 @@ namespace io {
                            const std::string description=""); 
             ~OutputStream();
 
-            /// Write a message to the stream
+            /// Write a message to the stream.
+            /// Unread messages (see InputStream::set_hint_copy) are copied directly
+            /// from the input buffer, and can not be accessed afterwards.
             bool write(const google::protobuf::Message& m);
             bool write(shared<const A4Message> m);
 
+            /// Write all messages in [begin, end) to the stream.
+            /// The class is only looked up when it changes between messages.
+            template<typename Iterator>
+            bool write(Iterator begin, Iterator end);
+
             /// Write a metadata message to the stream
             /// Take care to respect the metadata message direction - forward means the events following
             bool metadata(const google::protobuf::Message& m);
@@ -81,9 +91,51 @@ namespace io {
             OutputStream& set_compression(std::string t, int level = 5) {
                 return set_compression(compression_type(t), level);
             };
+            /// Compress on the given number of threads (0 compresses in write()),
+            /// with up to blocks_in_flight blocks queued (default: 2*threads).
+            /// Files written this way can be read by any reader.
+            OutputStream& set_compression_threads(int threads, int blocks_in_flight = 0);
+
 
 
 
+            /// Record the position of every interval-th event in the footer,
+            /// which allows InputStream::seek_to_event() to jump close to it.
+            /// Has to be called before writing is begun.
+            OutputStream& set_event_index(uint32_t interval) { assert(!_opened); _event_index_interval = interval; return *this; };
+
+            /// Start a new independently decodable chunk after the given number of
+            /// uncompressed bytes or events of a metadata block, whichever comes first.
+            /// Zero disables the respective limit. In compressed streams every chunk
+            /// is a compressed section, in uncompressed ones it starts at a message.
+            /// Chunks are listed in the footer, and InputStream::split() reads them
+            /// as separate parts. Has to be called before writing is begun.
+            OutputStream& set_chunk_size(uint64_t bytes, uint64_t events = 0) {
+                assert(!_opened);
+                _chunk_bytes = bytes;
+                _chunk_events = events;
+                return *this;
+            };
+
+            /// Record the range of values of the given numeric fields of regular
+            /// messages per metadata block in the footer, so that readers can skip
+            /// blocks (see InputStream::add_zone_filter). Messages written from an
+            /// InputStream with set_hint_copy are parsed for this.
+            /// Has to be called before writing is begun.
+            OutputStream& set_zone_map_fields(const std::vector<std::string>& fields);
+
+            /// \internal Append to a destination shared with other streams
+            /// (a file or a queue to a writer thread) instead of writing a
+            /// file. The stream is written in sections (header to
+            /// footer) that are buffered in memory and appended at a metadata
+            /// message once they are larger than section_bytes, and on close().
+            /// Before the first forward metadata, sections end at any event.
+            /// Otherwise a section ends at an event once it reaches eight
+            /// times section_bytes (at least 1 MB) without metadata; the
+            /// events after that are not covered by the metadata of the
+            /// section, or with backward metadata by the next metadata.
+            /// Has to be called before writing is begun. \endinternal
+            OutputStream& set_section_sink(shared<SectionSink> sink, uint64_t section_bytes);
 
             /// If called, metadata will refer to the events following the metadata, instead of events before.
             /// Has to be called before writing is begun.
@@ -103,22 +155,68 @@ namespace io {
             bool write(uint32_t class_id, shared<const A4Message> m);
             bool write_header(std::string description);
             bool write_footer();
+            void start_section();
+            bool finish_section();
+            bool finish_section_if_full();
+            bool finish_section_at_event();
+            uint64_t section_size();
             bool start_compression();
             bool stop_compression();
 
             uint64_t get_bytes_written();
             void reset_coded_stream();
+            void add_event_index_position();
+            void start_event();
+            void start_chunk_if_full();
+            void start_zone_map_block();
+            void update_zone_maps(const google::protobuf::Message& m);
 
             std::string _output_name, _description;
             int _fileno;
             bool _compression;
             int _compression_level;
+            int _compression_threads, _compression_blocks_in_flight;
+            shared<ThreadPool> _compression_pool;
 
             CompressionType _compression_type;
             bool _opened, _closed;
             bool _metadata_refers_forward;
             std::vector<uint64_t> metadata_positions;
             std::vector<uint64_t> protoclass_positions;
+
+            struct EventIndexPosition {
+                uint64_t event, section_offset, inner_offset;
+                uint32_t metadata_index;
+            };
+            std::vector<EventIndexPosition> event_index_positions;
+            EventIndexPosition current_position();
+            uint32_t _event_index_interval;
+            uint64_t _event_count;
+            // start of the current compressed section, and the number of
+            // bytes written to it by previous coded streams
+            uint64_t _section_start, _section_bytes;
+
+            struct ZoneMapColumn {
+                std::string field;
+                std::vector<double> min, max;
+                std::vector<int64_t> null_count;
+            };
+            /// Statistics per field, the last entries are the current block
+            std::vector<ZoneMapColumn> _zone_maps;
+            const google::protobuf::Descriptor* _zone_map_descriptor;
+            std::vector<const google::protobuf::FieldDescriptor*> _zone_map_fields;
+
+            // sections appended to a shared file
+            shared<SectionSink> _section_sink;
+            uint64_t _section_bytes_limit;
+            uint32_t _sections_finished;
+            bool _events_cut_from_metadata;
+            std::string _section_buffer;
+
+            uint64_t _chunk_bytes, _chunk_events;
+            // start of the current chunk in uncompressed streams
+            uint64_t _chunk_start, _events_in_chunk;
+            std::vector<EventIndexPosition> chunk_positions;
             
             std::set<std::string> _written_file_descriptor_set;
             std::set<uint32_t> _written_classids;
@@ -134,6 +232,26 @@ namespace io {
             void set_written_classid(const uint32_t& classid) { _written_classids.insert(classid); }
     };
 
+    template<typename Iterator>
+    bool OutputStream::write(Iterator begin, Iterator end) {
+        if (!_opened) if(!open()) { return false; };
+        const google::protobuf::Descriptor* descriptor = NULL;
+        uint32_t class_id = 0;
+        for (Iterator it = begin; it != end; ++it) {
+            // a new section needs the ProtoClass again
+            uint32_t sections = _sections_finished;
+            if (_section_sink && !finish_section_at_event()) return false;
+            if ((*it).GetDescriptor() != descriptor || _sections_finished != sections) {
+                descriptor = (*it).GetDescriptor();
+                class_id = find_class_id(descriptor, false);
+            }
+            start_event();
+            if (!_zone_maps.empty()) update_zone_maps(*it);
+            if (!write(class_id, *it)) return false;
+        }
+        return true;
+    }
+
 }
 }
 
@@ -14,6 +14,7 @@ using std::numeric_limits;
 
 #include <boost/program_options.hpp>
 #include <boost/filesystem.hpp>
+#include <boost/thread.hpp>
 
 #include <google/protobuf/text_format.h>
 #include <google/protobuf/descriptor.h>
@@ -31,6 +32,7 @@ using google::protobuf::Reflection;
 #include <a4/input_stream.h>
 #include <a4/message.h>
 #include <a4/dynamic_message.h>
+#include <a4/field_path.h>
 
 #include <a4/io/A4Stream.pb.h>
 
@@ -90,7 +92,7 @@ public:
 class Stats {
 public:
     Stats() :
-        n(0), total(0), sum_of_squares(0),
+        n(0), total(0), total_uniq(0), sum_of_squares(0),
         min (numeric_limits<double>::max()),
         min1(numeric_limits<double>::max()),
         max (numeric_limits<double>::min()),
@@ -138,6 +140,26 @@ public:
         total_uniq += uniq;
     }
     
+    /// Add the values collected by other
+    void merge(const Stats& other) {
+        n += other.n;
+        total += other.total;
+        total_uniq += other.total_uniq;
+        sum_of_squares += other.sum_of_squares;
+        
+        // min1/max1 are the closest values to min/max seen by either
+        const double mins[] = {min, min1, other.min, other.min1};
+        const double maxs[] = {max, max1, other.max, other.max1};
+        min = std::min(min, other.min);
+        max = std::max(max, other.max);
+        min1 = numeric_limits<double>::max();
+        max1 = numeric_limits<double>::min();
+        foreach (double value, mins)
+            if (value > min && value < min1) min1 = value;
+        foreach (double value, maxs)
+            if (value < max && value > max1) max1 = value;
+    }
+    
     double mean() const {
         return total / n;
     }
@@ -165,71 +187,57 @@ public:
     
     /// Collect values from one message
     void collect(const Message& message) {
-        const Reflection* reflection = message.GetReflection();
+        auto it = _paths.find(message.GetDescriptor());
+        if (it == _paths.end()) {
+            it = _paths.insert(std::make_pair(message.GetDescriptor(), std::vector<StatsPath>())).first;
+            add_paths(message.GetDescriptor(), "", it->second);
+        }
         
-        std::vector<const FieldDescriptor*> fields;
-        reflection->ListFields(message, &fields);
-        foreach (const FieldDescriptor* field, fields) {
-
-
-            if (field->is_repeated()) {
-                int count = reflection->FieldSize(message, field);
-                for (int j = 0; j < count; j++) {
-            
-                    switch (field->cpp_type()) {
-#define HANDLE_TYPE(CPPTYPE, METHOD)                                           \
-                    case FieldDescriptor::CPPTYPE_##CPPTYPE:                           \
-                        stats[field].collect(reflection->GetRepeated##METHOD(message, field, j)); \
-                        break;
-                
-                    // Only handle numeric types
-                    HANDLE_TYPE(INT32 , Int32 );
-                    HANDLE_TYPE(INT64 , Int64 );
-                    HANDLE_TYPE(UINT32, UInt32);
-                    HANDLE_TYPE(UINT64, UInt64);
-                    HANDLE_TYPE(FLOAT , Float );
-                    HANDLE_TYPE(DOUBLE, Double);
-                    HANDLE_TYPE(BOOL  , Bool  );
-#undef HANDLE_TYPE
-
-                    case FieldDescriptor::CPPTYPE_MESSAGE:
-                        collect(reflection->GetRepeatedMessage(message, field, j));
-                        break;
-                        
-                    default:
-                        break;
-                    }
-                }
-            } else { // (not repeated)
-            
-                switch (field->cpp_type()) {
-#define HANDLE_TYPE(CPPTYPE, METHOD)                                           \
-                    case FieldDescriptor::CPPTYPE_##CPPTYPE:                           \
-                        if (reflection->HasField(message, field))                      \
-                            stats[field].collect(reflection->Get##METHOD(message, field)); \
-                        break;
-                
-                    // Only handle numeric types
-                    HANDLE_TYPE(INT32 , Int32 );
-                    HANDLE_TYPE(INT64 , Int64 );
-                    HANDLE_TYPE(UINT32, UInt32);
-                    HANDLE_TYPE(UINT64, UInt64);
-                    HANDLE_TYPE(FLOAT , Float );
-                    HANDLE_TYPE(DOUBLE, Double);
-                    HANDLE_TYPE(BOOL  , Bool  );
-#undef HANDLE_TYPE
-
-                    case FieldDescriptor::CPPTYPE_MESSAGE:
-                        collect(reflection->GetMessage(message, field));
-                        break;
-                        
-                    default:
-                        break;
-                }
+        foreach (StatsPath& path, it->second) {
+            path.path.for_each(message, [this, &path](double value) {
+                if (!path.stats)
+                    path.stats = &stats[path.path.field()];
+                path.stats->collect(value);
+            });
+        }
+    }
+    
+    /// Add the statistics collected by other
+    void merge(const StatsCollector& other) {
+        foreach (const auto& i, other.stats)
+            stats[i.first].merge(i.second);
+    }
+    
+private:
+    /// Numeric field, possibly in sub messages, and its stats once it had a value
+    struct StatsPath {
+        a4::io::FieldPath path;
+        Stats* stats;
+    };
+    std::unordered_map<const Descriptor*, std::vector<StatsPath>> _paths;
+    std::vector<const Descriptor*> _nesting;
+    
+    /// Compile paths to all numeric fields of d and its sub messages
+    void add_paths(const Descriptor* d, const std::string& prefix, std::vector<StatsPath>& paths) {
+        // Do not follow recursive message definitions
+        if (std::find(_nesting.begin(), _nesting.end(), d) != _nesting.end())
+            return;
+        _nesting.push_back(d);
+        for (int i = 0; i < d->field_count(); i++) {
+            const FieldDescriptor* field = d->field(i);
+            const std::string path = prefix + field->name();
+            if (field->cpp_type() == FieldDescriptor::CPPTYPE_MESSAGE) {
+                add_paths(field->message_type(), path + ".", paths);
+            } else if (field->cpp_type() != FieldDescriptor::CPPTYPE_ENUM) {
+                StatsPath stats_path = {a4::io::FieldPath::compile(_nesting[0], path), NULL};
+                if (stats_path.path.numeric())
+                    paths.push_back(stats_path);
             }
         }
+        _nesting.pop_back();
     }
     
+public:
     friend std::ostream& operator<< (std::ostream& o, StatsCollector const& sc) {
         typedef std::pair<const FieldDescriptor*, Stats> StatsItem;
         
@@ -360,28 +368,23 @@ bool any(const Container& container, const Predicate& pred) {
 class Selection
 {
 public:
-    Selection(const std::string& sel) : _desc(NULL), _field_desc(NULL) {
+    Selection(const std::string& sel) {
         auto pos = sel.find(":");
         _name = sel.substr(0, pos);
         _value = sel.substr(pos+1);
     }
     
     bool check(const Message& m) const {
-        if (_desc != m.GetDescriptor()) {
-            // Optimisation so we don't do the lookup every time
-            _desc = m.GetDescriptor();
-            _field_desc = _desc->FindFieldByName(_name);
-            if (!_field_desc)
-                FATAL("Unknown field name: ", _name);
-        }
+        // Optimisation so we don't do the lookup every time
+        if (_path.descriptor() != m.GetDescriptor())
+            _path = a4::io::FieldPath::compile(m.GetDescriptor(), _name);
         // HACK: Inefficient string comparison because it's the quickest implementation
-        return FieldContent(m, _field_desc).str() == _value;
+        return _path.str(m) == _value;
     }
     
     std::string _name, _value;
     
-    mutable const Descriptor* _desc;
-    mutable const FieldDescriptor* _field_desc;
+    mutable a4::io::FieldPath _path;
 };
 
 class CheckSelection {
@@ -521,16 +524,75 @@ bool dump_stream(shared<a4::io::InputStream> stream,
     return true;
 }
 
+/// Collect statistics of all regular messages of all inputs on several threads,
+/// each with its own collector, and print them together. The number of
+/// messages read by each thread is reported verbosely.
+bool collect_stats_parallel(a4::io::A4Input& in, int threads,
+                            const std::vector<Selection>& selections,
+                            const std::vector<std::string>& variables)
+{
+    StatsCollector total;
+    std::string error;
+    std::vector<size_t> thread_messages(threads, 0);
+    boost::mutex mutex;
+    
+    boost::thread_group workers;
+    for (int t = 0; t < threads; t++) {
+        workers.create_thread([&, t]() {
+            StatsCollector sc;
+            size_t messages = 0;
+            // Selections cache their field paths
+            std::vector<Selection> thread_selections(selections);
+            try {
+                while (shared<a4::io::InputStream> stream = in.get_stream()) {
+                    if (variables.size())
+                        stream->set_projection(variables);
+                    while (shared<A4Message> m = stream->next()) {
+                        messages++;
+                        if (!any(thread_selections, CheckSelection(*m->message())))
+                            sc.collect(*m->message());
+                    }
+                    if (stream->error())
+                        throw a4::Fatal("Error reading ", stream->str());
+                }
+            } catch (std::exception& e) {
+                // a4::Fatal as well as errors of the standard library
+                boost::unique_lock<boost::mutex> lock(mutex);
+                error = e.what();
+                return;
+            } catch (...) {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                error = "Unknown exception while collecting statistics";
+                return;
+            }
+            boost::unique_lock<boost::mutex> lock(mutex);
+            thread_messages[t] = messages;
+            total.merge(sc);
+        });
+    }
+    workers.join_all();
+    
+    if (!error.empty()) {
+        ERROR(error);
+        return false;
+    }
+    for (int t = 0; t < threads; t++)
+        VERBOSE("Thread ", t, " read ", thread_messages[t], " messages");
+    std::cout << total;
+    return true;
+}
+
 int main(int argc, char** argv) {
     a4::Fatal::enable_throw_on_segfault();
 
     namespace po = boost::program_options;
 
-    std::vector<std::string> input_files, selection_strings;
+    std::vector<std::string> input_files, selection_strings, variables;
     size_t event_count = 1, event_index = 0;
     bool collect_stats = false, short_form = false, message_info = false,
          internal_msg = false, dump_all = false, show_footer = false,
          show_metadata = false, dump_proto = false;
+    int threads = 1;
     
     DEBUG("argv[0] = ", argv[0]);
     
@@ -553,9 +615,11 @@ int main(int argc, char** argv) {
         ("number,n", po::value(&event_count), "maximum number to dump")
         ("internal,I", po::bool_switch(&internal_msg), "also dump stream internal messages")
         ("collect-stats,S", po::bool_switch(&collect_stats), "should collect statistics for all numeric variables")
+        ("threads,j", po::value(&threads), "with --collect-stats --all: read the inputs on this many threads and show the statistics of all inputs together")
         ("message-info,M", po::bool_switch(&message_info), "should collect statistics relating to the message")
         ("short-form,s", po::bool_switch(&short_form), "print in a compact form, one event per line")
         ("select", po::value(&selection_strings), "Select messages by string equality (e.g. --select event_number:1234)")
+        ("var,v", po::value(&variables), "only read these fields of events (e.g. -v event_number -v jets.pt)")
         ("footer,f", po::bool_switch(&show_footer), "Show information from the footer (e.g. object counts)")
         ("metadata,m", po::bool_switch(&show_metadata), "Show only metadata")
         ("proto,p", po::bool_switch(&dump_proto), "Dump .proto files")
@@ -587,7 +651,24 @@ int main(int argc, char** argv) {
     foreach (auto& selection_string, selection_strings)
         selections.push_back(Selection(selection_string));
         
+    // Selections need their fields to be read
+    if (variables.size()) {
+        foreach (auto& selection, selections)
+            variables.push_back(selection._name);
+    }
+    
+    if (threads > 1) {
+        FATAL_ASSERT(collect_stats && dump_all && !message_info && !internal_msg && !show_metadata && !dump_proto && event_index == 0,
+                     "--threads only works with --collect-stats --all");
+        // Also share the blocks of large files between the threads
+        in.set_split_files();
+        in.set_work_stealing(threads);
+        return collect_stats_parallel(in, threads, selections, variables) ? 0 : 1;
+    }
+
     while (shared<a4::io::InputStream> stream = in.get_stream()) {
+        if (variables.size())
+            stream->set_projection(variables);
         if (!dump_stream(stream, show_footer, internal_msg, collect_stats, 
                          message_info, dump_all, event_index, event_count, 
                          short_form, selections, show_metadata, dump_proto))
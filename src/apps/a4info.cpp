@@ -29,12 +29,25 @@ using google::protobuf::Reflection;
 #include <a4/output.h>
 #include <a4/output_stream.h>
 #include <a4/message.h>
+#include <a4/dynamic_message.h>
 
 
 void dump_message(const Message& message, const std::vector<std::string>& vars) {
     if (vars.size()) {
-        // specialized code
-        FATAL("Not implemented yet");
+        const Reflection* reflection = message.GetReflection();
+        foreach (const std::string& var, vars) {
+            const FieldDescriptor* field = message.GetDescriptor()->FindFieldByName(var);
+            if (!field)
+                FATAL("Unknown field name: ", var);
+            std::cout << var << ":";
+            if (field->is_repeated()) {
+                for (int i = 0; i < reflection->FieldSize(message, field); i++)
+                    std::cout << " " << a4::io::FieldContent(message, field, i).str();
+            } else if (reflection->HasField(message, field)) {
+                std::cout << " " << a4::io::FieldContent(message, field).str();
+            }
+            std::cout << std::endl;
+        }
     } else {
         std::string str;
         google::protobuf::TextFormat::PrintToString(message, &str);
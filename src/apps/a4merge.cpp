@@ -0,0 +1,232 @@
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include <iostream>
+
+#include <boost/program_options.hpp>
+#include <boost/thread.hpp>
+
+#include <a4/input_stream.h>
+#include <a4/output.h>
+#include <a4/output_stream.h>
+#include <a4/message.h>
+
+using a4::io::A4Message;
+using a4::io::InputStream;
+
+/// Metadata of the inputs, reduced pairwise until one message is left.
+/// Reduction keeps the order of the inputs, so MERGE_APPEND fields
+/// are in the order of the input files.
+/// The streams opened to read the metadata are handed on to copy the
+/// events, so that every input is only discovered once. At most max_open
+/// of them are kept open ahead of the one taken last.
+class MetadataReduction {
+    public:
+        MetadataReduction(const std::vector<std::string>& inputs, int threads, size_t max_open)
+            : _inputs(inputs), _threads(threads), _merged(inputs.size()), _failed(false),
+              _streams(inputs.size()), _ready(inputs.size(), false), _taken(0), _max_open(max_open) {}
+
+        /// Merge the metadata of all inputs. Returns NULL if there is none.
+        shared<A4Message> run() {
+            parallel(_inputs.size(), &MetadataReduction::merge_file);
+            for (size_t n = _merged.size(); n > 1; n = (n + 1) / 2) {
+                parallel(n / 2, &MetadataReduction::merge_pair);
+                for (size_t i = 0; i < n / 2; i++)
+                    _merged[i] = _merged[2*i];
+                if (n % 2)
+                    _merged[n / 2] = _merged[n - 1];
+            }
+            if (_failed)
+                FATAL(_error);
+            return _merged.empty() ? shared<A4Message>() : _merged[0];
+        }
+
+        /// Stream of input i with its metadata read, in the order of the inputs.
+        /// Waits until it is ready, returns NULL if the reduction failed before.
+        shared<InputStream> take_stream(size_t i) {
+            boost::unique_lock<boost::mutex> lock(_mutex);
+            _taken = i + 1;
+            _stream_taken.notify_all();
+            while (!_ready[i] && !_failed)
+                _stream_ready.wait(lock);
+            shared<InputStream> in;
+            in.swap(_streams[i]);
+            return in;
+        }
+
+    private:
+        typedef void (MetadataReduction::*Task)(size_t i);
+
+        /// Run task(0) to task(count-1) on up to _threads threads
+        void parallel(size_t count, Task task) {
+            std::atomic<size_t> next(0);
+            boost::thread_group workers;
+            for (int t = 0; t < _threads && size_t(t) < count; t++)
+                workers.create_thread([this, &next, count, task]() {
+                    for (size_t i = next++; i < count && !_failed; i = next++) {
+                        try {
+                            (this->*task)(i);
+                        } catch (std::exception& e) {
+                            // a4::Fatal as well as errors of the standard library
+                            fail(e.what());
+                        }
+                    }
+                });
+            workers.join_all();
+        }
+
+        void fail(const std::string& error) {
+            boost::unique_lock<boost::mutex> lock(_mutex);
+            if (!_failed)
+                _error = error;
+            _failed = true;
+            _stream_ready.notify_all();
+            _stream_taken.notify_all();
+        }
+
+        /// Merge all metadata of input i into _merged[i]
+        void merge_file(size_t i) {
+            {
+                boost::unique_lock<boost::mutex> lock(_mutex);
+                while (i >= _taken + _max_open && !_failed)
+                    _stream_taken.wait(lock);
+            }
+            shared<InputStream> in(new InputStream(_inputs[i]));
+            shared<A4Message> merged;
+            foreach (const auto& header, in->all_metadata()) {
+                foreach (const auto& metadata, header) {
+                    if (merged)
+                        *merged += *metadata;
+                    else
+                        merged.reset(new A4Message(*metadata));
+                }
+            }
+            if (in->error())
+                throw a4::Fatal("Could not read metadata from ", _inputs[i]);
+            _merged[i] = merged;
+
+            boost::unique_lock<boost::mutex> lock(_mutex);
+            _streams[i] = in;
+            _ready[i] = true;
+            _stream_ready.notify_all();
+        }
+
+        /// Merge _merged[2*i+1] into _merged[2*i]
+        void merge_pair(size_t i) {
+            shared<A4Message>& left = _merged[2*i];
+            shared<A4Message>& right = _merged[2*i + 1];
+            if (!left)
+                left = right;
+            else if (right)
+                *left += *right;
+            right.reset();
+        }
+
+        const std::vector<std::string>& _inputs;
+        int _threads;
+        std::vector<shared<A4Message>> _merged;
+        std::atomic<bool> _failed;
+        std::string _error;
+        boost::mutex _mutex;
+
+        std::vector<shared<InputStream>> _streams;
+        std::vector<bool> _ready;
+        size_t _taken, _max_open;
+        boost::condition_variable _stream_ready, _stream_taken;
+};
+
+int main(int argc, char ** argv) {
+    a4::Fatal::enable_throw_on_segfault();
+
+    namespace po = boost::program_options;
+
+    std::vector<std::string> input_files;
+    std::string output_file, compression;
+    int threads, level;
+
+    po::positional_options_description p;
+    p.add("input", -1);
+
+    po::options_description commandline_options("Allowed options");
+    commandline_options.add_options()
+        ("help,h", "produce help message")
+        ("output,o", po::value(&output_file), "output file name ('-' for stdout)")
+        ("threads,j", po::value(&threads)->default_value(boost::thread::hardware_concurrency()), "number of threads")
+        ("compression,C", po::value(&compression)->default_value("ZLIB"), "compression of the output (UNCOMPRESSED, ZLIB, SNAPPY, LZ4)")
+        ("level,l", po::value(&level)->default_value(5), "compression level")
+        ("input", po::value(&input_files), "input file names")
+    ;
+
+    po::variables_map arguments;
+    po::store(po::command_line_parser(argc, argv).
+              options(commandline_options).positional(p).run(), arguments);
+    po::notify(arguments);
+
+    if (arguments.count("help") || !arguments.count("input") || !arguments.count("output"))
+    {
+        std::cout << "Usage: " << argv[0] << " [Options] -o output input(s)" << std::endl;
+        std::cout << "Copies the events of all inputs unchanged into one block of the output," << std::endl;
+        std::cout << "followed by the metadata of all inputs merged according to their merge options." << std::endl;
+        std::cout << commandline_options << std::endl;
+        return 1;
+    }
+    if (threads < 1)
+        threads = 1;
+    // Split the threads between reading metadata, which is quick, and
+    // decompressing and compressing events
+    const int reduction_threads = std::max(1, threads / 4);
+    const int compression_threads = (threads - reduction_threads) / 2;
+    const int decompression_threads = threads - reduction_threads - compression_threads;
+
+    // The metadata is merged on its own threads while the events are copied,
+    // from the streams that were opened for it
+    MetadataReduction reduction(input_files, reduction_threads, 2*reduction_threads);
+    shared<A4Message> metadata;
+    std::string metadata_error;
+    boost::thread reduction_thread([&]() {
+        try {
+            metadata = reduction.run();
+        } catch (std::exception& e) {
+            metadata_error = e.what();
+        }
+    });
+
+    a4::io::A4Output out(output_file, "a4merge");
+    shared<a4::io::OutputStream> outs = out.get_stream();
+    outs->set_compression(compression, level);
+    // Streams to a fifo or stdout are opened by get_stream() and compress in write()
+    if (compression_threads > 1 && !outs->opened())
+        outs->set_compression_threads(compression_threads);
+
+    bool success = true;
+    for (size_t i = 0; i < input_files.size(); i++) {
+        const std::string& filename = input_files[i];
+        shared<InputStream> in = reduction.take_stream(i);
+        if (!in) {
+            // the reduction failed, which is reported below
+            success = false;
+            break;
+        }
+        in->set_hint_copy(true);
+        if (decompression_threads > 1)
+            in->set_parallel_decompression(decompression_threads);
+        while (shared<A4Message> msg = in->next())
+            success = outs->write(msg) && success;
+        if (in->error()) {
+            ERROR("Could not read events from ", filename);
+            success = false;
+        }
+    }
+
+    reduction_thread.join();
+    if (!metadata_error.empty()) {
+        ERROR("Could not merge metadata: ", metadata_error);
+        success = false;
+    } else if (metadata) {
+        success = outs->metadata(*metadata->message()) && success;
+    }
+    success = out.close() && success;
+    return success ? 0 : 1;
+}
@@ -0,0 +1,82 @@
+#include <string>
+#include <vector>
+
+#include <iostream>
+#include <fstream>
+
+#include <boost/program_options.hpp>
+
+#include <google/protobuf/descriptor.h>
+
+#include <a4/input.h>
+#include <a4/input_stream.h>
+#include <a4/columns.h>
+
+int main(int argc, char ** argv) {
+    a4::Fatal::enable_throw_on_segfault();
+
+    namespace po = boost::program_options;
+
+    std::vector<std::string> input_files, variables;
+    std::string output_file;
+    size_t batch_size = 0;
+
+    po::positional_options_description p;
+    p.add("input", -1);
+
+    po::options_description commandline_options("Allowed options");
+    commandline_options.add_options()
+        ("help,h", "produce help message")
+        ("input", po::value(&input_files), "input file names")
+        ("output,o", po::value(&output_file), "output column file name")
+        ("var,v", po::value(&variables), "variables to convert (defaults to all numeric ones)")
+        ("batch-size,b", po::value(&batch_size)->default_value(65536), "messages per batch")
+    ;
+
+    po::variables_map arguments;
+    po::store(po::command_line_parser(argc, argv).
+              options(commandline_options).positional(p).run(), arguments);
+    po::notify(arguments);
+
+    if (arguments.count("help") || !arguments.count("input") || !arguments.count("output"))
+    {
+        std::cout << "Usage: " << argv[0] << " [Options] -o output input(s)" << std::endl;
+        std::cout << "Writes the regular messages of the first class found in the inputs" << std::endl;
+        std::cout << "as batches of columns (see a4/columns.h), other classes are skipped." << std::endl;
+        std::cout << commandline_options << std::endl;
+        return 1;
+    }
+    if (batch_size == 0)
+        FATAL("Batch size must be positive");
+
+    std::ofstream out(output_file.c_str(), std::ios::binary);
+    if (!out)
+        FATAL("Could not open ", output_file);
+
+    a4::io::A4Input in;
+    foreach (std::string filename, input_files)
+        in.add_file(filename);
+
+    a4::io::ColumnBatch batch(variables);
+    size_t messages = 0, batches = 0;
+    while (shared<a4::io::InputStream> stream = in.get_stream()) {
+        while (batch.read(*stream, batch_size)) {
+            if (!batch.write(out))
+                FATAL("Could not write to ", output_file);
+            messages += batch.size();
+            batches++;
+        }
+        if (stream->error())
+            FATAL("Error reading ", stream->str());
+    }
+    out.close();
+    if (!out)
+        FATAL("Could not write to ", output_file);
+
+    if (batch.descriptor())
+        std::cout << "Wrote " << messages << " " << batch.descriptor()->full_name()
+                  << " messages in " << batches << " batches of "
+                  << batch.columns().size() << " columns" << std::endl;
+    else
+        std::cout << "No messages found" << std::endl;
+}
@@ -0,0 +1,441 @@
+#include <ostream>
+
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/message.h>
+#include <google/protobuf/wire_format_lite.h>
+#include <google/protobuf/io/coded_stream.h>
+
+#include <a4/columns.h>
+#include <a4/input_stream.h>
+#include <a4/message.h>
+
+#include "frame_reader.h"
+#include "varint.h"
+
+using google::protobuf::Descriptor;
+using google::protobuf::FieldDescriptor;
+using google::protobuf::Message;
+using google::protobuf::Reflection;
+using google::protobuf::internal::WireFormatLite;
+using google::protobuf::io::CodedInputStream;
+
+namespace a4{ namespace io{
+
+    bool Column::type_of(const FieldDescriptor* field, Type& type) {
+        switch (field->cpp_type()) {
+            case FieldDescriptor::CPPTYPE_INT32: type = INT32; return true;
+            case FieldDescriptor::CPPTYPE_INT64: type = INT64; return true;
+            case FieldDescriptor::CPPTYPE_UINT32: type = UINT32; return true;
+            case FieldDescriptor::CPPTYPE_UINT64: type = UINT64; return true;
+            case FieldDescriptor::CPPTYPE_FLOAT: type = FLOAT; return true;
+            case FieldDescriptor::CPPTYPE_DOUBLE: type = DOUBLE; return true;
+            case FieldDescriptor::CPPTYPE_BOOL: type = BOOL; return true;
+            case FieldDescriptor::CPPTYPE_ENUM: type = INT32; return true;
+            default: return false;
+        }
+    }
+
+    template<typename T> static uint64_t bits(T value) {
+        uint64_t b = 0;
+        memcpy(&b, &value, sizeof(T));
+        return b;
+    }
+
+    Column::Column(const FieldDescriptor* field) :
+        _field(NULL), _name(field->name()), _repeated(field->is_repeated())
+    {
+        if (!type_of(field, _type))
+            FATAL("Field ", field->full_name(), " is not numeric and can not be a column");
+        switch (_type) {
+            case INT64: case UINT64: case DOUBLE: _value_size = 8; break;
+            case BOOL: _value_size = 1; break;
+            default: _value_size = 4;
+        }
+        set_field(field);
+        clear();
+    }
+
+    void Column::set_field(const FieldDescriptor* field) {
+        _field = field;
+        switch (field->type()) {
+            case FieldDescriptor::TYPE_FIXED32:
+            case FieldDescriptor::TYPE_SFIXED32:
+            case FieldDescriptor::TYPE_FLOAT:
+                _wire_type = WireFormatLite::WIRETYPE_FIXED32; break;
+            case FieldDescriptor::TYPE_FIXED64:
+            case FieldDescriptor::TYPE_SFIXED64:
+            case FieldDescriptor::TYPE_DOUBLE:
+                _wire_type = WireFormatLite::WIRETYPE_FIXED64; break;
+            default:
+                _wire_type = WireFormatLite::WIRETYPE_VARINT;
+        }
+        _zigzag = field->type() == FieldDescriptor::TYPE_SINT32
+               || field->type() == FieldDescriptor::TYPE_SINT64;
+        _default = 0;
+        if (_repeated)
+            return;
+        switch (field->cpp_type()) {
+            case FieldDescriptor::CPPTYPE_INT32: _default = bits(field->default_value_int32()); break;
+            case FieldDescriptor::CPPTYPE_INT64: _default = bits(field->default_value_int64()); break;
+            case FieldDescriptor::CPPTYPE_UINT32: _default = bits(field->default_value_uint32()); break;
+            case FieldDescriptor::CPPTYPE_UINT64: _default = bits(field->default_value_uint64()); break;
+            case FieldDescriptor::CPPTYPE_FLOAT: _default = bits(field->default_value_float()); break;
+            case FieldDescriptor::CPPTYPE_DOUBLE: _default = bits(field->default_value_double()); break;
+            case FieldDescriptor::CPPTYPE_BOOL: _default = field->default_value_bool(); break;
+            case FieldDescriptor::CPPTYPE_ENUM: _default = bits(field->default_value_enum()->number()); break;
+            default: break;
+        }
+    }
+
+    void Column::clear() {
+        _values.clear();
+        _offsets.clear();
+        if (_repeated)
+            _offsets.push_back(0);
+    }
+
+    template<typename T> void Column::push(T value) {
+        const char* p = reinterpret_cast<const char*>(&value);
+        _values.insert(_values.end(), p, p + sizeof(T));
+    }
+
+    void Column::add(const Message& msg) {
+        const Reflection* r = msg.GetReflection();
+        const FieldDescriptor* f = _field;
+        if (_repeated) {
+            int n = r->FieldSize(msg, f);
+            _values.reserve(_values.size() + n*_value_size);
+            for (int i = 0; i < n; i++) {
+                switch (f->cpp_type()) {
+                    case FieldDescriptor::CPPTYPE_INT32: push(r->GetRepeatedInt32(msg, f, i)); break;
+                    case FieldDescriptor::CPPTYPE_INT64: push(r->GetRepeatedInt64(msg, f, i)); break;
+                    case FieldDescriptor::CPPTYPE_UINT32: push(r->GetRepeatedUInt32(msg, f, i)); break;
+                    case FieldDescriptor::CPPTYPE_UINT64: push(r->GetRepeatedUInt64(msg, f, i)); break;
+                    case FieldDescriptor::CPPTYPE_FLOAT: push(r->GetRepeatedFloat(msg, f, i)); break;
+                    case FieldDescriptor::CPPTYPE_DOUBLE: push(r->GetRepeatedDouble(msg, f, i)); break;
+                    case FieldDescriptor::CPPTYPE_BOOL: push<uint8_t>(r->GetRepeatedBool(msg, f, i)); break;
+                    case FieldDescriptor::CPPTYPE_ENUM: push<int32_t>(r->GetRepeatedEnum(msg, f, i)->number()); break;
+                    default: break;
+                }
+            }
+            _offsets.push_back(size());
+        } else {
+            switch (f->cpp_type()) {
+                case FieldDescriptor::CPPTYPE_INT32: push(r->GetInt32(msg, f)); break;
+                case FieldDescriptor::CPPTYPE_INT64: push(r->GetInt64(msg, f)); break;
+                case FieldDescriptor::CPPTYPE_UINT32: push(r->GetUInt32(msg, f)); break;
+                case FieldDescriptor::CPPTYPE_UINT64: push(r->GetUInt64(msg, f)); break;
+                case FieldDescriptor::CPPTYPE_FLOAT: push(r->GetFloat(msg, f)); break;
+                case FieldDescriptor::CPPTYPE_DOUBLE: push(r->GetDouble(msg, f)); break;
+                case FieldDescriptor::CPPTYPE_BOOL: push<uint8_t>(r->GetBool(msg, f)); break;
+                case FieldDescriptor::CPPTYPE_ENUM: push<int32_t>(r->GetEnum(msg, f)->number()); break;
+                default: break;
+            }
+        }
+    }
+
+    // Values are stored in host byte order, these copy the low bytes of a
+    // 64 bit value and assume a little endian machine.
+
+    void Column::add_default() {
+        const char* p = reinterpret_cast<const char*>(&_default);
+        _values.insert(_values.end(), p, p + _value_size);
+    }
+
+    const uint8_t* Column::decode(const uint8_t* p, const uint8_t* end) {
+        uint64_t v = 0;
+        if (_wire_type == WireFormatLite::WIRETYPE_VARINT) {
+            p = read_varint(p, end, &v);
+            if (!p)
+                return NULL;
+            if (_zigzag && _value_size == 4)
+                v = WireFormatLite::ZigZagDecode32(uint32_t(v));
+            else if (_zigzag)
+                v = WireFormatLite::ZigZagDecode64(v);
+            else if (_type == BOOL)
+                v = v != 0;
+        } else {
+            if (size_t(end - p) < _value_size)
+                return NULL;
+            memcpy(&v, p, _value_size);
+            p += _value_size;
+        }
+        // the last value of a field that is not repeated wins
+        if (_repeated)
+            _values.resize(_values.size() + _value_size);
+        memcpy(&_values[_values.size() - _value_size], &v, _value_size);
+        return p;
+    }
+
+    const uint8_t* Column::decode_packed(const uint8_t* p, const uint8_t* end) {
+        uint64_t length;
+        p = read_varint(p, end, &length);
+        if (!p || length > uint64_t(end - p))
+            return NULL;
+        const uint8_t* begin = p;
+        p += length;
+        if (_wire_type != WireFormatLite::WIRETYPE_VARINT) {
+            if (length % _value_size)
+                return NULL;
+            _values.insert(_values.end(), begin, p);
+            return p;
+        }
+        if (_type == BOOL) {
+            while (begin < p) {
+                uint64_t v;
+                begin = read_varint(begin, p, &v);
+                if (!begin)
+                    return NULL;
+                _values.push_back(v != 0);
+            }
+            return p;
+        }
+        const VarintKernels& kernels = varint_kernels();
+        size_t n = kernels.count(begin, p);
+        size_t old = _values.size();
+        _values.resize(old + n * _value_size);
+        if (_value_size == 4) {
+            uint32_t* out = reinterpret_cast<uint32_t*>(&_values[old]);
+            if (kernels.decode32(begin, p, out) != int64_t(n))
+                return NULL;
+            if (_zigzag)
+                kernels.zigzag32(out, n);
+        } else {
+            uint64_t* out = reinterpret_cast<uint64_t*>(&_values[old]);
+            if (kernels.decode64(begin, p, out) != int64_t(n))
+                return NULL;
+            if (_zigzag)
+                kernels.zigzag64(out, n);
+        }
+        return p;
+    }
+
+    ColumnBatch::ColumnBatch(const std::vector<std::string>& fields) :
+        _fields(fields), _descriptor(NULL), _size(0) {}
+
+    bool ColumnBatch::add(const Message& msg) {
+        if (!set_class(msg.GetDescriptor()))
+            return false;
+        foreach (Column& c, _columns)
+            c.add(msg);
+        _size++;
+        return true;
+    }
+
+    static const size_t max_indexed_field = 4096;
+
+    /// Set up or check the columns for messages of class d
+    bool ColumnBatch::set_class(const Descriptor* d) {
+        if (d != _descriptor) {
+            if (!_descriptor) {
+                if (_fields.empty()) {
+                    for (int i = 0; i < d->field_count(); i++) {
+                        Column::Type type;
+                        if (Column::type_of(d->field(i), type))
+                            _columns.push_back(Column(d->field(i)));
+                    }
+                } else {
+                    foreach (const std::string& name, _fields) {
+                        const FieldDescriptor* field = d->FindFieldByName(name);
+                        if (!field)
+                            FATAL("Unknown field ", name, " in ", d->full_name());
+                        _columns.push_back(Column(field));
+                    }
+                }
+            } else if (d->full_name() == _descriptor->full_name()) {
+                // Same class from another header, e.g. a new dynamic pool
+                foreach (Column& c, _columns) {
+                    const FieldDescriptor* field = d->FindFieldByNumber(c._field->number());
+                    Column::Type type;
+                    if (!field || field->name() != c._name || !Column::type_of(field, type)
+                        || type != c._type || field->is_repeated() != c._repeated)
+                        FATAL("Field ", c._name, " of ", d->full_name(), " changed between headers");
+                    c.set_field(field);
+                }
+            } else {
+                return false;
+            }
+            _descriptor = d;
+            _by_number.clear();
+            for (size_t i = 0; i < _columns.size(); i++) {
+                size_t number = _columns[i]._field->number();
+                if (number >= max_indexed_field)
+                    continue;
+                if (number >= _by_number.size())
+                    _by_number.resize(number + 1, 0);
+                _by_number[number] = i + 1;
+            }
+        }
+        return true;
+    }
+
+    static const uint8_t* skip_field(uint64_t tag, const uint8_t* p, const uint8_t* end) {
+        uint64_t v;
+        switch (WireFormatLite::GetTagWireType(tag)) {
+            case WireFormatLite::WIRETYPE_VARINT:
+                return read_varint(p, end, &v);
+            case WireFormatLite::WIRETYPE_FIXED64:
+                return end - p >= 8 ? p + 8 : NULL;
+            case WireFormatLite::WIRETYPE_FIXED32:
+                return end - p >= 4 ? p + 4 : NULL;
+            case WireFormatLite::WIRETYPE_LENGTH_DELIMITED:
+                p = read_varint(p, end, &v);
+                return p && v <= uint64_t(end - p) ? p + v : NULL;
+            case WireFormatLite::WIRETYPE_START_GROUP: {
+                CodedInputStream in(p, end - p);
+                if (!WireFormatLite::SkipField(&in, tag))
+                    return NULL;
+                return p + in.CurrentPosition();
+            }
+            default:
+                return NULL;
+        }
+    }
+
+    bool ColumnBatch::add_serialized(const Descriptor* d, const void* data, size_t size) {
+        if (!set_class(d))
+            return false;
+        foreach (Column& c, _columns)
+            if (!c._repeated)
+                c.add_default();
+
+        const uint8_t* p = static_cast<const uint8_t*>(data);
+        const uint8_t* end = p + size;
+        while (p < end) {
+            uint64_t tag;
+            p = read_varint(p, end, &tag);
+            if (p && tag <= UINT32_MAX) {
+                uint64_t number = tag >> 3;
+                Column* c = NULL;
+                if (number < _by_number.size()) {
+                    if (_by_number[number])
+                        c = &_columns[_by_number[number] - 1];
+                } else if (number >= max_indexed_field) {
+                    foreach (Column& column, _columns) {
+                        if (uint64_t(column._field->number()) == number)
+                            c = &column;
+                    }
+                }
+                int wire_type = WireFormatLite::GetTagWireType(tag);
+                if (c && wire_type == c->_wire_type)
+                    p = c->decode(p, end);
+                else if (c && c->_repeated && wire_type == WireFormatLite::WIRETYPE_LENGTH_DELIMITED)
+                    p = c->decode_packed(p, end);
+                else
+                    p = skip_field(tag, p, end);
+            } else {
+                p = NULL;
+            }
+            if (!p)
+                FATAL("Corrupt serialized message of class ", d->full_name());
+        }
+
+        foreach (Column& c, _columns)
+            if (c._repeated)
+                c._offsets.push_back(c.size());
+        _size++;
+        return true;
+    }
+
+    void ColumnBatch::clear() {
+        foreach (Column& c, _columns)
+            c.clear();
+        _size = 0;
+    }
+
+    const Column* ColumnBatch::column(const std::string& name) const {
+        foreach (const Column& c, _columns)
+            if (c.name() == name)
+                return &c;
+        return NULL;
+    }
+
+    size_t ColumnBatch::read(InputStream& stream, size_t max_messages) {
+        clear();
+        const bool hint_copy = stream.hint_copy();
+        stream.set_hint_copy(true);
+        try {
+            while (_size < max_messages) {
+                shared<A4Message> msg = stream.next();
+                if (!msg)
+                    break;
+                add_unread(*msg);
+            }
+        } catch (...) {
+            stream.set_hint_copy(hint_copy);
+            throw;
+        }
+        stream.set_hint_copy(hint_copy);
+        return _size;
+    }
+
+    bool ColumnBatch::add_unread(const A4Message& msg) {
+        auto frames = msg._frames.lock();
+        const void* data = NULL;
+        int buffered = 0;
+        if (msg._instream_read || !frames || !frames->GetDirectBufferPointer(&data, &buffered)
+                || size_t(buffered) < msg._size) {
+            // already read, or spread over several buffers
+            const std::string& bytes = msg.bytes();
+            return add_serialized(msg.descriptor(), bytes.data(), bytes.size());
+        }
+        // Decode straight from the input buffer, the message is consumed afterwards
+        bool added = add_serialized(msg.descriptor(), data, msg._size);
+        frames->Skip(msg._size);
+        msg.consume();
+        return added;
+    }
+
+    static uint64_t padded(uint64_t size) {
+        return (size + 7) & ~uint64_t(7);
+    }
+
+    template<typename T> static void put(std::ostream& out, T value) {
+        out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    static void pad(std::ostream& out, uint64_t size) {
+        static const char zeros[8] = {0};
+        out.write(zeros, padded(size) - size);
+    }
+
+    bool ColumnBatch::write(std::ostream& out) const {
+        uint64_t header = 32;
+        foreach (const Column& c, _columns)
+            header += padded(4 + c.name().size()) + 32;
+
+        std::vector<uint64_t> values_pos, offsets_pos;
+        uint64_t pos = header;
+        foreach (const Column& c, _columns) {
+            values_pos.push_back(pos);
+            pos += padded(c._values.size());
+            offsets_pos.push_back(c.repeated() ? pos : 0);
+            pos += c._offsets.size() * sizeof(uint64_t);
+        }
+
+        out.write("A4COLS01", 8);
+        put<uint64_t>(out, pos);
+        put<uint64_t>(out, _size);
+        put<uint64_t>(out, _columns.size());
+        for (size_t i = 0; i < _columns.size(); i++) {
+            const Column& c = _columns[i];
+            put<uint32_t>(out, c.name().size());
+            out.write(c.name().data(), c.name().size());
+            pad(out, 4 + c.name().size());
+            put<uint32_t>(out, c.type());
+            put<uint32_t>(out, c.repeated());
+            put<uint64_t>(out, c.size());
+            put<uint64_t>(out, values_pos[i]);
+            put<uint64_t>(out, offsets_pos[i]);
+        }
+        foreach (const Column& c, _columns) {
+            out.write(c._values.data(), c._values.size());
+            pad(out, c._values.size());
+            if (c.repeated())
+                out.write(reinterpret_cast<const char*>(c._offsets.data()),
+                          c._offsets.size() * sizeof(uint64_t));
+        }
+        return out.good();
+    }
+
+};};
@@ -5,6 +5,12 @@
 
 #include <iostream>
 #include <cmath>
+#include <cstring>
+#include <algorithm>
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/locks.hpp>
 
 #include <google/protobuf/stubs/common.h>
 
@@ -16,14 +22,19 @@ using google::protobuf::io::CodedOutputStream;
 #include <snappy.h>
 #endif
 
+#include <zlib.h>
+
 #include "lz4.h"
 
 #include "compressed_stream.h"
+#include "thread_pool.h"
+#include "zero_copy_resource.h"
 
 namespace a4 {
 namespace io {
 
 const size_t BLOCKSIZE = 64 * 1024;
+const int kMaxVarint32Bytes = 5;
 
 GenericCompressionInputStream::GenericCompressionInputStream(
     ZeroCopyInputStream* sub_stream)
@@ -38,7 +49,18 @@ GenericCompressionInputStream::~GenericCompressionInputStream() {
 }
 
 bool GenericCompressionInputStream::Skip(int count) {
-    assert(false);
+    const void* data;
+    int size;
+    while (count > 0) {
+        if (!Next(&data, &size))
+            return false;
+        if (size > count) {
+            BackUp(size - count);
+            return true;
+        }
+        count -= size;
+    }
+    return true;
 };
 
 void GenericCompressionInputStream::BackUp(int count) {
@@ -62,7 +84,8 @@ bool GenericCompressionInputStream::Next(const void** data, int* size) {
     }
     
     uint32_t compressed_size = 0;
-    assert(_sub_stream->ReadVarint32(&compressed_size));
+    if (!_sub_stream->ReadVarint32(&compressed_size))
+        return false;
     assert(compressed_size < BLOCKSIZE*10);
     shared<char> tempbuffer(new char[compressed_size], array_delete<char>()); 
     _sub_stream->ReadRaw(tempbuffer.get(), compressed_size);
@@ -70,6 +93,7 @@ bool GenericCompressionInputStream::Next(const void** data, int* size) {
     RawUncompress(tempbuffer.get(), compressed_size);
     
     reset_input_stream(); // TODO(ebke): probably call this every Limit/BLOCKSIZE
+    _byte_count += _output_buffer_size;
     
     (*size) = _output_buffer_size;
     (*data) = _output_buffer.get();
@@ -99,6 +123,11 @@ void GenericCompressionOutputStream::BackUp(int count) {
     _backed_up_bytes += count;
 }
 
+int64_t GenericCompressionOutputStream::ByteCount() const {
+    if (!_input_buffer) return _byte_count;
+    return _byte_count + BLOCKSIZE - _backed_up_bytes;
+}
+
 bool GenericCompressionOutputStream::Flush()
 {
     size_t size = BLOCKSIZE - _backed_up_bytes;
@@ -113,7 +142,8 @@ bool GenericCompressionOutputStream::Flush()
     uint32_t compressed_size_32 = static_cast<uint32_t>(compressed_size);
     _sub_stream->WriteVarint32(compressed_size_32);
     _sub_stream->WriteRaw(compressed_data.get(), compressed_size_32);
-        
+
+    _byte_count += size;
     _backed_up_bytes = 0;
     _input_buffer.reset();
     return true;
@@ -141,24 +171,29 @@ bool GenericCompressionOutputStream::Next(void** data, int* size) {
 
 /// Snappy implementation
 
+bool SnappyRawUncompress(const char* input_buffer, uint32_t compressed_size,
+                         shared<char>& output_buffer, size_t& output_size) {
+    if (!::snappy::GetUncompressedLength(input_buffer, compressed_size, &output_size))
+        return false;
+    if (output_size > BLOCKSIZE)
+        return false;
+    output_buffer.reset(new char[output_size], array_delete<char>());
+    return ::snappy::RawUncompress(input_buffer, compressed_size, output_buffer.get());
+}
+
 void SnappyInputStream::RawUncompress(char* input_buffer, uint32_t compressed_size) {
-    bool success = ::snappy::GetUncompressedLength(
-        input_buffer, compressed_size, &_output_buffer_size);
+    bool success = SnappyRawUncompress(input_buffer, compressed_size,
+        _output_buffer, _output_buffer_size);
     assert(success);
-    
-    _output_buffer.reset(new char[_output_buffer_size], array_delete<char>());
-    success = ::snappy::RawUncompress(input_buffer, compressed_size,
-        _output_buffer.get());
-    assert(success);    
 }
 
 
-uint32_t SnappyOutputStream::MaxCompressedLength(size_t input_size)
+uint32_t SnappyMaxCompressedLength(size_t input_size)
 {
     return ::snappy::MaxCompressedLength(input_size);
 }
 
-uint32_t SnappyOutputStream::RawCompress(char* input_buffer, size_t input_size,
+uint32_t SnappyRawCompress(const char* input_buffer, size_t input_size,
     char* output_buffer)
 {
     size_t compressed_size = 0;
@@ -167,28 +202,389 @@ uint32_t SnappyOutputStream::RawCompress(char* input_buffer, size_t input_size,
     return compressed_size;
 }
 
+uint32_t SnappyOutputStream::MaxCompressedLength(size_t input_size)
+{
+    return SnappyMaxCompressedLength(input_size);
+}
+
+uint32_t SnappyOutputStream::RawCompress(char* input_buffer, size_t input_size,
+    char* output_buffer)
+{
+    return SnappyRawCompress(input_buffer, input_size, output_buffer);
+}
+
 #endif  // HAVE_SNAPPY
 
 /// LZ4 implementation
 
+bool LZ4RawUncompress(const char* input_buffer, uint32_t compressed_size,
+                      shared<char>& output_buffer, size_t& output_size) {
+    output_buffer.reset(new char[BLOCKSIZE], array_delete<char>());
+    int result = LZ4_uncompress_unknownOutputSize(input_buffer,
+        output_buffer.get(), compressed_size, BLOCKSIZE);
+    if (result <= 0)
+        return false;
+    output_size = result;
+    return true;
+}
+
 void LZ4InputStream::RawUncompress(char* input_buffer, uint32_t compressed_size) {
-    _output_buffer.reset(new char[BLOCKSIZE], array_delete<char>());
-    _output_buffer_size = LZ4_uncompress_unknownOutputSize(input_buffer,
-        _output_buffer.get(), compressed_size, BLOCKSIZE);
+    LZ4RawUncompress(input_buffer, compressed_size, _output_buffer, _output_buffer_size);
 }
 
-uint32_t LZ4OutputStream::MaxCompressedLength(size_t input_size)
+uint32_t LZ4MaxCompressedLength(size_t input_size)
 {
     return LZ4_compressBound(input_size);
 }
 
-uint32_t LZ4OutputStream::RawCompress(char* input_buffer, size_t input_size,
+uint32_t LZ4RawCompress(const char* input_buffer, size_t input_size,
     char* output_buffer)
 {
     assert(input_size);
     return ::LZ4_compress(input_buffer, output_buffer, input_size);
 }
 
+uint32_t LZ4OutputStream::MaxCompressedLength(size_t input_size)
+{
+    return LZ4MaxCompressedLength(input_size);
+}
+
+uint32_t LZ4OutputStream::RawCompress(char* input_buffer, size_t input_size,
+    char* output_buffer)
+{
+    return LZ4RawCompress(input_buffer, input_size, output_buffer);
+}
+
+// =========================================================================
+
+struct ParallelDecompressionInputStream::Block {
+    Block() : compressed_size(0), output_size(0), end_position(0), done(false), ok(false) {}
+    shared<char> compressed;
+    uint32_t compressed_size;
+    shared<char> output;
+    size_t output_size;
+    uint64_t end_position; // position in the sub stream after this block
+    bool done, ok;
+};
+
+// Shared with the decompression tasks, which may outlive the stream
+struct ParallelDecompressionInputStream::State {
+    boost::mutex mutex;
+    boost::condition_variable block_done;
+};
+
+typedef boost::unique_lock<boost::mutex> Lock;
+
+static void decompress_block(shared<ParallelDecompressionInputStream::State> state,
+                             shared<ParallelDecompressionInputStream::Block> block,
+                             RawUncompressFunction uncompress) {
+    shared<char> output;
+    size_t output_size = 0;
+    bool ok = uncompress(block->compressed.get(), block->compressed_size, output, output_size);
+    {
+        Lock lock(state->mutex);
+        block->output = output;
+        block->output_size = output_size;
+        block->ok = ok;
+        block->done = true;
+        block->compressed.reset();
+    }
+    state->block_done.notify_all();
+}
+
+ParallelDecompressionInputStream::ParallelDecompressionInputStream(
+    ZeroCopyStreamResource* sub_stream, RawUncompressFunction uncompress,
+    shared<ThreadPool> pool, int readahead)
+    : _raw_stream(sub_stream), _sub_stream(NULL), _uncompress(uncompress),
+      _pool(pool), _state(new State()), _readahead(readahead), _exhausted(false),
+      _backed_up_bytes(0), _byte_count(0) {
+    assert(_raw_stream->seekable());
+    assert(_readahead > 0);
+    _sub_stream_start = _raw_stream->ByteCount();
+    _consumed_position = _sub_stream_start;
+    _sub_stream = new CodedInputStream(_raw_stream);
+    _sub_stream->SetTotalBytesLimit(pow(1024,3), pow(1024,3));
+}
+
+ParallelDecompressionInputStream::~ParallelDecompressionInputStream() {
+    delete _sub_stream;
+    // Blocks still being decompressed only reference the shared state,
+    // so they can be left to finish on their own.
+    _raw_stream->Seek(_consumed_position);
+}
+
+void ParallelDecompressionInputStream::reset_sub_stream() {
+    delete _sub_stream;
+    _sub_stream_start = _raw_stream->ByteCount();
+    _sub_stream = new CodedInputStream(_raw_stream);
+    _sub_stream->SetTotalBytesLimit(pow(1024,3), pow(1024,3));
+}
+
+void ParallelDecompressionInputStream::read_ahead() {
+    while (!_exhausted && _blocks.size() < _readahead) {
+        // The end of the section is not marked in the block stream,
+        // so anything that does not look like a block ends the readahead.
+        uint32_t compressed_size = 0;
+        if (!_sub_stream->ReadVarint32(&compressed_size) ||
+            compressed_size == 0 || compressed_size >= BLOCKSIZE*10) {
+            _exhausted = true;
+            break;
+        }
+        shared<Block> block(new Block());
+        block->compressed.reset(new char[compressed_size], array_delete<char>());
+        block->compressed_size = compressed_size;
+        if (!_sub_stream->ReadRaw(block->compressed.get(), compressed_size)) {
+            _exhausted = true;
+            break;
+        }
+        block->end_position = _sub_stream_start + _sub_stream->CurrentPosition();
+        _blocks.push_back(block);
+        _pool->submit(boost::bind(&decompress_block, _state, block, _uncompress));
+
+        if (size_t(_sub_stream->CurrentPosition()) > BLOCKSIZE*1024)
+            reset_sub_stream();
+    }
+}
+
+bool ParallelDecompressionInputStream::Next(const void** data, int* size) {
+    if (_backed_up_bytes) {
+        size_t skip = _current->output_size - _backed_up_bytes;
+        (*data) = _current->output.get() + skip;
+        (*size) = _backed_up_bytes;
+        _backed_up_bytes = 0;
+        return true;
+    }
+
+    read_ahead();
+    if (_blocks.empty())
+        return false;
+    shared<Block> block = _blocks.front();
+    _blocks.pop_front();
+    // Keep the workers busy while we wait for this block
+    read_ahead();
+
+    {
+        Lock lock(_state->mutex);
+        while (!block->done)
+            _state->block_done.wait(lock);
+    }
+    if (!block->ok) {
+        // Either corruption or we speculatively read past the end of the
+        // section - in both cases the reader has to give up here.
+        _exhausted = true;
+        _blocks.clear();
+        return false;
+    }
+    _current = block;
+    _consumed_position = block->end_position;
+    _byte_count += block->output_size;
+
+    (*size) = block->output_size;
+    (*data) = block->output.get();
+    return true;
+}
+
+void ParallelDecompressionInputStream::BackUp(int count) {
+    _backed_up_bytes += count;
+}
+
+bool ParallelDecompressionInputStream::Skip(int count) {
+    const void* data;
+    int size;
+    while (count > 0) {
+        if (!Next(&data, &size))
+            return false;
+        if (size > count) {
+            BackUp(size - count);
+            return true;
+        }
+        count -= size;
+    }
+    return true;
+}
+
+// =========================================================================
+
+struct ParallelCompressionOutputStream::State {
+    boost::mutex mutex;
+    boost::condition_variable block_done;
+};
+
+static void compress_block_task(ParallelCompressionOutputStream* stream,
+                                void (ParallelCompressionOutputStream::*compress)(ParallelCompressionOutputStream::Block&),
+                                shared<ParallelCompressionOutputStream::State> state,
+                                shared<ParallelCompressionOutputStream::Block> block) {
+    (stream->*compress)(*block);
+    {
+        Lock lock(state->mutex);
+        block->done = true;
+    }
+    state->block_done.notify_all();
+}
+
+ParallelCompressionOutputStream::ParallelCompressionOutputStream(
+    ZeroCopyOutputStream* sub_stream, shared<ThreadPool> pool, int max_blocks_in_flight)
+    : _sub_stream(new CodedOutputStream(sub_stream)), _pool(pool), _state(new State()),
+      _max_blocks_in_flight(max_blocks_in_flight), _last_input_size(0),
+      _backed_up_bytes(0), _byte_count(0) {
+    assert(_max_blocks_in_flight > 0);
+}
+
+ParallelCompressionOutputStream::~ParallelCompressionOutputStream() {
+    if (_input_buffer || !_pending.empty()) {
+        // Blocks still in the pool call the virtual compress_block()
+        FATAL("Call ParallelCompressionOutputStream::Flush() before destroying "
+              "this object");
+    }
+    delete _sub_stream;
+}
+
+int64_t ParallelCompressionOutputStream::ByteCount() const {
+    if (!_input_buffer) return _byte_count;
+    return _byte_count + BLOCKSIZE - _backed_up_bytes;
+}
+
+void ParallelCompressionOutputStream::BackUp(int count) {
+    _backed_up_bytes += count;
+}
+
+void ParallelCompressionOutputStream::WriteRaw(const void* data, int size) {
+    _sub_stream->WriteRaw(data, size);
+}
+
+bool ParallelCompressionOutputStream::Next(void** data, int* size) {
+    if (_backed_up_bytes) {
+        size_t skip = BLOCKSIZE - _backed_up_bytes;
+        (*data) = _input_buffer.get() + skip;
+        (*size) = _backed_up_bytes;
+        _backed_up_bytes = 0;
+        return true;
+    }
+    if (_input_buffer) {
+        submit_block();
+        write_blocks(_max_blocks_in_flight - 1);
+    }
+    _input_buffer.reset(new char[BLOCKSIZE], array_delete<char>());
+    (*data) = _input_buffer.get();
+    (*size) = BLOCKSIZE;
+    return true;
+}
+
+bool ParallelCompressionOutputStream::Flush() {
+    if (_input_buffer)
+        submit_block();
+    write_blocks(0);
+    return true;
+}
+
+void ParallelCompressionOutputStream::submit_block() {
+    size_t size = BLOCKSIZE - _backed_up_bytes;
+    _backed_up_bytes = 0;
+    shared<char> input = _input_buffer;
+    _input_buffer.reset();
+    if (size == 0) return;
+
+    shared<Block> block(new Block());
+    block->input = input;
+    block->input_size = size;
+    block->dictionary = _last_input_buffer;
+    block->dictionary_size = _last_input_size;
+    _last_input_buffer = input;
+    _last_input_size = size;
+    _byte_count += size;
+
+    _pending.push_back(block);
+    _pool->submit(boost::bind(&compress_block_task, this,
+        &ParallelCompressionOutputStream::compress_block, _state, block));
+}
+
+void ParallelCompressionOutputStream::write_blocks(size_t max_pending) {
+    while (!_pending.empty()) {
+        shared<Block> block = _pending.front();
+        {
+            Lock lock(_state->mutex);
+            if (!block->done && _pending.size() <= max_pending)
+                return;
+            while (!block->done)
+                _state->block_done.wait(lock);
+        }
+        _pending.pop_front();
+        WriteRaw(block->output.get(), block->output_size);
+        block_written(*block);
+    }
+}
+
+void ParallelBlockCompressionOutputStream::compress_block(Block& block) {
+    size_t max_size = _max_length(block.input_size) + kMaxVarint32Bytes;
+    block.output.reset(new char[max_size], array_delete<char>());
+    uint8_t* compressed = reinterpret_cast<uint8_t*>(block.output.get()) + kMaxVarint32Bytes;
+    uint32_t compressed_size = _compress(block.input.get(), block.input_size,
+                                         reinterpret_cast<char*>(compressed));
+    // Put the size prefix right in front of the compressed data
+    uint8_t prefix[kMaxVarint32Bytes];
+    size_t prefix_size = CodedOutputStream::WriteVarint32ToArray(compressed_size, prefix) - prefix;
+    memcpy(compressed - prefix_size, prefix, prefix_size);
+    block.output = shared<char>(block.output, reinterpret_cast<char*>(compressed - prefix_size));
+    block.output_size = prefix_size + compressed_size;
+}
+
+ParallelZlibOutputStream::ParallelZlibOutputStream(ZeroCopyOutputStream* sub_stream,
+    int compression_level, shared<ThreadPool> pool, int max_blocks_in_flight)
+    : ParallelCompressionOutputStream(sub_stream, pool, max_blocks_in_flight),
+      _compression_level(compression_level), _adler(adler32(0, NULL, 0)), _closed(false) {
+    // zlib header: deflate with 32k window and the level hint zlib would write
+    int level_hint = compression_level < 2 ? 0 : compression_level < 6 ? 1 :
+                     compression_level == 6 ? 2 : 3;
+    unsigned char header[2] = {0x78, static_cast<unsigned char>(level_hint << 6)};
+    header[1] += 31 - ((header[0] << 8) + header[1]) % 31;
+    WriteRaw(header, 2);
+}
+
+void ParallelZlibOutputStream::compress_block(Block& block) {
+    z_stream z;
+    z.zalloc = Z_NULL;
+    z.zfree = Z_NULL;
+    z.opaque = Z_NULL;
+    int error = deflateInit2(&z, _compression_level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+    assert(error == Z_OK);
+    if (block.dictionary) {
+        size_t dictionary_size = std::min(block.dictionary_size, size_t(32*1024));
+        deflateSetDictionary(&z, reinterpret_cast<Bytef*>(block.dictionary.get())
+            + block.dictionary_size - dictionary_size, dictionary_size);
+    }
+    // Room for the sync flush marker and an empty block on top of the bound
+    size_t max_size = deflateBound(&z, block.input_size) + 16;
+    block.output.reset(new char[max_size], array_delete<char>());
+    z.next_in = reinterpret_cast<Bytef*>(block.input.get());
+    z.avail_in = block.input_size;
+    z.next_out = reinterpret_cast<Bytef*>(block.output.get());
+    z.avail_out = max_size;
+    error = deflate(&z, Z_SYNC_FLUSH);
+    assert(error == Z_OK && z.avail_in == 0 && z.avail_out > 0);
+    block.output_size = max_size - z.avail_out;
+    deflateEnd(&z);
+    block.check = adler32(adler32(0, NULL, 0),
+        reinterpret_cast<Bytef*>(block.input.get()), block.input_size);
+    // The dictionary is not needed anymore, do not keep the buffer alive
+    block.dictionary.reset();
+}
+
+void ParallelZlibOutputStream::block_written(const Block& block) {
+    _adler = adler32_combine(_adler, block.check, block.input_size);
+}
+
+bool ParallelZlibOutputStream::Close() {
+    if (_closed) return true;
+    Flush();
+    // final empty block with fixed huffman codes, then the checksum
+    unsigned char trailer[6] = {0x03, 0x00,
+        static_cast<unsigned char>(_adler >> 24), static_cast<unsigned char>(_adler >> 16),
+        static_cast<unsigned char>(_adler >> 8), static_cast<unsigned char>(_adler)};
+    WriteRaw(trailer, 6);
+    _closed = true;
+    return true;
+}
+
 }  // namespace io
 }  // namespace a4
 
@@ -12,12 +12,39 @@ using google::protobuf::io::ZeroCopyOutputStream;
 using google::protobuf::io::CodedInputStream;
 using google::protobuf::io::CodedOutputStream;
 
+#include <deque>
+
 #include <a4/types.h>
 #include <base_compressed_streams.h>
 
 namespace a4 {
 namespace io {
 
+class ThreadPool;
+class ZeroCopyStreamResource;
+
+// Uncompress a single block into a freshly allocated output buffer.
+// Returns false if the block is corrupt.
+typedef bool (*RawUncompressFunction)(const char* input_buffer, uint32_t compressed_size,
+                                      shared<char>& output_buffer, size_t& output_size);
+
+// Compress a single block into output_buffer, which has to provide room for
+// MaxCompressedLength(input_size) bytes. Returns the compressed size.
+typedef uint32_t (*RawCompressFunction)(const char* input_buffer, size_t input_size,
+                                        char* output_buffer);
+typedef uint32_t (*MaxCompressedLengthFunction)(size_t input_size);
+
+bool LZ4RawUncompress(const char* input_buffer, uint32_t compressed_size,
+                      shared<char>& output_buffer, size_t& output_size);
+uint32_t LZ4RawCompress(const char* input_buffer, size_t input_size, char* output_buffer);
+uint32_t LZ4MaxCompressedLength(size_t input_size);
+#ifdef HAVE_SNAPPY
+bool SnappyRawUncompress(const char* input_buffer, uint32_t compressed_size,
+                         shared<char>& output_buffer, size_t& output_size);
+uint32_t SnappyRawCompress(const char* input_buffer, size_t input_size, char* output_buffer);
+uint32_t SnappyMaxCompressedLength(size_t input_size);
+#endif
+
 // A ZeroCopyInputStream that reads compressed data through GenericCompression
 class GenericCompressionInputStream : public BaseCompressedInputStream {
  public:
@@ -31,7 +58,7 @@ class GenericCompressionInputStream : public BaseCompressedInputStream {
   bool Next(const void** data, int* size);
   void BackUp(int count);
   bool Skip(int count);
-  int64_t ByteCount() const { return _byte_count; }
+  int64_t ByteCount() const { return _byte_count - _backed_up_bytes; }
 
   virtual void RawUncompress(char* input_buffer, uint32_t compressed_size) = 0;
   
@@ -61,7 +88,7 @@ class GenericCompressionOutputStream : public BaseCompressedOutputStream {
   // implements ZeroCopyOutputStream ---------------------------------
   bool Next(void** data, int* size);
   void BackUp(int count);
-  int64_t ByteCount() const { return _byte_count; };
+  int64_t ByteCount() const;
 
   bool Flush();
   bool Close() {return true; }
@@ -126,6 +153,154 @@ class LZ4OutputStream : public GenericCompressionOutputStream {
   GOOGLE_DISALLOW_EVIL_CONSTRUCTORS(LZ4OutputStream);
 };
 
+// A ZeroCopyInputStream that reads the same length-prefixed blocks as
+// GenericCompressionInputStream, but hands the blocks following the current
+// one to a ThreadPool for decompression and returns them in order.
+//
+// Since the end of a compressed section is only known after parsing the
+// uncompressed data, blocks are read ahead speculatively. The sub stream
+// therefore has to be seekable: on destruction it is repositioned to the end
+// of the last block that was actually returned by Next().
+class ParallelDecompressionInputStream : public BaseCompressedInputStream {
+ public:
+  ParallelDecompressionInputStream(ZeroCopyStreamResource* sub_stream,
+                                   RawUncompressFunction uncompress,
+                                   shared<ThreadPool> pool, int readahead);
+  virtual ~ParallelDecompressionInputStream();
+
+  // implements ZeroCopyInputStream ----------------------------------
+  bool Next(const void** data, int* size);
+  void BackUp(int count);
+  bool Skip(int count);
+  int64_t ByteCount() const { return _byte_count - _backed_up_bytes; }
+
+  struct Block;
+  struct State;
+
+ private:
+  void read_ahead();
+  void reset_sub_stream();
+
+  ZeroCopyStreamResource* _raw_stream;
+  CodedInputStream* _sub_stream;
+  RawUncompressFunction _uncompress;
+  shared<ThreadPool> _pool;
+  shared<State> _state;
+  std::deque<shared<Block> > _blocks;
+  shared<Block> _current;
+
+  size_t _readahead;
+  bool _exhausted;
+  uint64_t _sub_stream_start;
+  uint64_t _consumed_position;
+
+  int _backed_up_bytes;
+  int64_t _byte_count;
+
+  GOOGLE_DISALLOW_EVIL_CONSTRUCTORS(ParallelDecompressionInputStream);
+};
+
+// A ZeroCopyOutputStream that hands filled input blocks to a ThreadPool for
+// compression and writes the results to the sub stream in order.
+// At most max_blocks_in_flight blocks are queued; beyond that, Next() waits
+// for the oldest block to be written.
+//
+// Like GenericCompressionOutputStream, call Flush() and Close() before
+// destroying the stream, since compress_block() is virtual.
+class ParallelCompressionOutputStream : public BaseCompressedOutputStream {
+ public:
+  ParallelCompressionOutputStream(ZeroCopyOutputStream* sub_stream,
+                                  shared<ThreadPool> pool, int max_blocks_in_flight);
+  virtual ~ParallelCompressionOutputStream();
+
+  // implements ZeroCopyOutputStream ---------------------------------
+  bool Next(void** data, int* size);
+  void BackUp(int count);
+  int64_t ByteCount() const;
+
+  // Compress the current block and wait until everything is written.
+  bool Flush();
+  virtual bool Close() { return Flush(); }
+
+  struct Block {
+    Block() : input_size(0), dictionary_size(0), output_size(0), check(0), done(false) {}
+    shared<char> input;
+    size_t input_size;
+    // tail of the previous block, for compressors that keep a window
+    shared<char> dictionary;
+    size_t dictionary_size;
+    shared<char> output;
+    size_t output_size;
+    uint32_t check;
+    bool done;
+  };
+  struct State;
+
+ protected:
+  // Called on a worker thread: fill block.output from block.input.
+  virtual void compress_block(Block& block) = 0;
+  // Called in order on the writing thread, after block.output has been written.
+  virtual void block_written(const Block&) {}
+
+  void WriteRaw(const void* data, int size);
+
+ private:
+  void submit_block();
+  void write_blocks(size_t max_pending);
+
+  CodedOutputStream* _sub_stream;
+  shared<ThreadPool> _pool;
+  shared<State> _state;
+  std::deque<shared<Block> > _pending;
+  size_t _max_blocks_in_flight;
+
+  shared<char> _input_buffer;
+  shared<char> _last_input_buffer;
+  size_t _last_input_size;
+  int _backed_up_bytes;
+  int64_t _byte_count;
+
+  GOOGLE_DISALLOW_EVIL_CONSTRUCTORS(ParallelCompressionOutputStream);
+};
+
+// Writes the same length-prefixed blocks as GenericCompressionOutputStream.
+class ParallelBlockCompressionOutputStream : public ParallelCompressionOutputStream {
+ public:
+  ParallelBlockCompressionOutputStream(ZeroCopyOutputStream* sub_stream,
+                                       RawCompressFunction compress,
+                                       MaxCompressedLengthFunction max_length,
+                                       shared<ThreadPool> pool, int max_blocks_in_flight)
+    : ParallelCompressionOutputStream(sub_stream, pool, max_blocks_in_flight),
+      _compress(compress), _max_length(max_length) {}
+
+ protected:
+  void compress_block(Block& block);
+
+ private:
+  RawCompressFunction _compress;
+  MaxCompressedLengthFunction _max_length;
+};
+
+// Writes a single zlib stream, like GzipOutputStream in ZLIB format.
+// Blocks are deflated independently, primed with the last 32k of the previous
+// block as dictionary and ended by a sync flush, so they can be concatenated.
+// The adler32 checksums of the blocks are combined for the stream trailer.
+class ParallelZlibOutputStream : public ParallelCompressionOutputStream {
+ public:
+  ParallelZlibOutputStream(ZeroCopyOutputStream* sub_stream, int compression_level,
+                           shared<ThreadPool> pool, int max_blocks_in_flight);
+  bool Close();
+
+ protected:
+  void compress_block(Block& block);
+  void block_written(const Block& block);
+
+ private:
+  int _compression_level;
+  uint32_t _adler;
+  bool _closed;
+};
+
 }  // namespace io
 }  // namespace protobuf
 
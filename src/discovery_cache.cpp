@@ -0,0 +1,96 @@
+#include <cstdio>
+#include <cstdlib>
+#include <climits>
+#include <fstream>
+#include <sstream>
+
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <boost/filesystem.hpp>
+
+#include <a4/io/A4Stream.pb.h>
+
+#include "discovery_cache.h"
+
+namespace a4{ namespace io{
+
+    /// FNV-1a, stable across runs and platforms
+    static uint64_t path_hash(const std::string& s) {
+        uint64_t h = 14695981039346656037ULL;
+        for (size_t i = 0; i < s.size(); i++) {
+            h ^= static_cast<unsigned char>(s[i]);
+            h *= 1099511628211ULL;
+        }
+        return h;
+    }
+
+    DiscoveryCacheEntry::DiscoveryCacheEntry(const std::string& stream_name) :
+        _device(0), _inode(0), _size(0), _mtime_ns(0)
+    {
+        const char* directory = getenv("A4_DISCOVERY_CACHE");
+        if (!directory || !*directory)
+            return;
+
+        std::string name = stream_name;
+        std::string proto = name.substr(0, 7);
+        if (proto == "file://" or proto == "nomm://")
+            name = name.substr(7);
+        else if (name.substr(0, 8) == "uring://")
+            name = name.substr(8);
+        else if (name == "-" or name.find("://") != std::string::npos)
+            return;
+
+        char real[PATH_MAX];
+        struct stat buffer;
+        if (!realpath(name.c_str(), real) || stat(real, &buffer) == -1 || !S_ISREG(buffer.st_mode))
+            return;
+        _file = real;
+        _device = buffer.st_dev;
+        _inode = buffer.st_ino;
+        _size = buffer.st_size;
+        _mtime_ns = int64_t(buffer.st_mtim.tv_sec) * 1000000000 + buffer.st_mtim.tv_nsec;
+
+        std::stringstream entry;
+        entry << directory << "/" << std::hex << path_hash(_file) << ".a4discovery";
+        _entry_path = entry.str();
+    }
+
+    bool DiscoveryCacheEntry::load(DiscoveryCache& cache) const {
+        if (!enabled())
+            return false;
+        std::ifstream in(_entry_path.c_str(), std::ios::binary);
+        if (!in || !cache.ParseFromIstream(&in))
+            return false;
+        return cache.path() == _file && cache.device() == _device && cache.inode() == _inode
+            && cache.size() == _size && cache.mtime_ns() == _mtime_ns;
+    }
+
+    void DiscoveryCacheEntry::store(DiscoveryCache& cache) const {
+        if (!enabled())
+            return;
+        cache.set_path(_file);
+        cache.set_device(_device);
+        cache.set_inode(_inode);
+        cache.set_size(_size);
+        cache.set_mtime_ns(_mtime_ns);
+        try {
+            boost::filesystem::create_directories(boost::filesystem::path(_entry_path).parent_path());
+        } catch (...) {
+            return;
+        }
+        // Write to a temporary file first, so that readers never see partial
+        // entries. Its name is unique, other threads may store the same entry.
+        std::string tmp = _entry_path + ".tmpXXXXXX";
+        int fd = mkstemp(&tmp[0]);
+        if (fd < 0)
+            return;
+        fchmod(fd, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+        bool written = cache.SerializeToFileDescriptor(fd);
+        written = (close(fd) == 0) && written;
+        if (!written || rename(tmp.c_str(), _entry_path.c_str()) != 0)
+            unlink(tmp.c_str());
+    }
+
+};};
@@ -0,0 +1,41 @@
+#ifndef _A4_DISCOVERY_CACHE_H_
+#define _A4_DISCOVERY_CACHE_H_
+
+#include <string>
+
+#include <a4/types.h>
+
+namespace a4{ namespace io{
+
+    class DiscoveryCache;
+
+    /// Entry of the opt-in cache of the footers, ProtoClasses and metadata
+    /// offsets that InputStreamImpl::discover_all_metadata() reads from a file.
+    /// The cache is enabled by setting the environment variable
+    /// A4_DISCOVERY_CACHE to a directory. Entries are named after the real
+    /// path of the file, and are only used while its device, inode, size
+    /// and modification time are unchanged. Only local files are cached.
+    class DiscoveryCacheEntry {
+        public:
+            /// Looks up the file behind the stream name (one stat)
+            DiscoveryCacheEntry(const std::string& stream_name);
+
+            /// True if caching is enabled for this file
+            bool enabled() const { return !_entry_path.empty(); }
+
+            /// Read a valid entry into cache, false if there is none
+            bool load(DiscoveryCache& cache) const;
+
+            /// Set the identity of the file in cache and store it.
+            /// Failures are ignored, the cache is only an optimization.
+            void store(DiscoveryCache& cache) const;
+
+        private:
+            std::string _entry_path, _file;
+            uint64_t _device, _inode;
+            int64_t _size, _mtime_ns;
+    };
+
+};};
+
+#endif
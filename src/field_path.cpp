@@ -0,0 +1,105 @@
+#include <sstream>
+
+#include <a4/field_path.h>
+#include <a4/dynamic_message.h>
+
+using google::protobuf::Descriptor;
+using google::protobuf::FieldDescriptor;
+using google::protobuf::Message;
+using google::protobuf::Reflection;
+
+namespace a4{ namespace io{
+
+#define A4_NUMBER(NAME) \
+    static double get_##NAME(const Message& m, const FieldDescriptor* f) { \
+        return m.GetReflection()->Get##NAME(m, f); } \
+    static double get_repeated_##NAME(const Message& m, const FieldDescriptor* f, int i) { \
+        return m.GetReflection()->GetRepeated##NAME(m, f, i); }
+
+    A4_NUMBER(Int32)
+    A4_NUMBER(Int64)
+    A4_NUMBER(UInt32)
+    A4_NUMBER(UInt64)
+    A4_NUMBER(Float)
+    A4_NUMBER(Double)
+    A4_NUMBER(Bool)
+#undef A4_NUMBER
+
+    static double get_Enum(const Message& m, const FieldDescriptor* f) {
+        return m.GetReflection()->GetEnum(m, f)->number(); }
+    static double get_repeated_Enum(const Message& m, const FieldDescriptor* f, int i) {
+        return m.GetReflection()->GetRepeatedEnum(m, f, i)->number(); }
+
+    FieldPath FieldPath::compile(const Descriptor* d, const std::string& path) {
+        FieldPath result;
+        result._path = path;
+        result._descriptor = d;
+
+        const Descriptor* current = d;
+        size_t start = 0;
+        while (true) {
+            size_t dot = path.find('.', start);
+            if (!current)
+                FATAL("Field before '", path.substr(start), "' in '", path, "' has no sub fields");
+            const FieldDescriptor* field = current->FindFieldByName(path.substr(start, dot - start));
+            if (!field)
+                FATAL("Field '", path, "' doesn't exist on ", d->full_name());
+            result._fields.push_back(field);
+            if (dot == std::string::npos)
+                break;
+            current = field->message_type();
+            start = dot + 1;
+        }
+
+        switch (result._fields.back()->cpp_type()) {
+#define HANDLE_TYPE(CPPTYPE, NAME) \
+            case FieldDescriptor::CPPTYPE_##CPPTYPE: \
+                result._number = &get_##NAME; \
+                result._repeated_number = &get_repeated_##NAME; \
+                break;
+            HANDLE_TYPE(INT32, Int32)
+            HANDLE_TYPE(INT64, Int64)
+            HANDLE_TYPE(UINT32, UInt32)
+            HANDLE_TYPE(UINT64, UInt64)
+            HANDLE_TYPE(FLOAT, Float)
+            HANDLE_TYPE(DOUBLE, Double)
+            HANDLE_TYPE(BOOL, Bool)
+            HANDLE_TYPE(ENUM, Enum)
+#undef HANDLE_TYPE
+            default:
+                break;
+        }
+        return result;
+    }
+
+    size_t FieldPath::count(const Message& m) const {
+        assert(m.GetDescriptor() == _descriptor);
+        size_t n = 0;
+        const FieldDescriptor* leaf = _fields.back();
+        for_each_parent(m, 0, [leaf, &n](const Message& parent) {
+            const Reflection* r = parent.GetReflection();
+            if (leaf->is_repeated())
+                n += r->FieldSize(parent, leaf);
+            else if (r->HasField(parent, leaf))
+                n++;
+        });
+        return n;
+    }
+
+    std::string FieldPath::str(const Message& m) const {
+        assert(m.GetDescriptor() == _descriptor);
+        std::stringstream ss;
+        const FieldDescriptor* leaf = _fields.back();
+        for_each_parent(m, 0, [leaf, &ss](const Message& parent) {
+            if (leaf->is_repeated()) {
+                int size = parent.GetReflection()->FieldSize(parent, leaf);
+                for (int i = 0; i < size; i++)
+                    ss << FieldContent(parent, leaf, i).str();
+            } else {
+                ss << FieldContent(parent, leaf).str();
+            }
+        });
+        return ss.str();
+    }
+
+};};
@@ -0,0 +1,106 @@
+#include <algorithm>
+#include <limits>
+
+#include <google/protobuf/message.h>
+
+#include "frame_reader.h"
+#include "projection.h"
+
+using google::protobuf::io::CodedInputStream;
+
+namespace a4{ namespace io{
+
+    bool FrameReader::refresh() {
+        const void* data = NULL;
+        int size = 0;
+        do {
+            if (!_in->Next(&data, &size)) {
+                _buffer = _buffer_end = NULL;
+                return false;
+            }
+        } while (size == 0);
+        _buffer = static_cast<const uint8_t*>(data);
+        _buffer_end = _buffer + size;
+        return true;
+    }
+
+    void FrameReader::release() {
+        if (_buffer != _buffer_end)
+            _in->BackUp(_buffer_end - _buffer);
+        _buffer = _buffer_end = NULL;
+    }
+
+    bool FrameReader::ReadRaw(void* data, size_t size) {
+        uint8_t* out = static_cast<uint8_t*>(data);
+        while (size > 0) {
+            if (_buffer == _buffer_end && !refresh())
+                return false;
+            size_t step = std::min(size, buffered());
+            memcpy(out, _buffer, step);
+            _buffer += step;
+            out += step;
+            size -= step;
+        }
+        return true;
+    }
+
+    bool FrameReader::ReadString(std::string* s, size_t size) {
+        s->resize(size);
+        if (size == 0)
+            return true;
+        return ReadRaw(&(*s)[0], size);
+    }
+
+    bool FrameReader::Skip(uint64_t count) {
+        uint64_t step = std::min<uint64_t>(count, buffered());
+        _buffer += step;
+        count -= step;
+        while (count > 0) {
+            step = std::min<uint64_t>(count, std::numeric_limits<int>::max());
+            if (!_in->Skip(step))
+                return false;
+            count -= step;
+        }
+        return true;
+    }
+
+    bool FrameReader::ParseMessage(google::protobuf::Message* msg, uint32_t size) {
+        if (buffered() >= size) {
+            bool ok = msg->ParseFromArray(_buffer, size);
+            _buffer += size;
+            return ok;
+        }
+        // The message spans several buffers, let protobuf read it from the stream.
+        // This stream only ever reads this message, so no limit is reached.
+        release();
+        CodedInputStream coded_in(_in);
+        coded_in.SetTotalBytesLimit(std::numeric_limits<int>::max(), -1);
+        CodedInputStream::Limit lim = coded_in.PushLimit(size);
+        if (!msg->ParseFromCodedStream(&coded_in) || coded_in.BytesUntilLimit() != 0)
+            return false;
+        coded_in.PopLimit(lim);
+        return true;
+    }
+
+    bool FrameReader::ParseMessage(google::protobuf::Message* msg, uint32_t size,
+                                   const Projection& projection) {
+        const uint8_t* data = _buffer;
+        if (buffered() >= size) {
+            _buffer += size;
+        } else {
+            if (!ReadString(&_payload, size))
+                return false;
+            data = reinterpret_cast<const uint8_t*>(_payload.data());
+        }
+        return projection.parse(data, size, msg, &_filtered);
+    }
+
+    bool FrameReader::GetDirectBufferPointer(const void** data, int* size) {
+        if (_buffer == _buffer_end && !refresh())
+            return false;
+        *data = _buffer;
+        *size = buffered();
+        return true;
+    }
+
+};};
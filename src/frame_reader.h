@@ -0,0 +1,77 @@
+#ifndef _A4_FRAME_READER_H_
+#define _A4_FRAME_READER_H_
+
+#include <string>
+
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/zero_copy_stream.h>
+
+#include <a4/types.h>
+
+namespace google{ namespace protobuf{ class Message; };};
+
+namespace a4{ namespace io{
+
+    class Projection;
+
+    /// Reads the A4 framing (magic strings, sizes and class ids) directly from
+    /// the buffers of a ZeroCopyInputStream. Protobuf is only used to parse
+    /// the message payloads, so there is no limit on the total number of
+    /// bytes that can be read.
+    /// Unconsumed buffered bytes are returned to the stream on destruction.
+    class FrameReader {
+        public:
+            FrameReader(google::protobuf::io::ZeroCopyInputStream* in)
+                : _in(in), _buffer(NULL), _buffer_end(NULL) {};
+            ~FrameReader() { release(); };
+
+            bool ReadLittleEndian32(uint32_t* value);
+            bool ReadRaw(void* data, size_t size);
+            bool ReadString(std::string* s, size_t size);
+            bool Skip(uint64_t count);
+
+            /// Parse the next `size` bytes into `msg`, without copying them
+            /// if they are in a single buffer of the stream.
+            bool ParseMessage(google::protobuf::Message* msg, uint32_t size);
+            /// Parse only the fields selected by the projection
+            bool ParseMessage(google::protobuf::Message* msg, uint32_t size,
+                              const Projection& projection);
+
+            /// Get the buffered bytes, reading from the stream if there are none.
+            /// They have to be consumed with Skip().
+            bool GetDirectBufferPointer(const void** data, int* size);
+
+            /// True if the stream has no more data
+            bool ExpectAtEnd() { return _buffer == _buffer_end && !refresh(); };
+
+            /// Number of bytes read from the stream but not consumed yet
+            size_t buffered() const { return _buffer_end - _buffer; };
+
+        private:
+            bool refresh();
+            void release();
+
+            google::protobuf::io::ZeroCopyInputStream* _in;
+            const uint8_t* _buffer;
+            const uint8_t* _buffer_end;
+            // buffers for projected messages
+            std::string _payload, _filtered;
+    };
+
+    inline
+    bool FrameReader::ReadLittleEndian32(uint32_t* value) {
+        using google::protobuf::io::CodedInputStream;
+        if (likely(_buffer_end - _buffer >= 4)) {
+            _buffer = CodedInputStream::ReadLittleEndian32FromArray(_buffer, value);
+            return true;
+        }
+        uint8_t bytes[4];
+        if (!ReadRaw(bytes, 4))
+            return false;
+        CodedInputStream::ReadLittleEndian32FromArray(bytes, value);
+        return true;
+    }
+
+};};
+
+#endif
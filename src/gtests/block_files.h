@@ -0,0 +1,60 @@
+#ifndef _A4_GTESTS_BLOCK_FILES_H_
+#define _A4_GTESTS_BLOCK_FILES_H_
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <a4/io/A4Stream.pb.h>
+#include <a4/output_stream.h>
+
+/// Write the TestEvents first to first+n-1, with event_number and event_data
+/// set to their number, in metadata blocks of block_size events.
+/// The TestMetaData value is the first (forward) or last (backward) event
+/// of its block, blocks start at multiples of block_size.
+/// With chunk_events, blocks are cut into chunks of that many events.
+inline void write_block_test(std::string filename, bool forward, int first, int n,
+        int block_size=1000,
+        a4::io::OutputStream::CompressionType compression=a4::io::OutputStream::ZLIB,
+        const std::vector<std::string>& zone_map_fields=std::vector<std::string>(),
+        int chunk_events=0)
+{
+    using namespace a4::io;
+    OutputStream w(filename, "TestEvent");
+    w.set_compression(compression);
+    if (chunk_events)
+        w.set_chunk_size(0, chunk_events);
+    if (zone_map_fields.size())
+        w.set_zone_map_fields(zone_map_fields);
+    if (forward) w.set_forward_metadata();
+
+    TestEvent e;
+    TestMetaData m;
+    for(int i = first; i < first + n; i++) {
+        if (forward && i % block_size == 0) {
+            m.set_meta_data(i);
+            w.metadata(m);
+        }
+        e.set_event_number(i);
+        e.set_event_data(i);
+        w.write(e);
+        if (!forward && i % block_size == block_size - 1) {
+            m.set_meta_data(i);
+            w.metadata(m);
+        }
+    }
+}
+
+/// Metadata value that write_block_test gives to event i
+inline int block_test_metadata(int i, bool forward, int block_size=1000) {
+    return forward ? i/block_size*block_size : i/block_size*block_size + block_size - 1;
+}
+
+/// Write the contents of a followed by those of b to out
+inline void concatenate(std::string a, std::string b, std::string out) {
+    std::ofstream o(out.c_str(), std::ios::binary);
+    std::ifstream ia(a.c_str(), std::ios::binary), ib(b.c_str(), std::ios::binary);
+    o << ia.rdbuf() << ib.rdbuf();
+}
+
+#endif
@@ -0,0 +1,206 @@
+#include <sstream>
+
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/descriptor.pb.h>
+#include <google/protobuf/dynamic_message.h>
+
+#include <a4/io/A4Stream.pb.h>
+#include <a4/columns.h>
+#include <a4/input_stream.h>
+#include <a4/message.h>
+#include <a4/output_stream.h>
+
+#include <gtest/gtest.h>
+
+using namespace std;
+using namespace a4::io;
+using namespace google::protobuf;
+
+TEST(a4io, columns_read) {
+    const int N = 2500;
+    {
+        OutputStream w("test_columns.a4", "TestEvent");
+        w.set_compression(OutputStream::ZLIB);
+        TestEvent e;
+        TestMetaData m;
+        for(int i = 0; i < N; i++) {
+            e.set_event_number(i);
+            e.set_event_data(i * 0.5);
+            w.write(e);
+            if (i % 1000 == 999) {
+                m.set_meta_data(i);
+                w.metadata(m);
+            }
+        }
+    }
+    InputStream r("test_columns.a4");
+    ColumnBatch batch;
+    int cnt = 0, batches = 0;
+    while (batch.read(r, 1000)) {
+        ASSERT_EQ(2u, batch.columns().size());
+        const Column* number = batch.column("event_number");
+        const Column* data = batch.column("event_data");
+        ASSERT_TRUE(number && data);
+        ASSERT_EQ(batch.size(), number->size());
+        ASSERT_EQ(batch.size(), data->size());
+        for (size_t i = 0; i < batch.size(); i++, cnt++) {
+            ASSERT_EQ(cnt, number->values<int32_t>()[i]);
+            ASSERT_EQ(cnt * 0.5, data->values<double>()[i]);
+        }
+        batches++;
+    }
+    ASSERT_FALSE(r.error());
+    ASSERT_EQ(N, cnt);
+    ASSERT_EQ(3, batches);
+
+    InputStream r2("test_columns.a4");
+    ColumnBatch selected(vector<string>(1, "event_data"));
+    ASSERT_EQ(1000u, selected.read(r2, 1000));
+    ASSERT_EQ(1u, selected.columns().size());
+    ASSERT_EQ(999 * 0.5, selected.column("event_data")->values<double>()[999]);
+    ASSERT_TRUE(selected.column("event_number") == NULL);
+
+    // the settings of the stream are restored after a batch
+    InputStream r3("test_columns.a4");
+    r3.set_projection(vector<string>(1, "event_number"));
+    ASSERT_EQ(1000u, batch.read(r3, 1000));
+    ASSERT_EQ(999, batch.column("event_number")->values<int32_t>()[999]);
+    ASSERT_EQ(999 * 0.5, batch.column("event_data")->values<double>()[999]);
+    ASSERT_FALSE(r3.hint_copy());
+    shared<A4Message> msg = r3.next();
+    ASSERT_TRUE(msg && msg->as<TestEvent>());
+    ASSERT_EQ(1000, msg->as<TestEvent>()->event_number());
+    ASSERT_FALSE(msg->as<TestEvent>()->has_event_data());
+}
+
+TEST(a4io, columns_repeated) {
+    FileDescriptorProto file;
+    file.set_name("test_columns.proto");
+    DescriptorProto* type = file.add_message_type();
+    type->set_name("Hits");
+    FieldDescriptorProto* field = type->add_field();
+    field->set_name("energy");
+    field->set_number(1);
+    field->set_type(FieldDescriptorProto::TYPE_FLOAT);
+    field->set_label(FieldDescriptorProto::LABEL_REPEATED);
+    field = type->add_field();
+    field->set_name("good");
+    field->set_number(2);
+    field->set_type(FieldDescriptorProto::TYPE_BOOL);
+    field->set_label(FieldDescriptorProto::LABEL_OPTIONAL);
+    field = type->add_field();
+    field->set_name("label");
+    field->set_number(3);
+    field->set_type(FieldDescriptorProto::TYPE_STRING);
+    field->set_label(FieldDescriptorProto::LABEL_OPTIONAL);
+
+    DescriptorPool pool;
+    const Descriptor* d = pool.BuildFile(file)->message_type(0);
+    DynamicMessageFactory factory(&pool);
+    UNIQUE<Message> msg(factory.GetPrototype(d)->New());
+    const Reflection* reflection = msg->GetReflection();
+
+    ColumnBatch batch;
+    for (int i = 0; i < 4; i++) {
+        msg->Clear();
+        for (int j = 0; j < i; j++)
+            reflection->AddFloat(msg.get(), d->field(0), i + j);
+        if (i % 2)
+            reflection->SetBool(msg.get(), d->field(1), true);
+        ASSERT_TRUE(batch.add(*msg));
+    }
+    ASSERT_FALSE(batch.add(TestEvent()));
+    ASSERT_EQ(4u, batch.size());
+    ASSERT_EQ(2u, batch.columns().size());
+
+    const Column* energy = batch.column("energy");
+    ASSERT_TRUE(energy->repeated());
+    ASSERT_EQ(6u, energy->size());
+    const uint64_t offsets[] = {0, 0, 1, 3, 6};
+    ASSERT_EQ(vector<uint64_t>(offsets, offsets + 5), energy->offsets());
+    ASSERT_EQ(2.0f, energy->values<float>()[1]);
+    ASSERT_EQ(5.0f, energy->values<float>()[5]);
+    const Column* good = batch.column("good");
+    ASSERT_FALSE(good->repeated());
+    ASSERT_EQ(1, good->values<uint8_t>()[1]);
+    ASSERT_EQ(0, good->values<uint8_t>()[2]);
+
+    ostringstream out;
+    ASSERT_TRUE(batch.write(out));
+    const string data = out.str();
+    ASSERT_EQ(0u, data.size() % 8);
+    ASSERT_EQ("A4COLS01", data.substr(0, 8));
+    const uint64_t* header = reinterpret_cast<const uint64_t*>(data.data());
+    ASSERT_EQ(data.size(), header[1]);
+    ASSERT_EQ(4u, header[2]);
+    ASSERT_EQ(2u, header[3]);
+    // the "energy" entry follows the batch header
+    const uint64_t* entry = header + 4 + 2;
+    ASSERT_EQ(6u, entry[1]);
+    ASSERT_EQ(energy->values<float>()[5],
+              reinterpret_cast<const float*>(data.data() + entry[2])[5]);
+    ASSERT_EQ(6u, reinterpret_cast<const uint64_t*>(data.data() + entry[3])[4]);
+}
+
+TEST(a4io, columns_serialized) {
+    FileDescriptorProto file;
+    file.set_name("test_columns_serialized.proto");
+    DescriptorProto* type = file.add_message_type();
+    type->set_name("Cells");
+    const FieldDescriptorProto::Type types[] = {
+        FieldDescriptorProto::TYPE_INT32, FieldDescriptorProto::TYPE_SINT64,
+        FieldDescriptorProto::TYPE_DOUBLE, FieldDescriptorProto::TYPE_UINT32,
+        FieldDescriptorProto::TYPE_SINT32, FieldDescriptorProto::TYPE_FLOAT,
+        FieldDescriptorProto::TYPE_BOOL, FieldDescriptorProto::TYPE_FIXED64};
+    for (int i = 0; i < 8; i++) {
+        FieldDescriptorProto* field = type->add_field();
+        field->set_name(string("field") + char('a' + i));
+        field->set_number(i + 1);
+        field->set_type(types[i]);
+        // packed and unpacked repeated fields, then optional ones
+        field->set_label(i < 4 ? FieldDescriptorProto::LABEL_REPEATED : FieldDescriptorProto::LABEL_OPTIONAL);
+        if (i < 3)
+            field->mutable_options()->set_packed(true);
+    }
+    type->mutable_field(5)->set_default_value("1.5");
+
+    DescriptorPool pool;
+    const Descriptor* d = pool.BuildFile(file)->message_type(0);
+    DynamicMessageFactory factory(&pool);
+    UNIQUE<Message> msg(factory.GetPrototype(d)->New());
+    const Reflection* r = msg->GetReflection();
+
+    ColumnBatch parsed, serialized;
+    for (int i = 0; i < 200; i++) {
+        msg->Clear();
+        for (int j = 0; j < i % 40; j++) {
+            r->AddInt32(msg.get(), d->field(0), j % 3 ? j : -j * 1000);
+            r->AddInt64(msg.get(), d->field(1), (j % 2 ? -1 : 1) * (int64_t(1) << (j % 63)));
+            r->AddDouble(msg.get(), d->field(2), i * 0.25 + j);
+            r->AddUInt32(msg.get(), d->field(3), j * 1000);
+        }
+        if (i % 3)
+            r->SetInt32(msg.get(), d->field(4), -i);
+        if (i % 5)
+            r->SetFloat(msg.get(), d->field(5), i);
+        r->SetBool(msg.get(), d->field(6), i % 2);
+        r->SetUInt64(msg.get(), d->field(7), uint64_t(i) << 40);
+        ASSERT_TRUE(parsed.add(*msg));
+        string bytes = msg->SerializeAsString();
+        ASSERT_TRUE(serialized.add_serialized(d, bytes.data(), bytes.size()));
+    }
+    ASSERT_FALSE(serialized.add_serialized(TestEvent::descriptor(), "", 0));
+
+    ASSERT_EQ(parsed.size(), serialized.size());
+    ASSERT_EQ(8u, serialized.columns().size());
+    for (size_t i = 0; i < parsed.columns().size(); i++) {
+        const Column& a = parsed.columns()[i];
+        const Column& b = serialized.columns()[i];
+        SCOPED_TRACE(a.name());
+        ASSERT_EQ(a.size(), b.size());
+        ASSERT_EQ(string(a.data(), a.size() * a.value_size()), string(b.data(), b.size() * b.value_size()));
+        ASSERT_EQ(a.offsets(), b.offsets());
+    }
+    ASSERT_EQ(1.5f, serialized.column("fieldf")->values<float>()[0]);
+    ASSERT_EQ(-1, serialized.column("fielde")->values<int32_t>()[1]);
+}
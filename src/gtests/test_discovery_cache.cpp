@@ -0,0 +1,140 @@
+#include <cstdlib>
+#include <fstream>
+
+#include <boost/filesystem.hpp>
+#include <boost/thread.hpp>
+
+#include <a4/io/A4Stream.pb.h>
+#include <a4/message.h>
+#include <a4/input_stream.h>
+#include <a4/output_stream.h>
+
+#include <gtest/gtest.h>
+
+#include "block_files.h"
+
+using namespace std;
+using namespace a4::io;
+
+static void check_discovery_test(string filename, int n) {
+    InputStream r(filename);
+    int cnt = 0;
+    while (shared<A4Message> msg = r.next()) {
+        ASSERT_EQ(cnt, msg->as<TestEvent>()->event_number());
+        ASSERT_EQ(block_test_metadata(cnt, false, 100), r.current_metadata()->as<TestMetaData>()->meta_data());
+        cnt++;
+    }
+    ASSERT_FALSE(r.error());
+    ASSERT_EQ(n, cnt);
+}
+
+static size_t cache_entries(string directory) {
+    size_t n = 0;
+    boost::filesystem::directory_iterator end;
+    for (boost::filesystem::directory_iterator it(directory); it != end; ++it)
+        n++;
+    return n;
+}
+
+TEST(a4io, discovery_cache) {
+    const string directory = "test_discovery_cache.d";
+    boost::filesystem::remove_all(directory);
+    setenv("A4_DISCOVERY_CACHE", directory.c_str(), 1);
+
+    write_block_test("test_discovery_cache1.a4", false, 0, 1000, 100);
+    write_block_test("test_discovery_cache2.a4", false, 1000, 500, 100);
+    concatenate("test_discovery_cache1.a4", "test_discovery_cache2.a4", "test_discovery_cache.a4");
+
+    // the first open fills the cache, the second one uses it
+    check_discovery_test("test_discovery_cache.a4", 1500);
+    ASSERT_EQ(1u, cache_entries(directory));
+    check_discovery_test("test_discovery_cache.a4", 1500);
+    {
+        InputStream r("test_discovery_cache.a4");
+        vector<shared<InputStream>> parts = r.split();
+        int cnt = 0;
+        foreach (shared<InputStream> part, parts)
+            while (part->next())
+                cnt++;
+        ASSERT_EQ(1500, cnt);
+    }
+
+    // a changed file does not use the stale entry
+    write_block_test("test_discovery_cache.a4", false, 0, 700, 100);
+    check_discovery_test("test_discovery_cache.a4", 700);
+    check_discovery_test("test_discovery_cache.a4", 700);
+    ASSERT_EQ(1u, cache_entries(directory));
+
+    unsetenv("A4_DISCOVERY_CACHE");
+}
+
+TEST(a4io, discovery_cache_threads) {
+    const string directory = "test_discovery_cache_threads.d";
+    boost::filesystem::remove_all(directory);
+    setenv("A4_DISCOVERY_CACHE", directory.c_str(), 1);
+    write_block_test("test_discovery_cache_threads.a4", false, 0, 1000, 100);
+
+    // threads that store the same entry at once do not share a temporary file
+    boost::thread_group threads;
+    for (int t = 0; t < 8; t++)
+        threads.create_thread([]() { InputStream r("test_discovery_cache_threads.a4"); r.footers(); });
+    threads.join_all();
+    ASSERT_EQ(1u, cache_entries(directory));
+    check_discovery_test("test_discovery_cache_threads.a4", 1000);
+
+    unsetenv("A4_DISCOVERY_CACHE");
+}
+
+// Path of the only entry in the cache directory
+static string cache_entry(string directory) {
+    boost::filesystem::directory_iterator it(directory);
+    return it->path().string();
+}
+
+// Change the event count of the first footer in the cache entry
+static void edit_cache_entry(string directory, int64_t event_count) {
+    DiscoveryCache cache;
+    {
+        ifstream in(cache_entry(directory).c_str(), ios::binary);
+        ASSERT_TRUE(cache.ParseFromIstream(&in));
+    }
+    cache.mutable_header(0)->mutable_footer()->set_event_count(event_count);
+    ofstream out(cache_entry(directory).c_str(), ios::binary | ios::trunc);
+    ASSERT_TRUE(cache.SerializeToOstream(&out));
+}
+
+static int64_t footer_event_count(string filename) {
+    InputStream r(filename);
+    EXPECT_EQ(1u, r.footers().size());
+    return r.footers()[0].event_count();
+}
+
+TEST(a4io, discovery_cache_identity) {
+    const string directory = "test_discovery_cache_identity.d";
+    const string filename = "test_discovery_cache_identity.a4";
+    boost::filesystem::remove_all(directory);
+    setenv("A4_DISCOVERY_CACHE", directory.c_str(), 1);
+    write_block_test(filename, false, 0, 1000, 100);
+    ASSERT_EQ(1000, footer_event_count(filename));
+    ASSERT_EQ(1u, cache_entries(directory));
+
+    // a hit restores the footers from the entry without scanning the file
+    edit_cache_entry(directory, 12345);
+    ASSERT_EQ(12345, footer_event_count(filename));
+
+    // a new modification time alone invalidates the entry
+    boost::filesystem::last_write_time(filename, boost::filesystem::last_write_time(filename) + 10);
+    ASSERT_EQ(1000, footer_event_count(filename));
+    ASSERT_EQ(1u, cache_entries(directory));
+
+    // as does rewriting the file with the same size
+    edit_cache_entry(directory, 12345);
+    ASSERT_EQ(12345, footer_event_count(filename));
+    uintmax_t size = boost::filesystem::file_size(filename);
+    write_block_test(filename, false, 0, 1000, 100);
+    ASSERT_EQ(size, boost::filesystem::file_size(filename));
+    ASSERT_EQ(1000, footer_event_count(filename));
+    check_discovery_test(filename, 1000);
+
+    unsetenv("A4_DISCOVERY_CACHE");
+}
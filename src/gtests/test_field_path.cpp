@@ -0,0 +1,69 @@
+#include <a4/io/A4Stream.pb.h>
+#include <a4/field_path.h>
+#include <a4/message.h>
+
+#include <gtest/gtest.h>
+
+using namespace std;
+using namespace a4::io;
+
+static TestMergeMetaData field_path_test_message() {
+    TestMergeMetaData m;
+    m.set_meta_data(7);
+    for (int i = 0; i < 3; i++) {
+        TestRunLB* rlb = m.add_lumiblock();
+        rlb->set_run(100 + i);
+        if (i != 1)
+            rlb->set_lumiblock(i);
+        m.add_run(100 + i);
+    }
+    m.set_tags("<tag>");
+    m.set_simulation(true);
+    return m;
+}
+
+TEST(a4io, field_path_values) {
+    TestMergeMetaData m = field_path_test_message();
+    const auto* d = TestMergeMetaData::descriptor();
+
+    FieldPath meta_data = FieldPath::compile(d, "meta_data");
+    ASSERT_TRUE(meta_data.numeric());
+    ASSERT_EQ(1u, meta_data.count(m));
+    vector<double> values;
+    meta_data.for_each(m, [&values](double v) { values.push_back(v); });
+    ASSERT_EQ(vector<double>({7}), values);
+
+    // values of repeated fields and sub messages
+    FieldPath run = FieldPath::compile(d, "lumiblock.run");
+    ASSERT_EQ(2u, run.fields().size());
+    ASSERT_EQ(3u, run.count(m));
+    values.clear();
+    run.for_each(m, [&values](double v) { values.push_back(v); });
+    ASSERT_EQ(vector<double>({100, 101, 102}), values);
+    ASSERT_EQ("100101102", run.str(m));
+
+    // unset fields have no values
+    FieldPath lumiblock = FieldPath::compile(d, "lumiblock.lumiblock");
+    ASSERT_EQ(2u, lumiblock.count(m));
+    FieldPath efficiency = FieldPath::compile(d, "efficiency");
+    ASSERT_EQ(0u, efficiency.count(m));
+
+    FieldPath simulation = FieldPath::compile(d, "simulation");
+    ASSERT_TRUE(simulation.numeric());
+    values.clear();
+    simulation.for_each(m, [&values](double v) { values.push_back(v); });
+    ASSERT_EQ(vector<double>({1}), values);
+
+    FieldPath tags = FieldPath::compile(d, "tags");
+    ASSERT_FALSE(tags.numeric());
+    ASSERT_EQ("<tag>", tags.str(m));
+    ASSERT_EQ("<tag>", A4Message(m).field_as_string(tags));
+}
+
+TEST(a4io, field_path_errors) {
+    const auto* d = TestMergeMetaData::descriptor();
+    ASSERT_THROW(FieldPath::compile(d, "nonexistent"), a4::Fatal);
+    ASSERT_THROW(FieldPath::compile(d, "lumiblock.nonexistent"), a4::Fatal);
+    ASSERT_THROW(FieldPath::compile(d, "run.value"), a4::Fatal);
+    ASSERT_FALSE(FieldPath::compile(d, "lumiblock").numeric());
+}
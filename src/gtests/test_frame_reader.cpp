@@ -0,0 +1,69 @@
+#include <string>
+
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+
+#include <a4/io/A4Stream.pb.h>
+
+#include "frame_reader.h"
+
+#include <gtest/gtest.h>
+
+using namespace std;
+using namespace a4::io;
+using google::protobuf::io::ArrayInputStream;
+using google::protobuf::io::CodedOutputStream;
+using google::protobuf::io::StringOutputStream;
+
+TEST(a4io, frame_reader) {
+    const int N = 100;
+    string data;
+    {
+        StringOutputStream out(&data);
+        CodedOutputStream coded_out(&out);
+        coded_out.WriteRaw("A4STREAM", 8);
+        TestEvent e;
+        for (int i = 0; i < N; i++) {
+            e.set_event_number(i);
+            coded_out.WriteLittleEndian32(e.ByteSize());
+            e.SerializeWithCachedSizes(&coded_out);
+        }
+    }
+    // Block sizes smaller than, around and larger than a frame
+    int block_sizes[] = {1, 3, 7, 1000};
+    for (int b = 0; b < 4; b++) {
+        ArrayInputStream in(data.data(), data.size(), block_sizes[b]);
+        {
+            FrameReader frames(&in);
+            string magic;
+            ASSERT_TRUE(frames.ReadString(&magic, 8));
+            ASSERT_EQ("A4STREAM", magic);
+            for (int i = 0; i < N; i++) {
+                uint32_t size = 0;
+                ASSERT_TRUE(frames.ReadLittleEndian32(&size));
+                if (i % 10 == 9) {
+                    ASSERT_TRUE(frames.Skip(size));
+                    continue;
+                }
+                TestEvent e;
+                ASSERT_TRUE(frames.ParseMessage(&e, size));
+                ASSERT_EQ(i, e.event_number());
+            }
+            ASSERT_TRUE(frames.ExpectAtEnd());
+        }
+        ASSERT_EQ(static_cast<int64_t>(data.size()), in.ByteCount());
+    }
+}
+
+TEST(a4io, frame_reader_backup) {
+    string data = "0123456789";
+    ArrayInputStream in(data.data(), data.size());
+    {
+        FrameReader frames(&in);
+        string s;
+        ASSERT_TRUE(frames.ReadString(&s, 4));
+        ASSERT_EQ(6u, frames.buffered());
+    }
+    // Unconsumed bytes are returned to the stream
+    ASSERT_EQ(4, in.ByteCount());
+}
@@ -0,0 +1,86 @@
+#include <a4/io/A4Stream.pb.h>
+#include <a4/message.h>
+#include <a4/input_stream.h>
+#include <a4/output_stream.h>
+
+#include <gtest/gtest.h>
+
+#include "block_files.h"
+#include "input_stream_impl.h"
+
+using namespace std;
+using namespace a4::io;
+
+// more metadata blocks than are kept in memory
+const int BLOCKS = 300;
+
+static void check_lazy_metadata_test(string filename, bool forward) {
+    {
+        InputStream r(filename);
+        int cnt = 0;
+        // metadata is not kept beyond the most recently used messages
+        vector<weak_shared<const A4Message>> seen;
+        while (shared<A4Message> msg = r.next()) {
+            ASSERT_EQ(cnt, msg->as<TestEvent>()->event_number());
+            shared<const A4Message> metadata = r.current_metadata();
+            ASSERT_EQ(block_test_metadata(cnt, forward, 10), metadata->as<TestMetaData>()->meta_data());
+            if (seen.empty() || seen.back().lock() != metadata)
+                seen.push_back(metadata);
+            cnt++;
+        }
+        ASSERT_FALSE(r.error());
+        ASSERT_EQ(BLOCKS * 10, cnt);
+        ASSERT_EQ(size_t(BLOCKS), seen.size());
+        size_t alive = 0;
+        foreach (const weak_shared<const A4Message>& metadata, seen)
+            if (!metadata.expired())
+                alive++;
+        ASSERT_LE(alive, METADATA_CACHE_SIZE + 1);
+    }
+    {
+        // metadata is only read when asked for, here for every 7th block
+        InputStream r(filename);
+        int cnt = 0;
+        while (shared<A4Message> msg = r.next()) {
+            if (cnt % 70 == 0)
+                ASSERT_EQ(block_test_metadata(cnt, forward, 10), r.current_metadata()->as<TestMetaData>()->meta_data());
+            cnt++;
+        }
+        ASSERT_EQ(BLOCKS * 10, cnt);
+    }
+    {
+        InputStream r(filename);
+        const auto& all = r.all_metadata();
+        ASSERT_EQ(1u, all.size());
+        ASSERT_EQ(size_t(BLOCKS), all[0].size());
+        for (int i = 0; i < BLOCKS; i++)
+            ASSERT_EQ(block_test_metadata(i * 10, forward, 10), all[0][i]->as<TestMetaData>()->meta_data());
+        ASSERT_EQ(0, r.next()->as<TestEvent>()->event_number());
+        ASSERT_EQ(block_test_metadata(0, forward, 10), r.current_metadata()->as<TestMetaData>()->meta_data());
+    }
+    {
+        // blocks read in reverse order
+        InputStream r(filename);
+        vector<shared<InputStream>> parts = r.split();
+        ASSERT_FALSE(parts.empty());
+        int cnt = 0;
+        for (int i = parts.size() - 1; i >= 0; i--) {
+            while (shared<A4Message> msg = parts[i]->next()) {
+                int n = msg->as<TestEvent>()->event_number();
+                ASSERT_EQ(block_test_metadata(n, forward, 10), parts[i]->current_metadata()->as<TestMetaData>()->meta_data());
+                cnt++;
+            }
+        }
+        ASSERT_EQ(BLOCKS * 10, cnt);
+    }
+}
+
+TEST(a4io, lazy_metadata_backward) {
+    write_block_test("test_lazy_metadata_bw.a4", false, 0, BLOCKS * 10, 10);
+    check_lazy_metadata_test("test_lazy_metadata_bw.a4", false);
+}
+
+TEST(a4io, lazy_metadata_forward) {
+    write_block_test("test_lazy_metadata_fw.a4", true, 0, BLOCKS * 10, 10);
+    check_lazy_metadata_test("test_lazy_metadata_fw.a4", true);
+}
@@ -1,3 +1,4 @@
+#include <cmath>
 #include <iostream>
 
 #include <a4/io/A4Stream.pb.h>
@@ -102,3 +103,43 @@ TEST(a4io, metadata_merge) {
         ASSERT_FALSE(r.error());
     }
 }
+
+TEST(a4io, merge_plan) {
+    A4Message merged(meta(1, 10, 1, 0));
+    for (int i = 1; i < 100; i++)
+        merged += A4Message(meta(1, 10 + i % 3, 1 + i % 5, i % 2));
+
+    auto m = merged.as<TestMergeMetaData>();
+    ASSERT_EQ(100, m->meta_data());
+    // MERGE_UNION keeps every value once, in the order first seen
+    ASSERT_EQ(3, m->run_size());
+    ASSERT_EQ(10, m->run(0));
+    ASSERT_EQ(11, m->run(1));
+    ASSERT_EQ(12, m->run(2));
+    ASSERT_EQ(2, m->period_size());
+    ASSERT_EQ(15, m->lumiblock_size());
+    // MERGE_APPEND keeps duplicates
+    ASSERT_EQ(100, m->comments_size());
+    ASSERT_EQ(100*5u, m->tags().size());
+    ASSERT_NEAR(pow(0.5, 100), m->efficiency(), 1e-40);
+
+    EXPECT_THROW(merged += A4Message(meta(1, 10, 1, 0, true)), a4::Fatal);
+}
+
+TEST(a4io, unionize) {
+    TestMergeMetaData m = meta(1, 3, 1, 0);
+    for (int run : {1, 3, 2, 1, 3})
+        m.add_run(run);
+    m.add_lumiblock()->CopyFrom(m.lumiblock(0));
+    m.add_comments("Hugo!");
+
+    A4Message msg(m);
+    msg.unionize();
+    auto u = msg.as<TestMergeMetaData>();
+    ASSERT_EQ(3, u->run_size());
+    ASSERT_EQ(3, u->run(0));
+    ASSERT_EQ(1, u->run(1));
+    ASSERT_EQ(2, u->run(2));
+    ASSERT_EQ(1, u->lumiblock_size());
+    ASSERT_EQ(2, u->comments_size());
+}
@@ -0,0 +1,44 @@
+#include <iostream>
+
+#include <a4/io/A4Stream.pb.h>
+#include <a4/message.h>
+#include <a4/input_stream.h>
+#include <a4/output_stream.h>
+
+#include <gtest/gtest.h>
+
+using namespace std;
+using namespace a4::io;
+
+TEST(a4io, parallel_decompression) {
+    const int N = 100000;
+    {
+        OutputStream w("test_parallel_decompression.a4", "TestEvent");
+        w.set_compression(OutputStream::LZ4);
+
+        TestEvent e;
+        for(int i = 0; i < N; i++) {
+            e.set_event_number(i);
+            w.write(e);
+            if (i % 25000 == 24999) {
+                TestMetaData m;
+                m.set_meta_data(i);
+                w.metadata(m);
+            }
+        }
+    }
+    for (int threads = 1; threads <= 4; threads++) {
+        InputStream r("test_parallel_decompression.a4");
+        r.set_parallel_decompression(threads);
+        int cnt = 0, metadata = 0;
+        while (shared<A4Message> msg = r.next()) {
+            if (const TestEvent* te = msg->as<TestEvent>()) {
+                ASSERT_EQ(cnt++, te->event_number());
+            }
+            if (r.new_metadata()) metadata++;
+        }
+        ASSERT_FALSE(r.error());
+        ASSERT_EQ(N, cnt);
+        ASSERT_EQ(4, metadata);
+    }
+}
@@ -0,0 +1,79 @@
+#include <string>
+#include <vector>
+
+#include <a4/io/A4Stream.pb.h>
+#include <a4/message.h>
+#include <a4/input_stream.h>
+#include <a4/output_stream.h>
+
+#include "projection.h"
+
+#include <gtest/gtest.h>
+
+using namespace std;
+using namespace a4::io;
+
+TEST(a4io, projection) {
+    TestMergeMetaData m;
+    m.set_meta_data(5);
+    for (int i = 0; i < 3; i++) {
+        TestRunLB* lb = m.add_lumiblock();
+        lb->set_run(100 + i);
+        lb->set_lumiblock(i);
+    }
+    string data = m.SerializeAsString();
+    string scratch;
+
+    vector<string> fields;
+    fields.push_back("lumiblock.run");
+    fields.push_back("no_such_field");
+    shared<Projection> p = Projection::resolve(TestMergeMetaData::descriptor(), fields);
+    ASSERT_TRUE(bool(p));
+    TestMergeMetaData r;
+    ASSERT_TRUE(p->parse(reinterpret_cast<const uint8_t*>(data.data()), data.size(), &r, &scratch));
+    ASSERT_FALSE(r.has_meta_data());
+    ASSERT_EQ(3, r.lumiblock_size());
+    for (int i = 0; i < 3; i++) {
+        ASSERT_EQ(100 + i, r.lumiblock(i).run());
+        ASSERT_FALSE(r.lumiblock(i).has_lumiblock());
+    }
+
+    // Selecting the complete field includes all sub fields
+    fields.push_back("lumiblock");
+    p = Projection::resolve(TestMergeMetaData::descriptor(), fields);
+    ASSERT_TRUE(p->parse(reinterpret_cast<const uint8_t*>(data.data()), data.size(), &r, &scratch));
+    ASSERT_EQ(2, r.lumiblock(2).lumiblock());
+
+    fields.clear();
+    fields.push_back("no_such_field");
+    ASSERT_FALSE(Projection::resolve(TestMergeMetaData::descriptor(), fields));
+}
+
+TEST(a4io, projection_read) {
+    const int N = 1000;
+    {
+        OutputStream w("test_projection.a4", "TestEvent");
+        TestEvent e;
+        TestMetaData m;
+        for(int i = 0; i < N; i++) {
+            e.set_event_number(i);
+            e.set_event_data(i * 0.5);
+            w.write(e);
+        }
+        m.set_meta_data(N);
+        w.metadata(m);
+    }
+    InputStream r("test_projection.a4");
+    r.set_projection(vector<string>(1, "event_data"));
+    int cnt = 0;
+    while (shared<A4Message> msg = r.next()) {
+        const TestEvent* te = msg->as<TestEvent>();
+        ASSERT_FALSE(te->has_event_number());
+        ASSERT_EQ(cnt * 0.5, te->event_data());
+        // Metadata is not projected
+        ASSERT_EQ(N, r.current_metadata()->as<TestMetaData>()->meta_data());
+        cnt++;
+    }
+    ASSERT_FALSE(r.error());
+    ASSERT_EQ(N, cnt);
+}
@@ -0,0 +1,106 @@
+#include <a4/io/A4Stream.pb.h>
+#include <a4/message.h>
+#include <a4/input_stream.h>
+#include <a4/output_stream.h>
+
+#include "merge_plan.h"
+#include "proto_class_pool.h"
+
+#include <gtest/gtest.h>
+
+using namespace std;
+using namespace a4::io;
+
+static void write_pool_test(string filename, bool with_metadata) {
+    OutputStream w(filename, "TestEvent");
+    w.set_compression(OutputStream::ZLIB);
+    TestEvent e;
+    for(int i = 0; i < 100; i++) {
+        e.set_event_number(i);
+        w.write(e);
+    }
+    if (with_metadata) {
+        TestMetaData m;
+        m.set_meta_data(1);
+        w.metadata(m);
+    }
+}
+
+static vector<const google::protobuf::FileDescriptor*> read_pool_test(string filename) {
+    InputStream r(filename);
+    int cnt = 0;
+    while (shared<A4Message> msg = r.next())
+        EXPECT_EQ(cnt++, msg->as<TestEvent>()->event_number());
+    EXPECT_EQ(100, cnt);
+    return r.get_filedescriptors();
+}
+
+TEST(a4io, proto_class_pool_shared) {
+    write_pool_test("test_proto_class_pool1.a4", true);
+    write_pool_test("test_proto_class_pool2.a4", true);
+    write_pool_test("test_proto_class_pool3.a4", false);
+
+    auto first = read_pool_test("test_proto_class_pool1.a4");
+    ASSERT_FALSE(first.empty());
+    size_t schemas = ProtoClassPool::cached_schemas();
+
+    // the same schema is built only once
+    auto second = read_pool_test("test_proto_class_pool2.a4");
+    ASSERT_EQ(schemas, ProtoClassPool::cached_schemas());
+    ASSERT_EQ(first, second);
+
+    // a schema with fewer classes shares the common start
+    read_pool_test("test_proto_class_pool3.a4");
+    ASSERT_EQ(schemas, ProtoClassPool::cached_schemas());
+}
+
+static void add_file(const google::protobuf::FileDescriptor* fd, set<string>& seen, ProtoClass& pc) {
+    if (!seen.insert(fd->name()).second)
+        return;
+    for (int i = 0; i < fd->dependency_count(); i++)
+        add_file(fd->dependency(i), seen, pc);
+    fd->CopyTo(pc.add_file_descriptor());
+}
+
+TEST(a4io, proto_class_pool_merge_plan) {
+    ProtoClass pc;
+    pc.set_class_id(3);
+    pc.set_full_name(TestMergeMetaData::descriptor()->full_name());
+    set<string> seen;
+    add_file(TestMergeMetaData::descriptor()->file(), seen, pc);
+
+    shared<ProtoClassPool> pool(new ProtoClassPool());
+    pool->add_protoclass(pc);
+    const auto* d = pool->dynamic_descriptor(3);
+    ASSERT_NE(TestMergeMetaData::descriptor(), d);
+
+    // plans of dynamic classes are cached by the pool, not globally
+    auto plan = pool->merge_plan(d);
+    ASSERT_EQ(plan, pool->merge_plan(d));
+    ASSERT_NE(plan, MergePlan::get(d));
+    // compiled-in classes share one plan
+    ASSERT_EQ(MergePlan::get(TestMergeMetaData::descriptor()),
+              pool->merge_plan(TestMergeMetaData::descriptor()));
+
+    TestMergeMetaData m;
+    m.set_meta_data(2);
+    m.add_run(1);
+    shared<Message> m1(pool->get_new_message(d)), m2(pool->get_new_message(d));
+    m1->ParseFromString(m.SerializeAsString());
+    m2->ParseFromString(m.SerializeAsString());
+    A4Message merged(3, m1, pool);
+    merged += A4Message(3, m2, pool);
+    TestMergeMetaData result;
+    result.ParseFromString(merged.bytes());
+    ASSERT_EQ(4, result.meta_data());
+    ASSERT_EQ(1, result.run_size());
+
+    // pools with the same schema share the prototypes of its classes
+    shared<ProtoClassPool> pool2(new ProtoClassPool());
+    pool2->add_protoclass(pc);
+    ASSERT_EQ(d, pool2->dynamic_descriptor(3));
+    ASSERT_EQ(m1->GetReflection(), pool2->get_new_message(d)->GetReflection());
+    // compiled-in classes come from the generated factory
+    ASSERT_TRUE(dynamic_cast<TestMergeMetaData*>(
+        pool->get_new_message(TestMergeMetaData::descriptor()).get()));
+}
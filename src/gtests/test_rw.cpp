@@ -1,10 +1,14 @@
 #include <iostream>
+#include <fstream>
+#include <iterator>
 
 #include <a4/io/A4Stream.pb.h>
 #include <a4/message.h>
 #include <a4/input_stream.h>
 #include <a4/output_stream.h>
 
+#include "zero_copy_resource.h"
+
 #include <gtest/gtest.h>
 
 using namespace std;
@@ -36,3 +40,298 @@ TEST(a4io, read_write) {
         ASSERT_FALSE(r.error());
     }
 }
+
+TEST(a4io, parallel_compression) {
+    const int N = 100000;
+    OutputStream::CompressionType types[] = {OutputStream::ZLIB, OutputStream::LZ4};
+    for (int t = 0; t < 2; t++) {
+        {
+            OutputStream w("test_rw_parallel.a4", "TestEvent");
+            w.set_compression(types[t]).set_compression_threads(3);
+
+            TestEvent e;
+            for(int i = 0; i < N; i++) {
+                e.set_event_number(i);
+                w.write(e);
+            }
+            TestMetaData m;
+            m.set_meta_data(N);
+            w.metadata(m);
+        }
+        {
+            InputStream r("test_rw_parallel.a4");
+            int cnt = 0;
+            while (shared<A4Message> msg = r.next()) {
+                if (const TestEvent* te = msg->as<TestEvent>()) {
+                    ASSERT_EQ(cnt++, te->event_number());
+                }
+            }
+            ASSERT_FALSE(r.error());
+            ASSERT_EQ(N, cnt);
+        }
+    }
+}
+
+TEST(a4io, chunked_compression) {
+    const int N = 10000;
+    OutputStream::CompressionType types[] = {OutputStream::ZLIB, OutputStream::LZ4};
+    for (int t = 0; t < 2; t++) {
+        {
+            OutputStream w("test_rw_chunked.a4", "TestEvent");
+            w.set_compression(types[t]).set_chunk_size(0, 1000).set_event_index(1000);
+
+            TestEvent e;
+            for(int i = 0; i < N; i++) {
+                e.set_event_number(i);
+                w.write(e);
+            }
+        }
+        {
+            InputStream r("test_rw_chunked.a4");
+            int cnt = 0;
+            while (shared<A4Message> msg = r.next()) {
+                if (const TestEvent* te = msg->as<TestEvent>()) {
+                    ASSERT_EQ(cnt++, te->event_number());
+                }
+            }
+            ASSERT_FALSE(r.error());
+            ASSERT_EQ(N, cnt);
+        }
+        {
+            // every chunk starts a compressed section
+            InputStream r("test_rw_chunked.a4");
+            ASSERT_EQ(1u, r.footers().size());
+            const StreamFooter& footer = r.footers()[0];
+            ASSERT_EQ(N/1000, footer.event_index_size());
+            for (int i = 1; i < footer.event_index_size(); i++) {
+                ASSERT_LT(footer.event_index(i-1).section_offset(), footer.event_index(i).section_offset());
+                ASSERT_EQ(0, footer.event_index(i).inner_offset());
+            }
+        }
+    }
+}
+
+TEST(a4io, uring_resource) {
+    {
+        OutputStream w("test_rw_uring.a4", "TestEvent");
+        w.set_compression(OutputStream::LZ4);
+        TestEvent e;
+        for(int i = 0; i < 10000; i++) {
+            e.set_event_number(i);
+            w.write(e);
+        }
+    }
+    InputStream r("uring://test_rw_uring.a4");
+    int cnt = 0;
+    while (shared<A4Message> msg = r.next()) {
+        ASSERT_EQ(cnt++, msg->as<TestEvent>()->event_number());
+    }
+    ASSERT_FALSE(r.error());
+    ASSERT_EQ(10000, cnt);
+}
+
+TEST(a4io, uring_resource_clone) {
+    {
+        OutputStream w("test_rw_uring_clone.a4", "TestEvent");
+        w.set_compression(OutputStream::ZLIB);
+        TestEvent e;
+        for(int i = 0; i < 10000; i++) {
+            e.set_event_number(i);
+            w.write(e);
+        }
+    }
+    ifstream file("test_rw_uring_clone.a4", ios::binary);
+    string contents((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+
+    // The clone only opens the file when it is read
+    UnixFileURing f("test_rw_uring_clone.a4", 4096, 4);
+    UNIQUE<ZeroCopyStreamResource> clone = f.Clone(100);
+    ASSERT_TRUE(bool(clone));
+    ASSERT_FALSE(static_cast<UnixFileURing*>(clone.get())->uring());
+    ASSERT_EQ(100u, clone->Tell());
+    string read;
+    const void* data;
+    int size;
+    while (clone->Next(&data, &size))
+        read.append(static_cast<const char*>(data), size);
+    ASSERT_EQ(contents.substr(100), read);
+
+    InputStream r("uring://test_rw_uring_clone.a4");
+    int cnt = 0;
+    foreach (shared<InputStream> part, r.split()) {
+        while (shared<A4Message> msg = part->next())
+            ASSERT_EQ(cnt++, msg->as<TestEvent>()->event_number());
+        ASSERT_FALSE(part->error());
+    }
+    ASSERT_EQ(10000, cnt);
+}
+
+TEST(a4io, readahead_buffers) {
+    {
+        OutputStream w("test_rw_readahead.a4", "TestEvent");
+        TestEvent e;
+        for(int i = 0; i < 100000; i++) {
+            e.set_event_number(i);
+            w.write(e);
+        }
+    }
+    // Buffers are at most half the readahead window, so that the window
+    // moves along with the reader
+    UnixFileMMap f("test_rw_readahead.a4");
+    f.set_readahead(64*1024);
+    const void* data;
+    int size;
+    size_t total = 0;
+    while (f.Next(&data, &size)) {
+        ASSERT_LE(size, 32*1024);
+        total += size;
+    }
+    ASSERT_LT(size_t(64*1024), total);
+
+    InputStream r("test_rw_readahead.a4");
+    r.set_readahead(64*1024);
+    int cnt = 0;
+    while (shared<A4Message> msg = r.next()) {
+        ASSERT_EQ(cnt++, msg->as<TestEvent>()->event_number());
+    }
+    ASSERT_FALSE(r.error());
+    ASSERT_EQ(100000, cnt);
+}
+
+TEST(a4io, hint_copy_passthrough) {
+    OutputStream::CompressionType types[] = {OutputStream::LZ4, OutputStream::UNCOMPRESSED};
+    for (int t = 0; t < 2; t++) {
+        {
+            OutputStream w("test_rw_hint_copy_in.a4", "TestEvent");
+            w.set_compression(types[t]);
+            TestEvent e;
+            for(int i = 0; i < 30000; i++) {
+                e.set_event_number(i);
+                w.write(e);
+            }
+        }
+        {
+            InputStream r("test_rw_hint_copy_in.a4");
+            r.set_hint_copy(true);
+            OutputStream w("test_rw_hint_copy_out.a4", "TestEvent");
+            w.set_compression(types[1-t]);
+            int cnt = 0;
+            while (shared<A4Message> msg = r.next()) {
+                // accessed messages take the regular path
+                if (cnt % 10 == 0)
+                    ASSERT_EQ(cnt, msg->as<TestEvent>()->event_number());
+                w.write(msg);
+                cnt++;
+            }
+            ASSERT_FALSE(r.error());
+        }
+        InputStream r("test_rw_hint_copy_out.a4");
+        int cnt = 0;
+        while (shared<A4Message> msg = r.next()) {
+            ASSERT_EQ(cnt++, msg->as<TestEvent>()->event_number());
+        }
+        ASSERT_FALSE(r.error());
+        ASSERT_EQ(30000, cnt);
+    }
+}
+
+TEST(a4io, hint_copy_consumed) {
+    {
+        OutputStream w("test_rw_hint_copy_in.a4", "TestEvent");
+        w.set_compression(OutputStream::ZLIB);
+        TestEvent e;
+        for(int i = 0; i < 1000; i++) {
+            e.set_event_number(i);
+            w.write(e);
+        }
+    }
+    {
+        InputStream r("test_rw_hint_copy_in.a4");
+        r.set_hint_copy(true);
+        OutputStream w1("test_rw_hint_copy_out1.a4", "TestEvent");
+        OutputStream w2("test_rw_hint_copy_out2.a4", "TestEvent");
+        int cnt = 0;
+        while (shared<A4Message> msg = r.next()) {
+            if (cnt % 2) {
+                // accessed messages are read and can be written twice
+                ASSERT_EQ(cnt, msg->as<TestEvent>()->event_number());
+                ASSERT_TRUE(w1.write(msg));
+                ASSERT_TRUE(w2.write(msg));
+                ASSERT_FALSE(msg->consumed());
+            } else {
+                // unread messages are copied without keeping their bytes
+                ASSERT_TRUE(w1.write(msg));
+                ASSERT_TRUE(msg->consumed());
+                ASSERT_THROW(msg->message(), a4::Fatal);
+                ASSERT_THROW(w2.write(msg), a4::Fatal);
+            }
+            cnt++;
+        }
+        ASSERT_FALSE(r.error());
+    }
+    const char* outputs[] = {"test_rw_hint_copy_out1.a4", "test_rw_hint_copy_out2.a4"};
+    for (int o = 0; o < 2; o++) {
+        InputStream r(outputs[o]);
+        int cnt = o;
+        while (shared<A4Message> msg = r.next()) {
+            ASSERT_EQ(cnt, msg->as<TestEvent>()->event_number());
+            cnt += o + 1;
+        }
+        ASSERT_FALSE(r.error());
+        ASSERT_EQ(o ? 1001 : 1000, cnt);
+    }
+}
+
+TEST(a4io, write_range) {
+    const int N = 10000;
+    {
+        OutputStream w("test_rw_range.a4", "TestEvent");
+        vector<TestEvent> events(1000);
+        for(int i = 0; i < N; i += events.size()) {
+            for (size_t j = 0; j < events.size(); j++)
+                events[j].set_event_number(i + j);
+            ASSERT_TRUE(w.write(events.begin(), events.end()));
+        }
+    }
+    InputStream r("test_rw_range.a4");
+    int cnt = 0;
+    while (shared<A4Message> msg = r.next()) {
+        ASSERT_EQ(cnt++, msg->as<TestEvent>()->event_number());
+    }
+    ASSERT_FALSE(r.error());
+    ASSERT_EQ(N, cnt);
+}
+
+TEST(a4io, recycle_messages) {
+    const int N = 10000;
+    {
+        OutputStream w("test_rw_recycle.a4", "TestEvent");
+        TestEvent e;
+        TestMetaData m;
+        for(int i = 0; i < N; i++) {
+            e.set_event_number(i);
+            w.write(e);
+            if (i % 1000 == 999) {
+                m.set_meta_data(i);
+                w.metadata(m);
+            }
+        }
+    }
+    InputStream r("test_rw_recycle.a4");
+    r.set_recycle_messages(true);
+    shared<A4Message> kept;
+    const A4Message* last = NULL;
+    int cnt = 0, reused = 0;
+    while (shared<A4Message> msg = r.next()) {
+        ASSERT_EQ(cnt, msg->as<TestEvent>()->event_number());
+        ASSERT_EQ(cnt/1000*1000 + 999, r.current_metadata()->as<TestMetaData>()->meta_data());
+        if (msg.get() == last) reused++;
+        last = msg.get();
+        if (cnt == 42) kept = msg;
+        cnt++;
+    }
+    ASSERT_FALSE(r.error());
+    ASSERT_EQ(N, cnt);
+    ASSERT_GT(reused, N/2);
+    ASSERT_EQ(42, kept->as<TestEvent>()->event_number());
+}
@@ -0,0 +1,52 @@
+#include <iostream>
+
+#include <a4/io/A4Stream.pb.h>
+#include <a4/message.h>
+#include <a4/input_stream.h>
+#include <a4/output_stream.h>
+
+#include <gtest/gtest.h>
+
+using namespace std;
+using namespace a4::io;
+
+void write_seek_test(string filename, bool event_index) {
+    OutputStream w(filename, "TestEvent");
+    if (event_index) w.set_event_index(100);
+
+    TestEvent e;
+    for(int i = 0; i < 10000; i++) {
+        e.set_event_number(i);
+        w.write(e);
+        if (i % 1000 == 999) {
+            TestMetaData m;
+            m.set_meta_data(i);
+            w.metadata(m);
+        }
+    }
+}
+
+void check_seek_test(string filename) {
+    const int events[] = {0, 1, 99, 100, 2500, 4999, 9999};
+    foreach (int n, events) {
+        InputStream r(filename);
+        ASSERT_TRUE(r.seek_to_event(n));
+        shared<A4Message> msg = r.next();
+        ASSERT_TRUE(msg);
+        ASSERT_EQ(n, msg->as<TestEvent>()->event_number());
+        // backward metadata: the one written after this block
+        ASSERT_EQ(n/1000*1000 + 999, r.current_metadata()->as<TestMetaData>()->meta_data());
+    }
+    InputStream r(filename);
+    ASSERT_FALSE(r.seek_to_event(10000));
+}
+
+TEST(a4io, seek_to_event) {
+    write_seek_test("test_seek_to_event.a4", true);
+    check_seek_test("test_seek_to_event.a4");
+}
+
+TEST(a4io, seek_to_event_without_index) {
+    write_seek_test("test_seek_to_event_noindex.a4", false);
+    check_seek_test("test_seek_to_event_noindex.a4");
+}
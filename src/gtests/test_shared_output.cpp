@@ -0,0 +1,146 @@
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fstream>
+
+#include <boost/thread.hpp>
+
+#include <a4/io/A4Stream.pb.h>
+#include <a4/message.h>
+#include <a4/input_stream.h>
+#include <a4/output.h>
+#include <a4/output_stream.h>
+
+#include <gtest/gtest.h>
+
+using namespace std;
+using namespace a4::io;
+
+const int THREADS = 4;
+const int EVENTS = 5000;
+
+// Events of thread t are t*EVENTS + i, metadata is the event number divided by 100
+static void write_thread(A4Output* output, int t, bool forward) {
+    shared<OutputStream> w = output->get_stream("", forward);
+    w->set_compression(OutputStream::ZLIB);
+    TestEvent e;
+    TestMetaData m;
+    for (int i = t*EVENTS; i < (t+1)*EVENTS; i++) {
+        if (forward && i % 100 == 0) {
+            m.set_meta_data(i / 100);
+            w->metadata(m);
+        }
+        e.set_event_number(i);
+        w->write(e);
+        if (!forward && i % 100 == 99) {
+            m.set_meta_data(i / 100);
+            w->metadata(m);
+        }
+    }
+}
+
+static void write_output(string filename, bool forward, bool single_writer, bool* success) {
+    A4Output output(filename, "TestEvent");
+    if (single_writer)
+        output.set_single_writer(1024, 2);
+    else
+        output.set_shared_file(1024);
+    boost::thread_group threads;
+    for (int t = 0; t < THREADS; t++)
+        threads.create_thread(boost::bind(&write_thread, &output, t, forward));
+    threads.join_all();
+    *success = output.close();
+}
+
+static void check_output(string filename, bool forward) {
+    InputStream r(filename);
+    vector<bool> seen(THREADS*EVENTS);
+    int cnt = 0;
+    while (shared<A4Message> msg = r.next()) {
+        int n = msg->as<TestEvent>()->event_number();
+        ASSERT_FALSE(seen[n]);
+        seen[n] = true;
+        ASSERT_EQ(n / 100, r.current_metadata()->as<TestMetaData>()->meta_data());
+        cnt++;
+    }
+    ASSERT_FALSE(r.error());
+    ASSERT_EQ(THREADS*EVENTS, cnt);
+    // several sections per thread
+    InputStream r2(filename);
+    ASSERT_GT(r2.footers().size(), size_t(THREADS));
+}
+
+static void check_shared_output(string filename, bool forward, bool single_writer) {
+    bool success = false;
+    write_output(filename, forward, single_writer, &success);
+    ASSERT_TRUE(success);
+    struct stat buffer;
+    ASSERT_EQ(-1, stat((filename + ".1").c_str(), &buffer));
+    check_output(filename, forward);
+}
+
+static void copy_fifo(string fifo, string filename) {
+    std::ifstream in(fifo.c_str(), std::ios::binary);
+    std::ofstream out(filename.c_str(), std::ios::binary);
+    out << in.rdbuf();
+}
+
+TEST(a4io, shared_output_backward) {
+    check_shared_output("test_shared_output_bw.a4", false, false);
+}
+
+TEST(a4io, shared_output_forward) {
+    check_shared_output("test_shared_output_fw.a4", true, false);
+}
+
+TEST(a4io, single_writer_backward) {
+    check_shared_output("test_single_writer_bw.a4", false, true);
+}
+
+TEST(a4io, single_writer_forward) {
+    check_shared_output("test_single_writer_fw.a4", true, true);
+}
+
+TEST(a4io, single_writer_fifo) {
+    string fifo = "test_single_writer.fifo";
+    unlink(fifo.c_str());
+    ASSERT_EQ(0, mkfifo(fifo.c_str(), 0600));
+    boost::thread reader(boost::bind(&copy_fifo, fifo, "test_single_writer_fifo.a4"));
+    bool success = false;
+    write_output(fifo, false, true, &success);
+    reader.join();
+    unlink(fifo.c_str());
+    ASSERT_TRUE(success);
+    check_output("test_single_writer_fifo.a4", false);
+}
+
+// Streams without metadata do not buffer all events until close()
+static void check_shared_output_without_metadata(string filename, bool forward, int events) {
+    {
+        A4Output output(filename, "TestEvent");
+        output.set_shared_file(64*1024);
+        shared<OutputStream> w = output.get_stream("", forward);
+        w->set_compression(OutputStream::ZLIB);
+        TestEvent e;
+        for (int i = 0; i < events; i++) {
+            e.set_event_number(i);
+            w->write(e);
+        }
+        w.reset();
+        ASSERT_TRUE(output.close());
+    }
+    InputStream r(filename);
+    int cnt = 0;
+    while (shared<A4Message> msg = r.next())
+        ASSERT_EQ(cnt++, msg->as<TestEvent>()->event_number());
+    ASSERT_FALSE(r.error());
+    ASSERT_EQ(events, cnt);
+    InputStream r2(filename);
+    ASSERT_GT(r2.footers().size(), size_t(1));
+}
+
+TEST(a4io, shared_output_without_metadata) {
+    // forward streams end sections at events before their first metadata,
+    // backward ones once the sections reach the hard limit
+    check_shared_output_without_metadata("test_shared_output_nomd_fw.a4", true, 10*EVENTS);
+    check_shared_output_without_metadata("test_shared_output_nomd_bw.a4", false, 100*EVENTS);
+}
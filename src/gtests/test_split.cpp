@@ -0,0 +1,138 @@
+#include <atomic>
+#include <iostream>
+
+#include <a4/io/A4Stream.pb.h>
+#include <a4/message.h>
+#include <a4/input.h>
+#include <a4/input_stream.h>
+#include <a4/output_stream.h>
+
+#include <boost/thread.hpp>
+
+#include <gtest/gtest.h>
+
+#include "block_files.h"
+
+using namespace std;
+using namespace a4::io;
+
+const int N = 10000;
+
+void check_split_test(string filename, bool forward, int block_size=1000) {
+    InputStream r(filename);
+    vector<shared<InputStream>> parts = r.split();
+    ASSERT_LE(10u, parts.size());
+    vector<int> seen(N);
+    foreach (shared<InputStream> part, parts) {
+        while (shared<A4Message> msg = part->next()) {
+            int n = msg->as<TestEvent>()->event_number();
+            seen[n]++;
+            ASSERT_EQ(block_test_metadata(n, forward, block_size), part->current_metadata()->as<TestMetaData>()->meta_data());
+        }
+        ASSERT_FALSE(part->error());
+    }
+    for (int i = 0; i < N; i++)
+        ASSERT_EQ(1, seen[i]);
+}
+
+TEST(a4io, split_backward) {
+    write_block_test("test_split_bw.a4", false, 0, N, 1000, OutputStream::LZ4);
+    check_split_test("test_split_bw.a4", false);
+    write_block_test("test_split_bw_uncompressed.a4", false, 0, N, 1000, OutputStream::UNCOMPRESSED);
+    check_split_test("test_split_bw_uncompressed.a4", false);
+}
+
+TEST(a4io, split_forward) {
+    write_block_test("test_split_fw.a4", true, 0, N, 1000, OutputStream::ZLIB);
+    check_split_test("test_split_fw.a4", true);
+    write_block_test("test_split_fw_uncompressed.a4", true, 0, N, 1000, OutputStream::UNCOMPRESSED);
+    check_split_test("test_split_fw_uncompressed.a4", true);
+}
+
+TEST(a4io, split_chunks) {
+    // a single metadata block is split at the chunks in the footer
+    const vector<string> no_zone_maps;
+    write_block_test("test_split_chunks_bw.a4", false, 0, N, N, OutputStream::ZLIB, no_zone_maps, 1000);
+    check_split_test("test_split_chunks_bw.a4", false, N);
+    write_block_test("test_split_chunks_fw.a4", true, 0, N, N, OutputStream::ZLIB, no_zone_maps, 1000);
+    check_split_test("test_split_chunks_fw.a4", true, N);
+    write_block_test("test_split_chunks_bw_uncompressed.a4", false, 0, N, N, OutputStream::UNCOMPRESSED, no_zone_maps, 1000);
+    check_split_test("test_split_chunks_bw_uncompressed.a4", false, N);
+    write_block_test("test_split_chunks_fw_uncompressed.a4", true, 0, N, N, OutputStream::UNCOMPRESSED, no_zone_maps, 1000);
+    check_split_test("test_split_chunks_fw_uncompressed.a4", true, N);
+}
+
+TEST(a4io, split_input) {
+    write_block_test("test_split_input.a4", false, 0, N, 1000, OutputStream::LZ4);
+    A4Input in;
+    in.add_file("test_split_input.a4").set_split_files();
+    int streams = 0, cnt = 0;
+    while (shared<InputStream> s = in.get_stream()) {
+        streams++;
+        while (shared<A4Message> msg = s->next())
+            cnt++;
+    }
+    ASSERT_LE(10, streams);
+    ASSERT_EQ(N, cnt);
+}
+
+TEST(a4io, split_input_work_stealing) {
+    write_block_test("test_split_input.a4", false, 0, N, 1000, OutputStream::LZ4);
+    write_block_test("test_split_input_small.a4", false, 0, N, 1000, OutputStream::ZLIB);
+    A4Input in;
+    in.set_work_stealing(2).set_split_files();
+    in.add_file("test_split_input_small.a4").add_file("test_split_input.a4");
+    int cnt = 0;
+    while (shared<InputStream> s = in.get_stream()) {
+        while (shared<A4Message> msg = s->next())
+            cnt++;
+    }
+    ASSERT_EQ(2*N, cnt);
+}
+
+// Read all streams of the input on the given number of threads,
+// returns the number of threads that got a stream
+int read_split_input_threads(A4Input& in, int workers, std::atomic<int>& cnt) {
+    std::atomic<int> busy_workers(0);
+    boost::thread_group threads;
+    for (int t = 0; t < workers; t++) {
+        threads.create_thread([&]() {
+            bool busy = false;
+            while (shared<InputStream> s = in.get_stream()) {
+                busy = true;
+                while (shared<A4Message> msg = s->next())
+                    cnt++;
+                boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+            }
+            if (busy)
+                busy_workers++;
+        });
+    }
+    threads.join_all();
+    return busy_workers;
+}
+
+TEST(a4io, split_input_threads) {
+    write_block_test("test_split_input_threads.a4", false, 0, N, 1000, OutputStream::ZLIB);
+    A4Input in;
+    in.set_split_files();
+    in.add_file("test_split_input_threads.a4");
+
+    // One thread splits the only file, the others wait for its parts
+    std::atomic<int> cnt(0);
+    ASSERT_LT(1, read_split_input_threads(in, 4, cnt));
+    ASSERT_EQ(N, cnt);
+}
+
+TEST(a4io, split_input_work_stealing_threads) {
+    write_block_test("test_split_input_threads.a4", false, 0, N, 1000, OutputStream::ZLIB);
+    A4Input in;
+    const int workers = 4;
+    in.set_work_stealing(workers).set_split_files();
+    in.add_file("test_split_input_threads.a4");
+
+    // One worker splits the only file, the others wait for its parts
+    std::atomic<int> cnt(0);
+    ASSERT_LT(1, read_split_input_threads(in, workers, cnt));
+    ASSERT_EQ(N, cnt);
+}
@@ -0,0 +1,130 @@
+#include <string>
+#include <vector>
+#include <random>
+
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+#include <google/protobuf/wire_format_lite.h>
+
+#include "varint.h"
+
+#include <gtest/gtest.h>
+
+using namespace std;
+using namespace a4::io;
+using google::protobuf::io::CodedInputStream;
+using google::protobuf::io::CodedOutputStream;
+using google::protobuf::io::StringOutputStream;
+using google::protobuf::internal::WireFormatLite;
+
+/// Edge cases and random values of all lengths, with runs of small values
+static vector<uint64_t> corpus() {
+    vector<uint64_t> values;
+    for (int bit = 0; bit < 64; bit++) {
+        values.push_back(uint64_t(1) << bit);
+        values.push_back((uint64_t(1) << bit) - 1);
+    }
+    values.push_back(~uint64_t(0));
+    values.push_back(uint64_t(int64_t(INT32_MIN)));
+    values.push_back(uint64_t(int64_t(-1)));
+    std::mt19937_64 rng(42);
+    for (int i = 0; i < 5000; i++) {
+        if (i % 100 < 70)
+            values.push_back(rng() % 128);
+        else
+            values.push_back(rng() >> (rng() % 64));
+    }
+    return values;
+}
+
+template<typename Writer>
+static string encode(const vector<uint64_t>& values, Writer write) {
+    string s;
+    {
+        StringOutputStream out(&s);
+        CodedOutputStream coded(&out);
+        for (size_t i = 0; i < values.size(); i++)
+            write(coded, values[i]);
+    }
+    return s;
+}
+
+static const uint8_t* wire_begin(const string& s) { return reinterpret_cast<const uint8_t*>(s.data()); }
+static const uint8_t* wire_end(const string& s) { return wire_begin(s) + s.size(); }
+
+TEST(a4io, varint_kernels) {
+    const vector<uint64_t> values = corpus();
+    const string wire64 = encode(values, [](CodedOutputStream& o, uint64_t v) { o.WriteVarint64(v); });
+    const string wire32 = encode(values, [](CodedOutputStream& o, uint64_t v) { o.WriteVarint32SignExtended(int32_t(v)); });
+    const string zigzag32 = encode(values, [](CodedOutputStream& o, uint64_t v) {
+        o.WriteVarint32(WireFormatLite::ZigZagEncode32(int32_t(v))); });
+    const string zigzag64 = encode(values, [](CodedOutputStream& o, uint64_t v) {
+        o.WriteVarint64(WireFormatLite::ZigZagEncode64(int64_t(v))); });
+
+    // reference decoding by protobuf
+    vector<uint64_t> expected64;
+    vector<uint32_t> expected32, expected_zigzag32;
+    vector<uint64_t> expected_zigzag64;
+    {
+        CodedInputStream in64(wire_begin(wire64), wire64.size());
+        CodedInputStream in32(wire_begin(wire32), wire32.size());
+        CodedInputStream inz32(wire_begin(zigzag32), zigzag32.size());
+        CodedInputStream inz64(wire_begin(zigzag64), zigzag64.size());
+        for (size_t i = 0; i < values.size(); i++) {
+            uint64_t v64;
+            uint32_t v32;
+            ASSERT_TRUE(in64.ReadVarint64(&v64));
+            expected64.push_back(v64);
+            ASSERT_TRUE(in32.ReadVarint32(&v32));
+            expected32.push_back(v32);
+            ASSERT_TRUE(inz32.ReadVarint32(&v32));
+            expected_zigzag32.push_back(WireFormatLite::ZigZagDecode32(v32));
+            ASSERT_TRUE(inz64.ReadVarint64(&v64));
+            expected_zigzag64.push_back(WireFormatLite::ZigZagDecode64(v64));
+        }
+    }
+
+    vector<const VarintKernels*> kernels = supported_varint_kernels();
+    ASSERT_EQ(string("scalar"), kernels[0]->name);
+    ASSERT_EQ(kernels.back(), &varint_kernels());
+    foreach (const VarintKernels* k, kernels) {
+        SCOPED_TRACE(k->name);
+        const size_t n = values.size();
+        ASSERT_EQ(n, k->count(wire_begin(wire64), wire_end(wire64)));
+        ASSERT_EQ(n, k->count(wire_begin(wire32), wire_end(wire32)));
+
+        vector<uint64_t> out64(n);
+        ASSERT_EQ(int64_t(n), k->decode64(wire_begin(wire64), wire_end(wire64), &out64[0]));
+        ASSERT_EQ(expected64, out64);
+        ASSERT_EQ(int64_t(n), k->decode64(wire_begin(zigzag64), wire_end(zigzag64), &out64[0]));
+        k->zigzag64(&out64[0], n);
+        ASSERT_EQ(expected_zigzag64, out64);
+
+        vector<uint32_t> out32(n);
+        ASSERT_EQ(int64_t(n), k->decode32(wire_begin(wire32), wire_end(wire32), &out32[0]));
+        ASSERT_EQ(expected32, out32);
+        ASSERT_EQ(int64_t(n), k->decode32(wire_begin(zigzag32), wire_end(zigzag32), &out32[0]));
+        k->zigzag32(&out32[0], n);
+        ASSERT_EQ(expected_zigzag32, out32);
+
+        // all tail lengths of a run of small values
+        const string small(100, '\x05');
+        for (size_t len = 0; len <= small.size(); len++) {
+            ASSERT_EQ(len, k->count(wire_begin(small), wire_begin(small) + len));
+            ASSERT_EQ(int64_t(len), k->decode32(wire_begin(small), wire_begin(small) + len, &out32[0]));
+            ASSERT_EQ(int64_t(len), k->decode64(wire_begin(small), wire_begin(small) + len, &out64[0]));
+            for (size_t i = 0; i < len; i++) {
+                ASSERT_EQ(5u, out32[i]);
+                ASSERT_EQ(5u, out64[i]);
+            }
+        }
+
+        // truncated and overlong varints
+        string truncated = small + "\x80\x80";
+        ASSERT_EQ(-1, k->decode32(wire_begin(truncated), wire_end(truncated), &out32[0]));
+        ASSERT_EQ(-1, k->decode64(wire_begin(truncated), wire_end(truncated), &out64[0]));
+        string overlong = small + string(10, '\xff') + '\x01' + small;
+        ASSERT_EQ(-1, k->decode32(wire_begin(overlong), wire_end(overlong), &out32[0]));
+        ASSERT_EQ(-1, k->decode64(wire_begin(overlong), wire_end(overlong), &out64[0]));
+    }
+}
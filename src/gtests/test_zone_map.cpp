@@ -0,0 +1,82 @@
+#include <a4/io/A4Stream.pb.h>
+#include <a4/message.h>
+#include <a4/input_stream.h>
+#include <a4/output_stream.h>
+
+#include <gtest/gtest.h>
+
+#include "block_files.h"
+
+using namespace std;
+using namespace a4::io;
+
+const int N = 10000;
+
+static void check_zone_map_test(string filename, bool forward) {
+    {
+        InputStream r(filename);
+        r.add_zone_filter("event_number", 2500, 3499.5);
+        r.add_zone_filter("event_number", 0, 3200);
+        int cnt = 0;
+        while (shared<A4Message> msg = r.next()) {
+            int n = msg->as<TestEvent>()->event_number();
+            ASSERT_EQ(2000 + cnt, n);
+            ASSERT_EQ(block_test_metadata(n, forward), r.current_metadata()->as<TestMetaData>()->meta_data());
+            cnt++;
+        }
+        ASSERT_FALSE(r.error());
+        ASSERT_EQ(2000, cnt);
+    }
+    {
+        // the second file starts at N
+        InputStream r(filename);
+        r.add_zone_filter("event_number", N + 8500, N + 8500);
+        int cnt = 0;
+        while (shared<A4Message> msg = r.next())
+            ASSERT_EQ(N + 8000 + cnt++, msg->as<TestEvent>()->event_number());
+        ASSERT_FALSE(r.error());
+        ASSERT_EQ(1000, cnt);
+    }
+    {
+        // nothing matches, or there is no zone map to decide
+        InputStream r(filename);
+        r.add_zone_filter("event_number", -10, -1);
+        ASSERT_FALSE(r.next());
+        ASSERT_FALSE(r.error());
+        InputStream r2(filename);
+        r2.add_zone_filter("event_data", -10, -1);
+        int cnt = 0;
+        while (r2.next())
+            cnt++;
+        ASSERT_EQ(2*N, cnt);
+    }
+    {
+        InputStream r(filename);
+        r.add_zone_filter("event_number", 4000, 5999);
+        vector<shared<InputStream>> parts = r.split();
+        ASSERT_EQ(2u, parts.size());
+        int cnt = 0;
+        foreach (shared<InputStream> part, parts) {
+            while (shared<A4Message> msg = part->next()) {
+                int n = msg->as<TestEvent>()->event_number();
+                ASSERT_TRUE(n >= 4000 && n < 6000);
+                cnt++;
+            }
+        }
+        ASSERT_EQ(2000, cnt);
+    }
+}
+
+TEST(a4io, zone_map_backward) {
+    write_block_test("test_zone_map_bw1.a4", false, 0, N, 1000, OutputStream::ZLIB, vector<string>(1, "event_number"));
+    write_block_test("test_zone_map_bw2.a4", false, N, N, 1000, OutputStream::ZLIB, vector<string>(1, "event_number"));
+    concatenate("test_zone_map_bw1.a4", "test_zone_map_bw2.a4", "test_zone_map_bw.a4");
+    check_zone_map_test("test_zone_map_bw.a4", false);
+}
+
+TEST(a4io, zone_map_forward) {
+    write_block_test("test_zone_map_fw1.a4", true, 0, N, 1000, OutputStream::ZLIB, vector<string>(1, "event_number"));
+    write_block_test("test_zone_map_fw2.a4", true, N, N, 1000, OutputStream::ZLIB, vector<string>(1, "event_number"));
+    concatenate("test_zone_map_fw1.a4", "test_zone_map_fw2.a4", "test_zone_map_fw.a4");
+    check_zone_map_test("test_zone_map_fw.a4", true);
+}
@@ -4,6 +4,7 @@
 
 #include <unordered_set>
 
+#include <algorithm>
 #include <functional>
 #include <string>
 #include <iostream>
@@ -11,6 +12,8 @@
 #include <boost/thread.hpp>
 #include <boost/thread/locks.hpp>
 
+#include <sys/stat.h>
+
 #include <a4/input_stream.h>
 
 namespace a4 {
@@ -19,7 +22,7 @@ namespace io {
 
 typedef boost::unique_lock<boost::mutex> Lock;
 
-A4Input::A4Input(std::string name) {}
+A4Input::A4Input(std::string name) : _split_files(false), _splitting(0), _distributed(false), _next_worker(0) {}
 
 /// Add a stream to be processed, Returns this object again.
 A4Input& A4Input::add_stream(shared<InputStream> s) {
@@ -37,16 +40,191 @@ A4Input& A4Input::add_file(const std::string& filename, bool check_duplicates) {
     return *this;
 }
 
-InputStream* A4Input::pop_file() {
-    if (_filenames.empty())
-        return NULL;
+/// Open the next file and queue all but the first of its parts.
+/// Called with _mutex held, which is released while the file is split.
+InputStream* A4Input::pop_file(Lock& lock) {
     std::string filename = _filenames.front();
     _filenames.pop_front();
-    shared<InputStream> s(new InputStream(filename));
+    if (!_split_files) {
+        shared<InputStream> s(new InputStream(filename));
+        _streams.push_back(s);
+        return s.get();
+    }
+
+    // Other threads wait for the parts instead of finding nothing to do
+    _splitting++;
+    lock.unlock();
+    std::vector<shared<InputStream>> parts;
+    shared<InputStream> s;
+    try {
+        s.reset(new InputStream(filename));
+        parts = s->split();
+    } catch (...) {
+        lock.lock();
+        _splitting--;
+        _work_added.notify_all();
+        throw;
+    }
+    lock.lock();
+    if (parts.size() > 0) {
+        // Hand out the first part now, the others in order after it
+        for (int i = parts.size() - 1; i > 0; i--) {
+            _streams.push_back(parts[i]);
+            _ready.push_back(parts[i].get());
+        }
+        s = parts[0];
+    }
     _streams.push_back(s);
+    _splitting--;
+    _work_added.notify_all();
     return s.get();
 }
 
+A4Input& A4Input::set_work_stealing(int workers) {
+    Lock lock(_mutex);
+    if (_distributed)
+        FATAL("set_work_stealing() has to be called before get_stream()!");
+    _queues.clear();
+    for (int i = 0; i < workers; i++)
+        _queues.push_back(shared<WorkQueue>(new WorkQueue()));
+    return *this;
+}
+
+/// Insert a unit after all units of at least its size.
+void A4Input::WorkQueue::push(const WorkUnit& unit) {
+    auto it = units.begin();
+    while (it != units.end() and it->size >= unit.size)
+        ++it;
+    units.insert(it, unit);
+}
+
+static bool larger_unit(const std::pair<uint64_t, std::string>& a, const std::pair<uint64_t, std::string>& b) {
+    return a.first > b.first;
+}
+
+/// Distribute all files added so far on the worker queues, largest first,
+/// each to the queue with the least total size. Called with _mutex held.
+void A4Input::distribute_files() {
+    _distributed = true;
+    std::vector<std::pair<uint64_t, std::string>> files;
+    while (!_filenames.empty()) {
+        struct stat buffer;
+        const std::string& filename = _filenames.front();
+        uint64_t size = (stat(filename.c_str(), &buffer) == 0) ? buffer.st_size : 0;
+        files.push_back(std::make_pair(size, filename));
+        _filenames.pop_front();
+    }
+    std::stable_sort(files.begin(), files.end(), larger_unit);
+    std::vector<uint64_t> load(_queues.size(), 0);
+    for (size_t i = 0; i < files.size(); i++) {
+        size_t q = std::min_element(load.begin(), load.end()) - load.begin();
+        load[q] += files[i].first;
+        WorkUnit unit;
+        unit.size = files[i].first;
+        unit.filename = files[i].second;
+        _queues[q]->units.push_back(unit);
+    }
+}
+
+/// Take the largest unit of the own queue, or else steal the
+/// largest unit of any other queue. Returns false if all are empty.
+/// Files that will be split are counted in _splitting before they leave
+/// their queue, so that no worker sees neither the file nor its split.
+bool A4Input::take_unit(size_t worker, WorkUnit& unit) {
+    {
+        WorkQueue& own = *_queues[worker];
+        Lock lock(own.mutex);
+        if (!own.units.empty()) {
+            unit = own.units.front();
+            own.units.pop_front();
+            if (_split_files and !unit.stream)
+                _splitting++;
+            return true;
+        }
+    }
+    while (true) {
+        bool found = false;
+        size_t victim = 0;
+        uint64_t largest = 0;
+        for (size_t i = 0; i < _queues.size(); i++) {
+            Lock lock(_queues[i]->mutex);
+            if (!_queues[i]->units.empty() and (!found or _queues[i]->units.front().size > largest)) {
+                found = true;
+                victim = i;
+                largest = _queues[i]->units.front().size;
+            }
+        }
+        if (!found)
+            return false;
+        WorkQueue& other = *_queues[victim];
+        Lock lock(other.mutex);
+        if (other.units.empty())
+            continue; // another thread was faster
+        unit = other.units.front();
+        other.units.pop_front();
+        if (_split_files and !unit.stream)
+            _splitting++;
+        return true;
+    }
+}
+
+/// Called when a worker has queued the parts of a file it took
+void A4Input::split_done() {
+    Lock lock(_mutex);
+    _splitting--;
+    _work_added.notify_all();
+}
+
+shared<InputStream> A4Input::get_stream_work_stealing() {
+    if (!_worker.get()) {
+        Lock lock(_mutex);
+        if (!_distributed)
+            distribute_files();
+        _worker.reset(new size_t(_next_worker++ % _queues.size()));
+    }
+    WorkUnit unit;
+    if (!take_unit(*_worker, unit)) {
+        // Files that other workers are splitting may still add stealable
+        // parts. The queues are checked with _mutex held, so a finished
+        // split can not be missed between the check and the wait.
+        Lock lock(_mutex);
+        while (!take_unit(*_worker, unit)) {
+            if (_splitting == 0)
+                return shared<InputStream>();
+            _work_added.wait(lock);
+        }
+    }
+
+    shared<InputStream> s = unit.stream;
+    if (!s and !_split_files) {
+        s.reset(new InputStream(unit.filename));
+    } else if (!s) {
+        try {
+            s.reset(new InputStream(unit.filename));
+            std::vector<shared<InputStream>> parts = s->split();
+            if (parts.size() > 0) {
+                // Queue the other parts locally, where they can be stolen
+                WorkQueue& own = *_queues[*_worker];
+                Lock lock(own.mutex);
+                for (size_t i = 1; i < parts.size(); i++) {
+                    WorkUnit part;
+                    part.size = unit.size / parts.size();
+                    part.stream = parts[i];
+                    own.push(part);
+                }
+                s = parts[0];
+            }
+        } catch (...) {
+            split_done();
+            throw;
+        }
+        split_done();
+    }
+    Lock lock(_mutex);
+    _streams.push_back(s);
+    return make_stream(s.get());
+}
+
 /// Callback executed when a stream is deleted.
 /// Collates errors, reschedules unfinished streams.
 void A4Input::report_finished(A4Input* input, InputStream* _s) {
@@ -72,18 +250,34 @@ void A4Input::report_finished(A4Input* input, InputStream* _s) {
 
 /// Get a stream for processing, returns NULL if none are left (threadsafe).
 shared<InputStream> A4Input::get_stream() {
+    if (_queues.size() > 0) {
+        shared<InputStream> s = get_stream_work_stealing();
+        if (s)
+            return s;
+        // Rescheduled streams and late files are handled below
+    }
     Lock lock(_mutex);
     InputStream* s = NULL;
-    if (!_ready.empty()) {
-        s = _ready.back();
-        
-        _ready.pop_back();
-    } else if (!_filenames.empty()) {
-        s = pop_file();
-    } else {
-        return shared<InputStream>();
+    while (!s) {
+        if (!_ready.empty()) {
+            s = _ready.back();
+            
+            _ready.pop_back();
+        } else if (!_filenames.empty()) {
+            s = pop_file(lock);
+        } else if (_splitting > 0) {
+            // A file that is being split will add more parts
+            _work_added.wait(lock);
+        } else {
+            return shared<InputStream>();
+        }
     }
+    return make_stream(s);
+}
 
+/// Mark the stream as processing and wrap it so that it is reported
+/// when finished. Called with _mutex held.
+shared<InputStream> A4Input::make_stream(InputStream* s) {
     _processing.insert(s);
 
     VERBOSE("Starting to process ", s->str());
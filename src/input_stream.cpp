@@ -39,6 +39,14 @@ namespace io {
     bool InputStream::end() { return _impl->end(); }
     void InputStream::close() { return _impl->close(); }
     bool InputStream::skip_to_next_metadata() { return _impl->skip_to_next_metadata(); }
+    bool InputStream::seek_to_event(uint64_t n) { return _impl->seek_to_event(n); }
+    std::vector<shared<InputStream>> InputStream::split() {
+        std::vector<UNIQUE<InputStreamImpl>> impls = _impl->split();
+        std::vector<shared<InputStream>> parts;
+        for (size_t i = 0; i < impls.size(); i++)
+            parts.push_back(shared<InputStream>(new InputStream(std::move(impls[i]))));
+        return parts;
+    }
     size_t InputStream::ByteCount() { return _impl->ByteCount(); }
     std::string InputStream::str() { return _impl->str(); }
 
@@ -51,6 +59,27 @@ namespace io {
     std::vector<const google::protobuf::FileDescriptor*> InputStream::get_filedescriptors() {
         return _impl->get_filedescriptors();
     }
+    void InputStream::set_parallel_decompression(int threads, int readahead_blocks) {
+        _impl->set_parallel_decompression(threads, readahead_blocks);
+    }
+    void InputStream::set_hint_copy(bool hint_copy) {
+        _impl->set_hint_copy(hint_copy);
+    }
+    bool InputStream::hint_copy() const {
+        return _impl->hint_copy();
+    }
+    void InputStream::set_recycle_messages(bool recycle) {
+        _impl->set_recycle_messages(recycle);
+    }
+    void InputStream::set_projection(const std::vector<std::string>& fields) {
+        _impl->set_projection(fields);
+    }
+    void InputStream::add_zone_filter(const std::string& field, double min, double max) {
+        _impl->add_zone_filter(field, min, max);
+    }
+    void InputStream::set_readahead(size_t bytes) {
+        _impl->set_readahead(bytes);
+    }
     bool InputStream::try_read(google::protobuf::Message & msg, const google::protobuf::Descriptor* d) {
         return _impl->try_read(msg, d);
     }
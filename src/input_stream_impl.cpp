@@ -31,6 +31,8 @@ using boost::function;
 
 #include "gzip_stream.h"
 #include "compressed_stream.h"
+#include "discovery_cache.h"
+#include "thread_pool.h"
 #include "zero_copy_resource.h"
 #include "input_stream_impl.h"
 
@@ -41,7 +43,6 @@ using boost::function;
 
 using google::protobuf::io::ZeroCopyInputStream;
 using google::protobuf::io::FileInputStream;
-using google::protobuf::io::CodedInputStream;
 
 using google::protobuf::DynamicMessageFactory;
 using google::protobuf::SimpleDescriptorDatabase;
@@ -65,18 +66,31 @@ InputStreamImpl::InputStreamImpl(UNIQUE<ZeroCopyStreamResource> in,
     _raw_in = std::move(in);
     _inputname = name;
     _compressed_in.reset();
-    _coded_in.reset();
+    _frames.reset();
     _good = true;
     _error = false;
     _new_metadata = false;
     _discovery_complete = false;
-    _items_read = 0;
     _current_metadata_refers_forward = false;
     _current_header_index = 0;
     _current_metadata_index = 0;
+    _pending_metadata = false;
+    _pending_metadata_header = 0;
+    _pending_metadata_index = 0;
+    _discovery.reset(new DiscoveryState());
     _last_unread_message.reset();
     _do_reset_metadata = false;
     _hint_copy = false;
+    _recycle_messages = false;
+    _decompression_threads = 0;
+    _decompression_readahead = 0;
+    _has_range = false;
+    _range_header = 0;
+    _range_block = 0;
+    _range_chunk = _range_chunk_end = -1;
+    _range_end = 0;
+    _zone_header = 0;
+    _zone_entry = -1;
 }
 
 InputStreamImpl::~InputStreamImpl() {};
@@ -100,13 +114,88 @@ void InputStreamImpl::set_hint_copy(bool do_copy) {
 
 }
 
+void InputStreamImpl::set_recycle_messages(bool recycle) {
+    _recycle_messages = recycle;
+    if (not _recycle_messages) {
+        _recycled_message.reset();
+        _spare_messages.clear();
+        _spare_pool.reset();
+    }
+}
+
+void InputStreamImpl::set_projection(const std::vector<std::string>& fields) {
+    _projection_fields = fields;
+    _projections.clear();
+    _projection_resolved.clear();
+    _projection_pool.reset();
+}
+
+void InputStreamImpl::add_zone_filter(const std::string& field, double min, double max) {
+    if (!_raw_in->seekable()) {
+        WARNING("a4::io:InputStreamImpl - Ignoring zone filter in unseekable stream ", _inputname);
+        return;
+    }
+    if (!require_discovery())
+        return;
+    ZoneFilter f;
+    f.field = field;
+    f.min = min;
+    f.max = max;
+    _zone_filters.push_back(f);
+    _zone_entry = -1;
+    seek_to_block(0, _discovery->headers_forward[0] ? -1 : 0);
+}
+
+/// Check the zone maps of the header for the filter ranges.
+/// Blocks are read if a field has no zone map.
+bool InputStreamImpl::block_may_match(uint32_t header, int32_t entry) {
+    const StreamFooter& footer = _discovery->footer_per_header[header];
+    foreach (const ZoneFilter& f, _zone_filters) {
+        foreach (const ZoneMap& z, footer.zone_map()) {
+            if (z.field() != f.field || entry >= z.min_size() || entry >= z.max_size())
+                continue;
+            if (z.max(entry) < f.min || z.min(entry) > f.max)
+                return false;
+        }
+    }
+    return true;
+}
+
+/// Continue at the start of the block after the current one.
+bool InputStreamImpl::skip_zone_block() {
+    if (_has_range)
+        return set_end();
+    _last_unread_message.reset();
+    uint32_t header = _current_header_index;
+    int32_t entry = _current_metadata_index + (_current_metadata_refers_forward ? 1 : 0);
+    if (entry < static_cast<int32_t>(_discovery->metadata_offset_per_header[header].size()))
+        return seek_to_block(header, _current_metadata_refers_forward ? entry : entry + 1);
+    if (header + 1 < _discovery->header_offsets.size())
+        return seek_to_block(header + 1, _discovery->headers_forward[header + 1] ? -1 : 0);
+    return set_end();
+}
+
+void InputStreamImpl::set_parallel_decompression(int threads, int readahead_blocks) {
+    if (_compressed_in)
+        FATAL("set_parallel_decompression() called inside a compressed section!");
+    if (threads != _decompression_threads)
+        _decompression_pool.reset();
+    _decompression_threads = threads;
+    _decompression_readahead = readahead_blocks > 0 ? readahead_blocks : 2*threads;
+}
+
 void InputStreamImpl::startup(bool discovery_requested) {
     // Initialize to defined state
     _started = true;
-    _coded_in.reset(new CodedInputStream(_raw_in.get()));
-    
-    // Push limit of read bytes
-    _coded_in->SetTotalBytesLimit(pow(1024,3), pow(1024,3));
+    _frames.reset(new FrameReader(_raw_in.get()));
+
+    if (_has_range) {
+        if (!start_chunk_range(_range_header, _range_block, _range_chunk, _range_chunk_end)) {
+            ERROR("Could not seek to metadata block ", _range_block, " of ", _inputname);
+            set_error();
+        }
+        return;
+    }
 
     if (!read_header(discovery_requested)) {
         if(_error) {
@@ -127,30 +216,28 @@ bool InputStreamImpl::read_header(bool discovery_requested)
     // Note: in the following i use that bool(set_end()) == false 
     // && bool(set_error()) == false
     string magic;
-    if (!_coded_in->ReadString(&magic, 8))
+    if (!_frames->ReadString(&magic, 8))
         return set_end();
 
     if (0 != magic.compare(START_MAGIC))
         return set_error();
 
     uint32_t size = 0;
-    if (!_coded_in->ReadLittleEndian32(&size))
+    if (!_frames->ReadLittleEndian32(&size))
         return set_error();
 
     uint32_t message_type = 0;
     if (size & HIGH_BIT) {
         size = size & (HIGH_BIT - 1);
-        if (!_coded_in->ReadLittleEndian32(&message_type))
+        if (!_frames->ReadLittleEndian32(&message_type))
             return set_error();
     }
     if (!message_type == _fixed_class_id<StreamHeader>())
         return set_error();
 
     StreamHeader h;
-    CodedInputStream::Limit lim = _coded_in->PushLimit(size);
-    if (!h.ParseFromCodedStream(_coded_in.get()))
+    if (!_frames->ParseMessage(&h, size))
         return set_error();
-    _coded_in->PopLimit(lim);
     
     if (h.a4_version() != 2) {
         ERROR("Unknown A4 stream version (", h.a4_version(), ")");
@@ -170,9 +257,7 @@ bool InputStreamImpl::read_header(bool discovery_requested)
             }
 
             _current_metadata_index = 0;
-            if (_metadata_per_header[_current_header_index].size() > 0) {
-                _current_metadata = _metadata_per_header[_current_header_index][0];
-            }
+            set_current_metadata(_current_header_index, 0);
         } else {
             _current_metadata_index = -1;
             if (discovery_requested and not discover_all_metadata()) {
@@ -188,6 +273,25 @@ bool InputStreamImpl::read_header(bool discovery_requested)
 bool InputStreamImpl::discover_all_metadata() {
     if (_hint_copy) notify_last_unread_message();
     assert(_metadata_per_header.size() == 0);
+
+    // Metadata is read on demand by a clone of the stream if possible,
+    // otherwise all of it is read now
+    if (!_metadata_reader) {
+        UNIQUE<ZeroCopyStreamResource> resource = _raw_in->Clone(0);
+        if (resource)
+            _metadata_reader.reset(new InputStreamImpl(std::move(resource), _inputname));
+    }
+
+    // The discovery cache only holds metadata offsets
+    DiscoveryCacheEntry cache_entry(_inputname);
+    const bool caching = _metadata_reader && cache_entry.enabled();
+    DiscoveryCache cache;
+    if (caching && cache_entry.load(cache) && restore_discovery(cache))
+        return true;
+    cache.Clear();
+    std::deque<DiscoveredHeader> discovered;
+    shared<DiscoveryState> discovery(new DiscoveryState());
+
     // Temporary ProtoClassPool for reading static messages
     shared<ProtoClassPool> temp_pool(new ProtoClassPool());
     unsigned int _temp_header_index = _current_header_index;
@@ -198,13 +302,15 @@ bool InputStreamImpl::discover_all_metadata() {
     std::deque<bool> _temp_headers_forward;
     std::deque<std::vector<shared<A4Message>>> _temp_metadata_per_header;
     std::deque<std::vector<uint64_t>>  _temp_metadata_offset_per_header;
+    std::deque<StreamFooter> _temp_footer_per_header;
+    std::deque<shared<ProtoClassPool>> _temp_class_pool_per_header;
 
     while (true) {
         if (seek_back(-size - END_MAGIC_len) == -1)
             return false;
         
         string magic;
-        if (!_coded_in->ReadString(&magic, 8)) {
+        if (!_frames->ReadString(&magic, 8)) {
             ERROR("Unexpected EOF during metadata scan");
             return false;
         }
@@ -213,7 +319,7 @@ bool InputStreamImpl::discover_all_metadata() {
             return false;
         
         uint32_t footer_size = 0;
-        if (!_coded_in->ReadLittleEndian32(&footer_size))
+        if (!_frames->ReadLittleEndian32(&footer_size))
             return false;
         
         // Seek to footer
@@ -230,38 +336,42 @@ bool InputStreamImpl::discover_all_metadata() {
         }
         
         const StreamFooter* footer = msg->as<StreamFooter>();
-        _footers.push_back(*footer);
+        discovery->footers.push_back(*footer);
+        _temp_footer_per_header.push_front(*footer);
+        DiscoveredHeader* this_discovered = NULL;
+        if (caching) {
+            discovered.push_front(DiscoveredHeader());
+            this_discovered = &discovered.front();
+        }
             
         size += footer->size() + footer_msgsize;
         
         // Read all ProtoClasses associated with this footer
         _current_class_pool.reset(new ProtoClassPool());
-        foreach(uint64_t offset, footer->protoclass_offsets()) {
-            uint64_t metadata_start = footer_abs_start - footer->size() + offset;
-            if (seek(metadata_start) == -1) 
-                return false;
-                
-            shared<A4Message> msg = next_message();
-            drop_compression();
-            
-            const ProtoClass* proto = msg->as<ProtoClass>();
-            assert(proto);
-            _current_class_pool->add_protoclass(*proto);
-        }
+        if (!read_protoclasses(*footer, footer_abs_start - footer->size(), this_discovered))
+            return false;
         
+        _temp_class_pool_per_header.push_front(_current_class_pool);
+
         // Populate the class_name on the ClassCount
-        foreach (auto& cc, *_footers.back().mutable_class_count())
+        foreach (auto& cc, *discovery->footers.back().mutable_class_count())
             cc.set_class_name(_current_class_pool->descriptor(cc.class_id())->full_name());
+        if (this_discovered)
+            this_discovered->mutable_footer()->CopyFrom(discovery->footers.back());
 
-        // Read all metadata associated with this footer
+        // Find all metadata associated with this footer
         std::vector<shared<A4Message>> _this_headers_metadata;
         std::vector<uint64_t> _this_headers_metadata_offsets;
         foreach(uint64_t offset, footer->metadata_offsets()) {
             uint64_t metadata_start = footer_abs_start - footer->size() + offset;
             _this_headers_metadata_offsets.push_back(metadata_start);
+            if (this_discovered)
+                this_discovered->add_metadata_offset(metadata_start);
+            if (_metadata_reader)
+                continue;
+
             if (seek(metadata_start) == -1) 
                 return false;
-                
             shared<A4Message> msg = next_message();
             drop_compression();
             _this_headers_metadata.push_back(msg);
@@ -283,7 +393,11 @@ bool InputStreamImpl::discover_all_metadata() {
             return false;
         }
         const StreamHeader* header = hmsg->as<StreamHeader>();
-        _temp_headers_forward.push_back(header->metadata_refers_forward());
+        _temp_headers_forward.push_front(header->metadata_refers_forward());
+        if (this_discovered) {
+            this_discovered->set_offset(tell);
+            this_discovered->set_metadata_refers_forward(header->metadata_refers_forward());
+        }
 
         if (tell == 0)
             break;
@@ -293,58 +407,364 @@ bool InputStreamImpl::discover_all_metadata() {
     seek(headers[_temp_header_index] + START_MAGIC_len);
     next_message(); // read the header again
     _discovery_complete = true;
-    _metadata_per_header.insert(
-        _metadata_per_header.end(),
-        _temp_metadata_per_header.begin(),
-        _temp_metadata_per_header.end());
-    _metadata_offset_per_header.insert(
-        _metadata_offset_per_header.end(),
+    if (!_metadata_reader) {
+        _metadata_per_header.insert(
+            _metadata_per_header.end(),
+            _temp_metadata_per_header.begin(),
+            _temp_metadata_per_header.end());
+    }
+    discovery->metadata_offset_per_header.assign(
         _temp_metadata_offset_per_header.begin(),
         _temp_metadata_offset_per_header.end());
     
     _current_header_index = _temp_header_index;
-    _headers_forward.insert(_headers_forward.end(), _temp_headers_forward.begin(), _temp_headers_forward.end());
+    discovery->headers_forward.assign(_temp_headers_forward.begin(), _temp_headers_forward.end());
+    discovery->header_offsets.assign(headers.begin(), headers.end());
+    discovery->footer_per_header.assign(_temp_footer_per_header.begin(), _temp_footer_per_header.end());
+    _discovery = discovery;
+    _class_pool_per_header.assign(_temp_class_pool_per_header.begin(), _temp_class_pool_per_header.end());
+
+    if (caching) {
+        foreach (DiscoveredHeader& d, discovered)
+            cache.add_header()->Swap(&d);
+        cache_entry.store(cache);
+    }
+    return true;
+}
+
+/// Fill the per-header state from a cached discovery instead of reading
+/// footers and ProtoClasses from the stream. Needs a metadata reader.
+bool InputStreamImpl::restore_discovery(const DiscoveryCache& cache) {
+    if (!_metadata_reader || cache.header_size() <= static_cast<int>(_current_header_index)
+        || cache.header(0).offset() != 0)
+        return false;
+    shared<DiscoveryState> discovery(new DiscoveryState());
+    for (int i = cache.header_size() - 1; i >= 0; i--)
+        discovery->footers.push_back(cache.header(i).footer());
+
+    foreach (const DiscoveredHeader& d, cache.header()) {
+        shared<ProtoClassPool> pool(new ProtoClassPool());
+        foreach (const ProtoClass& proto, d.protoclass())
+            pool->add_protoclass(proto);
+        discovery->metadata_offset_per_header.push_back(std::vector<uint64_t>(
+            d.metadata_offset().begin(), d.metadata_offset().end()));
+        discovery->headers_forward.push_back(d.metadata_refers_forward());
+        discovery->header_offsets.push_back(d.offset());
+        discovery->footer_per_header.push_back(d.footer());
+        _class_pool_per_header.push_back(pool);
+    }
+    _discovery = discovery;
+
+    // Seek back to the current header, as after a full discovery
+    _current_class_pool = _class_pool_per_header[0];
+    seek(_discovery->header_offsets[_current_header_index] + START_MAGIC_len);
+    next_message(); // read the header again
+    _discovery_complete = true;
+    return true;
+}
+
+/// Read all ProtoClasses listed in the footer into the current class pool,
+/// and record them in discovered if given.
+/// Leaves the stream at an undefined position.
+bool InputStreamImpl::read_protoclasses(const StreamFooter& footer, uint64_t header_offset,
+                                        DiscoveredHeader* discovered) {
+    foreach(uint64_t offset, footer.protoclass_offsets()) {
+        if (seek(header_offset + offset) == -1) 
+            return false;
+            
+        shared<A4Message> msg = next_message();
+        drop_compression();
+        
+        const ProtoClass* proto = msg->as<ProtoClass>();
+        assert(proto);
+        _current_class_pool->add_protoclass(*proto);
+        if (discovered)
+            discovered->add_protoclass()->CopyFrom(*proto);
+    }
+    return true;
+}
+
+/// Make sure discover_all_metadata() has run, starting up the stream if needed.
+/// Leaves the stream at an undefined position.
+bool InputStreamImpl::require_discovery() {
+    if (!_started)
+        startup(true);
+    if (_error)
+        return false;
+    drop_compression();
+    if (!_discovery_complete) {
+        if (seek(0) == -1) {
+            ERROR("a4::io:InputStreamImpl - Cannot seek in this unseekable stream!");
+            return set_error();
+        }
+        if (not discover_all_metadata()) {
+            ERROR("a4::io:InputStreamImpl - Failed to discover metadata - file corrupted?");
+            return set_error();
+        }
+    }
+    return true;
+}
+
+/// Class pool containing all classes of the given header.
+/// Streams created by split() read it on demand, which moves the stream position.
+shared<ProtoClassPool> InputStreamImpl::class_pool_for_header(uint32_t header) {
+    if (!_class_pool_per_header[header]) {
+        drop_compression();
+        shared<ProtoClassPool> current_pool = _current_class_pool;
+        _current_class_pool.reset(new ProtoClassPool());
+        if (read_protoclasses(_discovery->footer_per_header[header], _discovery->header_offsets[header]))
+            _class_pool_per_header[header] = _current_class_pool;
+        _current_class_pool = current_pool;
+    }
+    return _class_pool_per_header[header];
+}
+
+/// Set the metadata state as it is after reading metadata_before metadata
+/// messages of the given header.
+void InputStreamImpl::set_metadata_state(uint32_t header, int32_t metadata_before) {
+    if (_current_metadata_refers_forward)
+        _current_metadata_index = metadata_before - 1;
+    else
+        _current_metadata_index = metadata_before;
+    set_current_metadata(header, _current_metadata_index);
+    _do_reset_metadata = false;
+    _new_metadata = true;
+}
+
+/// Get a metadata message of a header, from all_metadata() if it has been
+/// filled, or else from the most recently used messages or the stream.
+shared<A4Message> InputStreamImpl::metadata_message(uint32_t header, int32_t index) {
+    if (header < _metadata_per_header.size())
+        return _metadata_per_header[header][index];
+
+    const uint64_t key = (uint64_t(header) << 32) | uint32_t(index);
+    auto it = _metadata_lru_index.find(key);
+    if (it != _metadata_lru_index.end()) {
+        _metadata_lru.splice(_metadata_lru.begin(), _metadata_lru, it->second);
+        return it->second->second;
+    }
+
+    shared<A4Message> msg = read_metadata(header, index);
+    if (!msg)
+        return msg;
+    _metadata_lru.push_front(std::make_pair(key, msg));
+    _metadata_lru_index[key] = _metadata_lru.begin();
+    if (_metadata_lru.size() > METADATA_CACHE_SIZE) {
+        _metadata_lru_index.erase(_metadata_lru.back().first);
+        _metadata_lru.pop_back();
+    }
+    return msg;
+}
+
+/// Read a metadata message with the metadata reader, which is created on the
+/// first call. The position of this stream is not changed.
+shared<A4Message> InputStreamImpl::read_metadata(uint32_t header, int32_t index) {
+    if (!_metadata_reader) {
+        UNIQUE<ZeroCopyStreamResource> resource = _raw_in->Clone(0);
+        if (!resource) {
+            ERROR("a4::io:InputStreamImpl - Cannot read metadata from ", _inputname);
+            return shared<A4Message>();
+        }
+        _metadata_reader.reset(new InputStreamImpl(std::move(resource), _inputname));
+    }
+    InputStreamImpl& reader = *_metadata_reader;
+    if (!reader._started) {
+        reader._started = true;
+        reader._discovery_complete = true;
+        reader._discovery = _discovery;
+        reader._class_pool_per_header = _class_pool_per_header;
+    }
+
+    reader.drop_compression();
+    shared<ProtoClassPool> pool = reader.class_pool_for_header(header);
+    if (!pool || reader.seek(_discovery->metadata_offset_per_header[header][index]) == -1) {
+        ERROR("a4::io:InputStreamImpl - Failed to read metadata ", index, " of header ", header,
+              " in ", _inputname);
+        return shared<A4Message>();
+    }
+    reader._current_class_pool = pool;
+    shared<A4Message> msg = reader.next_message();
+    reader.drop_compression();
+    if (!msg || !msg->metadata()) {
+        ERROR("a4::io:InputStreamImpl - No metadata at offset ",
+              _discovery->metadata_offset_per_header[header][index], " in ", _inputname);
+        return shared<A4Message>();
+    }
+    return msg;
+}
+
+/// All metadata messages per header. Reads all of them on the first call.
+const std::vector<std::vector<shared<A4Message>>>& InputStreamImpl::all_metadata() {
+    if (!_discovery_complete) {
+        if (_started)
+            FATAL("Coding Bug: all_metadata first called after reading started!");
+        startup(true);
+    }
+    while (_metadata_per_header.size() < _discovery->metadata_offset_per_header.size()) {
+        const uint32_t header = _metadata_per_header.size();
+        std::vector<shared<A4Message>> metadata;
+        for (size_t i = 0; i < _discovery->metadata_offset_per_header[header].size(); i++)
+            metadata.push_back(metadata_message(header, i));
+        _metadata_per_header.push_back(metadata);
+    }
+    return _metadata_per_header;
+}
+
+/// Position the stream at the start of the given metadata block and set the
+/// end of the readable range to its end.
+/// Block k holds the events metadata k refers to. If metadata refers forward,
+/// block -1 holds the events before the first metadata, otherwise block n holds
+/// the events after the last one.
+/// Block boundaries are the metadata offsets, so that a block starts with the
+/// metadata message preceding it, and reading it sets the correct metadata.
+bool InputStreamImpl::start_metadata_block(uint32_t header, int32_t block) {
+    if (!seek_to_block(header, block))
+        return false;
+    const auto& offsets = _discovery->metadata_offset_per_header[header];
+    int32_t n = offsets.size();
+    int32_t after = _current_metadata_refers_forward ? block + 1 : block;
+    if (after < n) {
+        _range_end = offsets[after];
+    } else {
+        _range_end = _discovery->header_offsets[header] + _discovery->footer_per_header[header].size();
+    }
+    return true;
+}
+
+/// Position the stream at the start of the given footer chunk of a metadata
+/// block and end the range before the chunk chunk_end.
+/// Chunk -1 is the start of the block, chunk_end -1 its end.
+bool InputStreamImpl::start_chunk_range(uint32_t header, int32_t block, int32_t chunk, int32_t chunk_end) {
+    if (!start_metadata_block(header, block))
+        return false;
+    const StreamFooter& footer = _discovery->footer_per_header[header];
+    if (chunk_end >= 0)
+        _range_end = _discovery->header_offsets[header] + footer.chunk(chunk_end).section_offset();
+    if (chunk < 0)
+        return true;
+    // All classes of this header are known from discovery, even if
+    // their ProtoClass messages are before the chunk.
+    const EventIndexEntry& entry = footer.chunk(chunk);
+    if (seek(_discovery->header_offsets[header] + entry.section_offset()) == -1)
+        return set_error();
+    set_metadata_state(header, entry.metadata_index());
+    return true;
+}
+
+/// Position the stream at the start of the given metadata block, numbered
+/// as in start_metadata_block(), without limiting the range.
+bool InputStreamImpl::seek_to_block(uint32_t header, int32_t block) {
+    shared<ProtoClassPool> pool = class_pool_for_header(header);
+    if (!pool || !seek_to_header(header))
+        return set_error();
+    _current_class_pool = pool;
+
+    int32_t before = _current_metadata_refers_forward ? block : block - 1;
+    if (before >= 0) {
+        if (seek(_discovery->metadata_offset_per_header[header][before]) == -1)
+            return set_error();
+        set_metadata_state(header, before);
+    }
+    return true;
+}
+
+/// Check if the end of the range of a split stream is reached, and end the stream if so.
+/// Only valid outside of compressed sections.
+bool InputStreamImpl::range_end_reached() {
+    uint64_t position = _raw_in->Tell() - _frames->buffered();
+    if (position < _range_end)
+        return false;
+    set_end();
     return true;
 }
 
+std::vector<UNIQUE<InputStreamImpl>> InputStreamImpl::split() {
+    std::vector<UNIQUE<InputStreamImpl>> parts;
+    if (!_raw_in->seekable() || !require_discovery())
+        return parts;
+    for (uint32_t header = 0; header < _discovery->header_offsets.size(); header++) {
+        int32_t n = _discovery->metadata_offset_per_header[header].size();
+        int32_t first = _discovery->headers_forward[header] ? -1 : 0;
+        int32_t last = _discovery->headers_forward[header] ? n - 1 : n;
+        const StreamFooter& footer = _discovery->footer_per_header[header];
+        for (int32_t block = first; block <= last; block++) {
+            if (!_zone_filters.empty() && !block_may_match(header, block - first))
+                continue;
+            // The footer chunks in this block cut it into several parts
+            uint32_t metadata_before = _discovery->headers_forward[header] ? block + 1 : block;
+            std::vector<int32_t> cuts(1, -1);
+            for (int i = 0; i < footer.chunk_size(); i++) {
+                if (footer.chunk(i).metadata_index() == metadata_before)
+                    cuts.push_back(i);
+            }
+            cuts.push_back(-1);
+            for (size_t c = 0; c + 1 < cuts.size(); c++) {
+                UNIQUE<ZeroCopyStreamResource> resource = _raw_in->Clone(0);
+                if (!resource) {
+                    parts.clear();
+                    return parts;
+                }
+                std::string name = str_cat(_inputname, " [", header, ":", block, "]");
+                if (cuts.size() > 2)
+                    name = str_cat(_inputname, " [", header, ":", block, ":", c, "]");
+                UNIQUE<InputStreamImpl> part(new InputStreamImpl(std::move(resource), name));
+                part->_discovery_complete = true;
+                // Metadata is read on demand by every part
+                part->_discovery = _discovery;
+                // Class pools are not thread-safe, every part reads its own
+                part->_class_pool_per_header.resize(_class_pool_per_header.size());
+                part->_hint_copy = _hint_copy;
+                part->_recycle_messages = _recycle_messages;
+                part->_projection_fields = _projection_fields;
+                part->set_parallel_decompression(_decompression_threads, _decompression_readahead);
+                part->_has_range = true;
+                part->_range_header = header;
+                part->_range_block = block;
+                part->_range_chunk = cuts[c];
+                part->_range_chunk_end = cuts[c + 1];
+                parts.push_back(std::move(part));
+            }
+        }
+    }
+    return parts;
+}
+
 int64_t InputStreamImpl::seek_back(int64_t position) {
     assert(!_compressed_in);
     if (_hint_copy) notify_last_unread_message();
-    _coded_in.reset();
+    _frames.reset();
     if (!_raw_in->SeekBack(-position))
         return -1;
     int64_t pos = _raw_in->Tell();
-    _coded_in.reset(new CodedInputStream(_raw_in.get()));
-    _coded_in->SetTotalBytesLimit(pow(1024,3), pow(1024,3));
+    _frames.reset(new FrameReader(_raw_in.get()));
     return pos;
 };
 
 int64_t InputStreamImpl::seek(int64_t position) {
     assert(!_compressed_in);
     if (_hint_copy) notify_last_unread_message();
-    _coded_in.reset();
+    _frames.reset();
     if (!_raw_in->Seek(position))
         return -1;
     int64_t pos = _raw_in->Tell();
     
-    _coded_in.reset(new CodedInputStream(_raw_in.get()));
-    _coded_in->SetTotalBytesLimit(pow(1024,3), pow(1024,3));
+    _frames.reset(new FrameReader(_raw_in.get()));
     return pos;
 }
 
 bool InputStreamImpl::carry_metadata(uint32_t& header, int32_t& metadata) {
-    if ((0 < header) or not (header < _metadata_offset_per_header.size()))
+    if ((0 < header) or not (header < _discovery->metadata_offset_per_header.size()))
         return false;
     while (metadata < 0 and header > 0) {
         header -= 1;
-        metadata += _metadata_offset_per_header[header].size();
+        metadata += _discovery->metadata_offset_per_header[header].size();
     }
-    while (header < _metadata_offset_per_header.size() 
-        and metadata > static_cast<int32_t>(_metadata_offset_per_header[header].size())) {
-        metadata -= _metadata_offset_per_header[header].size();
+    while (header < _discovery->metadata_offset_per_header.size() 
+        and metadata > static_cast<int32_t>(_discovery->metadata_offset_per_header[header].size())) {
+        metadata -= _discovery->metadata_offset_per_header[header].size();
         header += 1;
     }
-    if ((0 < header) or not (header < _metadata_offset_per_header.size()))
+    if ((0 < header) or not (header < _discovery->metadata_offset_per_header.size()))
         return false;
     return true;
 }
@@ -370,18 +790,18 @@ bool InputStreamImpl::seek_to(uint32_t header, int32_t metadata, bool carry) {
         return false;
     }
 
-    if (_headers_forward[header]) {
+    if (_discovery->headers_forward[header]) {
         // If the metadata refers forward, just seek to it
         _current_header_index = header;
         // will be incremented when next metadata is read
         _current_metadata_index = metadata - 1;
-        if (metadata == static_cast<int32_t>(_metadata_offset_per_header[header].size())) {
+        if (metadata == static_cast<int32_t>(_discovery->metadata_offset_per_header[header].size())) {
             // No more metadata in this header, current position is end
             // of stream.
             set_end();
             return false;
         }
-        seek(_metadata_offset_per_header[header][metadata]);
+        seek(_discovery->metadata_offset_per_header[header][metadata]);
     } else {
         if (metadata == 0 && header == 0) {
             // Easy case
@@ -394,13 +814,13 @@ bool InputStreamImpl::seek_to(uint32_t header, int32_t metadata, bool carry) {
             carry_metadata(header, metadata); // modifies header and metadata
             _current_header_index = header;
             _current_metadata_index = metadata;
-            if (metadata == static_cast<int32_t>(_metadata_offset_per_header[header].size())) {
+            if (metadata == static_cast<int32_t>(_discovery->metadata_offset_per_header[header].size())) {
                 // No more metadata in this header, current position is end
                 // of stream.
                 set_end();
                 return false;
             }
-            seek(_metadata_offset_per_header[header][metadata]);
+            seek(_discovery->metadata_offset_per_header[header][metadata]);
             next(false); // read only the next metadata    
         }
     }
@@ -410,9 +830,25 @@ bool InputStreamImpl::seek_to(uint32_t header, int32_t metadata, bool carry) {
 bool InputStreamImpl::start_compression(const StartCompressedSection& cs) {
     assert(!_compressed_in);
     if (_hint_copy) notify_last_unread_message();
-    _coded_in.reset();
-
-    if (cs.compression() == StartCompressedSection_Compression_ZLIB) {
+    _frames.reset();
+
+    // Block-compressed sections can be decompressed in parallel if we are
+    // able to seek back from the speculatively read blocks.
+    // zlib sections are one continuous deflate stream and stay sequential.
+    RawUncompressFunction block_uncompress = NULL;
+    if (cs.compression() == StartCompressedSection_Compression_LZ4) {
+        block_uncompress = &LZ4RawUncompress;
+#ifdef HAVE_SNAPPY
+    } else if (cs.compression() == StartCompressedSection_Compression_SNAPPY) {
+        block_uncompress = &SnappyRawUncompress;
+#endif
+    }
+    if (block_uncompress && _decompression_threads > 0 && _raw_in->seekable()) {
+        if (!_decompression_pool)
+            _decompression_pool.reset(new ThreadPool(_decompression_threads));
+        _compressed_in.reset(new ParallelDecompressionInputStream(_raw_in.get(),
+            block_uncompress, _decompression_pool, _decompression_readahead));
+    } else if (cs.compression() == StartCompressedSection_Compression_ZLIB) {
         _compressed_in.reset(new GzipInputStream(_raw_in.get(), GzipInputStream::ZLIB));
     } else if (cs.compression() == StartCompressedSection_Compression_GZIP) {
         _compressed_in.reset(new GzipInputStream(_raw_in.get(), GzipInputStream::GZIP));
@@ -430,8 +866,7 @@ bool InputStreamImpl::start_compression(const StartCompressedSection& cs) {
         return false;
     }
 
-    _coded_in.reset(new CodedInputStream(_compressed_in.get()));
-    _coded_in->SetTotalBytesLimit(pow(1024,3), pow(1024,3));
+    _frames.reset(new FrameReader(_compressed_in.get()));
     return true;
 }
 
@@ -440,34 +875,109 @@ void InputStreamImpl::drop_compression() {
         return;
         
     if (_hint_copy) notify_last_unread_message();
-    _coded_in.reset();
+    _frames.reset();
     _compressed_in.reset();
-    _coded_in.reset(new CodedInputStream(_raw_in.get()));
+    _frames.reset(new FrameReader(_raw_in.get()));
 }
 
 bool InputStreamImpl::stop_compression(const EndCompressedSection& cs) {
     assert(_compressed_in);
     if (_hint_copy) notify_last_unread_message();
-    _coded_in.reset();
+    _frames.reset();
     if (!_compressed_in->ExpectAtEnd()) {
         ERROR("Compressed section did not end where it should");
         return false;
     }
     _compressed_in.reset();
-    _coded_in.reset(new CodedInputStream(_raw_in.get()));
+    _frames.reset(new FrameReader(_raw_in.get()));
     return true;
 }
 
-void InputStreamImpl::reset_coded_stream() {
-    if (_hint_copy) notify_last_unread_message();
-    _coded_in.reset();
-    if (_compressed_in) {
-        _coded_in.reset(new CodedInputStream(_compressed_in.get()));
-    } else {
-        _coded_in.reset(new CodedInputStream(_raw_in.get()));
+bool InputStreamImpl::seek_to_header(uint32_t header) {
+    drop_compression();
+    _pickup.reset();
+    if (seek(_discovery->header_offsets[header]) == -1)
+        return set_error();
+    _current_header_index = header;
+    if (!read_header())
+        return false;
+    reset_header_metadata();
+    return true;
+}
+
+/// Number of regular messages in the stream belonging to a footer.
+/// Older files do not record it, so it is derived from the class counts.
+static uint64_t footer_event_count(const StreamFooter& footer) {
+    if (footer.has_event_count())
+        return footer.event_count();
+    uint64_t count = 0;
+    foreach (const ClassCount& cc, footer.class_count()) {
+        if (cc.class_id() % 2 == 0 && (cc.class_id() < 100 || cc.class_id() > 200))
+            count += cc.count();
     }
-    _coded_in->SetTotalBytesLimit(pow(1024, 3), pow(1024, 3));
+    return count;
 }
 
+bool InputStreamImpl::seek_to_event(uint64_t event) {
+    if (!require_discovery())
+        return false;
+    _good = true;
+    _has_range = false;
+    _range_end = 0;
+
+    uint32_t header = 0;
+    while (header < _discovery->footer_per_header.size()) {
+        uint64_t count = footer_event_count(_discovery->footer_per_header[header]);
+        if (event < count)
+            break;
+        event -= count;
+        header++;
+    }
+    if (header == _discovery->footer_per_header.size())
+        return set_end();
+    shared<ProtoClassPool> pool = class_pool_for_header(header);
+    if (!pool)
+        return set_error();
+    if (!seek_to_header(header))
+        return false;
+
+    // Find the last indexed event not after the requested one
+    const StreamFooter& footer = _discovery->footer_per_header[header];
+    int lo = 0, hi = footer.event_index_size();
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (static_cast<uint64_t>(footer.event_index(mid).event()) <= event)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo > 0) {
+        const EventIndexEntry& entry = footer.event_index(lo - 1);
+        uint64_t offset = _discovery->header_offsets[header] + entry.section_offset();
+        if (seek(offset) == -1)
+            return set_error();
+        // All classes of this header are known from discovery, even if
+        // their ProtoClass messages are before the section.
+        _current_class_pool = pool;
+        shared<A4Message> msg = bare_message();
+        if (msg and msg->is<StartCompressedSection>()) {
+            handle_compressed_section(msg);
+            if (!_frames->Skip(entry.inner_offset()))
+                FATAL("Event index points beyond the compressed section!");
+        } else if (seek(offset) == -1) {
+            return set_error();
+        }
+
+        set_metadata_state(header, entry.metadata_index());
+        event -= entry.event();
+    }
+
+    // Read through the remaining events
+    for (; event > 0; event--) {
+        if (!next())
+            return set_end();
+    }
+    return true;
+}
 
 };}; // namespace a4::io
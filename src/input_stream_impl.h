@@ -1,11 +1,15 @@
 #ifndef _A4_INPUT_STREAM_IMPL_
 #define _A4_INPUT_STREAM_IMPL_
 
+#include <list>
 #include <tuple>
+#include <unordered_map>
 #include <unordered_set>
 #include <a4/types.h>
 
 #include "base_compressed_streams.h"
+#include "frame_reader.h"
+#include "projection.h"
 #include "proto_class_pool.h"
 #include "zero_copy_resource.h"
 
@@ -21,9 +25,26 @@ const string START_MAGIC = "A4STREAM";
 const string END_MAGIC = "KTHXBYE4";
 const int START_MAGIC_len = 8;
 const int END_MAGIC_len = 8;
+/// Number of metadata messages read on demand that are kept
+const size_t METADATA_CACHE_SIZE = 64;
 
 namespace a4{ namespace io{
 
+    class ThreadPool;
+
+    /// Per header state found by discovering all metadata of a stream.
+    /// It does not change afterwards, and is shared by the streams created
+    /// by InputStreamImpl::split().
+    struct DiscoveryState {
+        std::vector<std::vector<uint64_t>> metadata_offset_per_header;
+        std::vector<bool> headers_forward;
+        // in the order they are found, from the end of the stream
+        std::vector<StreamFooter> footers;
+        // per header in file order
+        std::vector<uint64_t> header_offsets;
+        std::vector<StreamFooter> footer_per_header;
+    };
+
     class InputStreamImpl
     {
         public:
@@ -36,12 +57,27 @@ namespace a4{ namespace io{
             shared<A4Message> next_bare_message();
             /// Returns the next regular or metadata message in the stream.
             shared<A4Message> next_with_metadata() { return next(false); }
-            /// Return the current metadata message.
-            shared<const A4Message> current_metadata() {return _current_metadata; }
+            /// Return the current metadata message, reading it if needed.
+            shared<const A4Message> current_metadata() {
+                if (_pending_metadata) {
+                    _pending_metadata = false;
+                    _current_metadata = metadata_message(_pending_metadata_header, _pending_metadata_index);
+                }
+                return _current_metadata;
+            }
             /// Seek to the given header/metadata combination.
             /// If carry==false, specifying a metadata index not in that header section
             /// causes an exception, otherwise the next header is used, or false is returned on EOF.
             bool seek_to(uint32_t header, int32_t metadata, bool carry=false);
+            /// Seek so that the next call to next() returns the given event,
+            /// counting regular messages from the start of the file.
+            /// Uses the event index in the footers if present.
+            /// Returns false if the file has fewer events.
+            bool seek_to_event(uint64_t event);
+            /// Create independent streams that each read one metadata block,
+            /// see InputStream::split(). Returns an empty vector if the
+            /// underlying resource cannot be cloned.
+            std::vector<UNIQUE<InputStreamImpl>> split();
             /// Skip to the start of the next metadata block. Return false if EOF, true if not.
             bool skip_to_next_metadata() {
                 return seek_to(_current_header_index, _current_metadata_index+1, true);
@@ -63,7 +99,7 @@ namespace a4{ namespace io{
             bool end() { return !_error && !_good; }
             /// explicitely close the stream
             void close() {
-                _coded_in.reset();
+                _frames.reset();
                 _compressed_in.reset();
                 _raw_in.reset();
                 _good = false;
@@ -73,22 +109,15 @@ namespace a4{ namespace io{
 
             std::string str() { return _inputname; };
             
-            const std::vector<std::vector<shared<a4::io::A4Message>>>& all_metadata() {
-                if (_metadata_per_header.size() == 0) {
-                    if (_started)
-                        FATAL("Coding Bug: all_metadata first called after reading started!");
-                    startup(true);
-                }
-                return _metadata_per_header;
-            }
+            const std::vector<std::vector<shared<a4::io::A4Message>>>& all_metadata();
             
             const std::vector<StreamFooter>& footers() {
-                if (_footers.size() == 0) {
+                if (_discovery->footers.size() == 0) {
                     if (_started) 
                         FATAL("Coding Bug: footers() first called after reading started!");
                     startup(true);
                 }
-                return _footers;
+                return _discovery->footers;
             }
             
             std::vector<const google::protobuf::FileDescriptor*> get_filedescriptors() {
@@ -101,12 +130,18 @@ namespace a4{ namespace io{
             }
 
             void set_hint_copy(bool hint_copy);
+            bool hint_copy() const { return _hint_copy; }
+            void set_recycle_messages(bool recycle);
+            void set_projection(const std::vector<std::string>& fields);
+            void add_zone_filter(const std::string& field, double min, double max);
+            void set_parallel_decompression(int threads, int readahead_blocks=0);
+            void set_readahead(size_t bytes) { _raw_in->set_readahead(bytes); }
             bool try_read(Message & msg, const google::protobuf::Descriptor* d);
 
         private:
             UNIQUE<ZeroCopyStreamResource> _raw_in;
             UNIQUE<BaseCompressedInputStream> _compressed_in;
-            shared<google::protobuf::io::CodedInputStream> _coded_in;
+            shared<FrameReader> _frames;
             shared<ProtoClassPool> _current_class_pool;
 
             // variables set at construction time
@@ -114,7 +149,6 @@ namespace a4{ namespace io{
 
             // status variables
             bool _good, _error, _started, _discovery_complete, _do_reset_metadata;
-            uint64_t _items_read;
             unsigned int _current_header_index;
             int32_t _current_metadata_index;
             int _fileno;
@@ -123,19 +157,51 @@ namespace a4{ namespace io{
             bool _new_metadata, _current_metadata_refers_forward;
             shared<A4Message> _current_metadata;
             shared<A4Message> _pickup;
-            std::vector<std::vector<uint64_t>> _metadata_offset_per_header;
+            shared<const DiscoveryState> _discovery;
+            // only filled by all_metadata(), or by discovery if the stream
+            // cannot be cloned to read metadata on demand
             std::vector<std::vector<shared<A4Message>>> _metadata_per_header;
-            std::vector<bool> _headers_forward;
-            std::vector<StreamFooter> _footers;
+            // the current metadata if it has not been read yet
+            bool _pending_metadata;
+            uint32_t _pending_metadata_header;
+            int32_t _pending_metadata_index;
+            // metadata read on demand by a second stream on the same
+            // resource, and the most recently used of them
+            UNIQUE<InputStreamImpl> _metadata_reader;
+            typedef std::list<std::pair<uint64_t, shared<A4Message>>> MetadataLRU;
+            MetadataLRU _metadata_lru;
+            std::unordered_map<uint64_t, MetadataLRU::iterator> _metadata_lru_index;
+            std::vector<shared<ProtoClassPool>> _class_pool_per_header;
+
+            // restriction to a single metadata block, or to the footer chunks
+            // [_range_chunk, _range_chunk_end) in it (-1: block bound), set by split()
+            bool _has_range;
+            uint32_t _range_header;
+            int32_t _range_block;
+            int32_t _range_chunk, _range_chunk_end;
+            uint64_t _range_end;
     
             // internal functions
             void startup(bool discovery_requested=false);
-            void reset_coded_stream();
             bool discover_all_metadata();
+            bool restore_discovery(const DiscoveryCache& cache);
+            bool require_discovery();
+            bool read_protoclasses(const StreamFooter& footer, uint64_t header_offset,
+                                   DiscoveredHeader* discovered=NULL);
+            shared<ProtoClassPool> class_pool_for_header(uint32_t header);
+            void set_metadata_state(uint32_t header, int32_t metadata_before);
+            void set_current_metadata(uint32_t header, int32_t index);
+            shared<A4Message> metadata_message(uint32_t header, int32_t index);
+            shared<A4Message> read_metadata(uint32_t header, int32_t index);
+            bool start_metadata_block(uint32_t header, int32_t block);
+            bool start_chunk_range(uint32_t header, int32_t block, int32_t chunk, int32_t chunk_end);
+            bool range_end_reached();
             bool start_compression(const a4::io::StartCompressedSection& cs);
             bool stop_compression(const a4::io::EndCompressedSection& cs);
             void drop_compression();
             bool read_header(bool discovery_requested=false);
+            bool seek_to_header(uint32_t header);
+            void reset_header_metadata();
             int64_t seek(int64_t position);
             int64_t seek_back(int64_t position);
             shared<A4Message> bare_message();
@@ -153,6 +219,39 @@ namespace a4{ namespace io{
             bool set_end();
 
             bool _hint_copy;
+
+            // message recycling: the last returned message, and spare protobuf
+            // messages per class id of the class pool _spare_pool
+            bool _recycle_messages;
+            shared<A4Message> recycled_message(uint32_t class_id, uint32_t size);
+            shared<A4Message> _recycled_message;
+            std::vector<shared<Message>> _spare_messages;
+            shared<ProtoClassPool> _spare_pool;
+
+            // field projection, resolved per class id of the class pool _projection_pool
+            std::vector<std::string> _projection_fields;
+            const Projection* projection(uint32_t class_id);
+            std::vector<shared<Projection>> _projections;
+            std::vector<bool> _projection_resolved;
+            shared<ProtoClassPool> _projection_pool;
+
+            // block skipping by the zone maps in the footers; the block
+            // (header and zone map entry) last found to match is remembered
+            struct ZoneFilter {
+                std::string field;
+                double min, max;
+            };
+            std::vector<ZoneFilter> _zone_filters;
+            uint32_t _zone_header;
+            int32_t _zone_entry;
+            bool zone_block_matches();
+            bool block_may_match(uint32_t header, int32_t entry);
+            bool skip_zone_block();
+            bool seek_to_block(uint32_t header, int32_t block);
+
+            // parallel decompression of block-compressed sections
+            int _decompression_threads, _decompression_readahead;
+            shared<ThreadPool> _decompression_pool;
     };
 
 inline
@@ -161,13 +260,12 @@ bool InputStreamImpl::try_read(Message & msg, const google::protobuf::Descriptor
         startup();
     if (!_good) 
         return false;
+    if (_range_end && !_compressed_in && range_end_reached())
+        return false;
     if (_hint_copy) notify_last_unread_message();
-    if (_items_read++ % 10000 == 0) {
-        reset_coded_stream();
-    }
 
     uint32_t size = 0;
-    if (!_coded_in->ReadLittleEndian32(&size)) {
+    if (!_frames->ReadLittleEndian32(&size)) {
         if (_compressed_in && _compressed_in->ByteCount() == 0) {
             FATAL("Reading from compressed section failed!");
         } else {
@@ -178,18 +276,16 @@ bool InputStreamImpl::try_read(Message & msg, const google::protobuf::Descriptor
     uint32_t class_id = 0;
     if (size & HIGH_BIT) {
         size = size & (HIGH_BIT - 1);
-        if (!_coded_in->ReadLittleEndian32(&class_id))
+        if (!_frames->ReadLittleEndian32(&class_id))
             FATAL("Unexpected end of file [1]!");
     }
     if (_current_class_pool->check_match(class_id, d)) {
-        auto lim = _coded_in->PushLimit(size);
-        if (not msg.ParseFromCodedStream(_coded_in.get())) {
+        if (not _frames->ParseMessage(&msg, size)) {
             FATAL("Failed to read expected event!");
         }
-        _coded_in->PopLimit(lim);
         return true;
     } else {
-        auto _message = _current_class_pool->parse_message(class_id, _coded_in, size);
+        auto _message = _current_class_pool->parse_message(class_id, _frames, size);
         _pickup.reset(new A4Message(class_id, _message, _current_class_pool));
         return false;
     }
@@ -207,15 +303,13 @@ shared<A4Message> InputStreamImpl::bare_message() {
         startup();
     if (!_good) 
         return shared<A4Message>();
+    if (_range_end && !_compressed_in && range_end_reached())
+        return shared<A4Message>();
 
     if (_hint_copy) notify_last_unread_message();
 
-    if (_items_read++ % 10000 == 0) {
-        reset_coded_stream();
-    }
-
     uint32_t size = 0;
-    if (!_coded_in->ReadLittleEndian32(&size)) {
+    if (!_frames->ReadLittleEndian32(&size)) {
         if (_compressed_in && _compressed_in->ByteCount() == 0) {
             FATAL("Reading from compressed section failed! inside compression: ",
                   bool(_compressed_in), " compressed bytecount: ",
@@ -229,7 +323,7 @@ shared<A4Message> InputStreamImpl::bare_message() {
     uint32_t class_id = 0;
     if (size & HIGH_BIT) {
         size = size & (HIGH_BIT - 1);
-        if (!_coded_in->ReadLittleEndian32(&class_id))
+        if (!_frames->ReadLittleEndian32(&class_id))
             FATAL("Unexpected end of file [1]!");
     }
     
@@ -237,15 +331,74 @@ shared<A4Message> InputStreamImpl::bare_message() {
 
     if (_hint_copy) {
 
-        shared<A4Message> umsg(new A4Message(class_id, size, _coded_in, _current_class_pool));
+        shared<A4Message> umsg(new A4Message(class_id, size, _frames, _current_class_pool));
         _last_unread_message = umsg;
         return umsg;
+    } else if (_recycle_messages) {
+        return recycled_message(class_id, size);
     } else {
-        auto _message = _current_class_pool->parse_message(class_id, _coded_in, size);
+        auto _message = _current_class_pool->parse_message(class_id, _frames, size,
+                                                           shared<Message>(), projection(class_id));
         return shared<A4Message>(new A4Message(class_id, _message, _current_class_pool));
     }
 }
 
+/// Projection of the given class, or NULL if it is parsed completely.
+/// Metadata and stream messages are always parsed completely.
+inline
+const Projection* InputStreamImpl::projection(uint32_t class_id) {
+    if (_projection_fields.empty() || class_id % 2 == 1 || (class_id >= 100 && class_id <= 200))
+        return NULL;
+    if (_projection_pool != _current_class_pool) {
+        _projections.clear();
+        _projection_resolved.clear();
+        _projection_pool = _current_class_pool;
+    }
+    if (class_id >= _projections.size()) {
+        _projections.resize(class_id+1);
+        _projection_resolved.resize(class_id+1);
+    }
+    if (!_projection_resolved[class_id]) {
+        _projections[class_id] = Projection::resolve(_current_class_pool->descriptor(class_id),
+                                                     _projection_fields);
+        _projection_resolved[class_id] = true;
+    }
+    return _projections[class_id].get();
+}
+
+/// Parse the next message into the previously returned message and a spare
+/// protobuf message of its class, if they are not referenced elsewhere.
+inline
+shared<A4Message> InputStreamImpl::recycled_message(uint32_t class_id, uint32_t size) {
+    if (_spare_pool != _current_class_pool) {
+        // class ids are only valid within a class pool
+        _spare_messages.clear();
+        _spare_pool = _current_class_pool;
+    }
+    shared<A4Message> msg;
+    if (_recycled_message && _recycled_message.use_count() == 1) {
+        msg.swap(_recycled_message);
+        uint32_t old_id = msg->_class_id;
+        if (msg->_message && msg->_message.use_count() == 1 && msg->_pool == _spare_pool) {
+            if (old_id >= _spare_messages.size())
+                _spare_messages.resize(old_id+1);
+            _spare_messages[old_id].swap(msg->_message);
+        }
+    }
+
+    shared<Message> spare;
+    if (class_id < _spare_messages.size())
+        spare.swap(_spare_messages[class_id]);
+    auto _message = _current_class_pool->parse_message(class_id, _frames, size, spare,
+                                                       projection(class_id));
+    if (msg)
+        msg->recycle(class_id, _message, _current_class_pool);
+    else
+        msg.reset(new A4Message(class_id, _message, _current_class_pool));
+    _recycled_message = msg;
+    return msg;
+}
+
 /// Deals with a4.io.StartCompressedSection and a4.io.EndCompressedSection messages
 inline
 bool InputStreamImpl::handle_compressed_section(shared<A4Message> msg) {
@@ -270,17 +423,17 @@ bool InputStreamImpl::handle_stream_command(shared<A4Message> msg) {
     if (msg->is<StreamFooter>()) {
         if (_hint_copy) notify_last_unread_message();
         uint32_t size;
-        if (!_coded_in->ReadLittleEndian32(&size))
+        if (!_frames->ReadLittleEndian32(&size))
             FATAL("Unexpected end of file [3]!");
         
         string magic;
-        if (!_coded_in->ReadString(&magic, 8))
+        if (!_frames->ReadString(&magic, 8))
             FATAL("Unexpected end of file [4]!");
             
         if (0 != magic.compare(END_MAGIC))
             FATAL("Corrupt footer! Read: ", magic);
         
-        if (_coded_in->ExpectAtEnd()) {
+        if (_frames->ExpectAtEnd()) {
              // Regular end of stream
             _good = false;
             return true;
@@ -292,16 +445,7 @@ bool InputStreamImpl::handle_stream_command(shared<A4Message> msg) {
             _good = false; // Slightly strange but regular end of stream
             return true;
         }
-        _current_metadata = shared<A4Message>();
-        if (!_current_metadata_refers_forward) {
-            _current_metadata_index = 0;
-            if (_metadata_per_header[_current_header_index].size() > 0)
-                _current_metadata = _metadata_per_header[_current_header_index][0];
-        } else {
-            _current_metadata_index = -1;
-        }
-        _do_reset_metadata = false; // if we had an increment before, ignore it
-        _new_metadata = true; // a footer invalidates metadata
+        reset_header_metadata();
         return true;
     } else if (msg->is<StreamHeader>()) {
         FATAL("Unexpected header!");
@@ -326,6 +470,31 @@ bool InputStreamImpl::handle_stream_command(shared<A4Message> msg) {
     return false;
 }
 
+/// Make the given metadata message of a header the current metadata. It is
+/// only read when current_metadata() asks for it. Invalid indices clear it.
+inline
+void InputStreamImpl::set_current_metadata(uint32_t header, int32_t index) {
+    _current_metadata.reset();
+    _pending_metadata = header < _discovery->metadata_offset_per_header.size() && index >= 0
+        && index < static_cast<int32_t>(_discovery->metadata_offset_per_header[header].size());
+    _pending_metadata_header = header;
+    _pending_metadata_index = index;
+}
+
+/// Set the metadata state to the start of the current header
+inline
+void InputStreamImpl::reset_header_metadata() {
+    if (!_current_metadata_refers_forward) {
+        _current_metadata_index = 0;
+        set_current_metadata(_current_header_index, 0);
+    } else {
+        _current_metadata_index = -1;
+        set_current_metadata(_current_header_index, -1);
+    }
+    _do_reset_metadata = false; // if we had an increment before, ignore it
+    _new_metadata = true; // a footer invalidates metadata
+}
+
 inline
 bool InputStreamImpl::handle_metadata(shared<A4Message> msg) {
     //if (_current_header_index > 0) {
@@ -336,6 +505,7 @@ bool InputStreamImpl::handle_metadata(shared<A4Message> msg) {
     if (msg->metadata()) {
         _current_metadata_index++;
         if (_current_metadata_refers_forward) {
+            _pending_metadata = false;
             _current_metadata = msg;
             _new_metadata = true;
         } else {
@@ -350,12 +520,7 @@ inline
 shared<A4Message> InputStreamImpl::next_message() {
     if (_do_reset_metadata) {
         _do_reset_metadata = false;
-        _current_metadata = shared<A4Message>();
-        if (_metadata_per_header.size() > _current_header_index) {
-            auto& header_metadata = _metadata_per_header[_current_header_index];
-            if (static_cast<int32_t>(header_metadata.size()) > _current_metadata_index)
-                _current_metadata = header_metadata[_current_metadata_index];
-        }
+        set_current_metadata(_current_header_index, _current_metadata_index);
         _new_metadata = true;
     }
     shared<A4Message> msg = bare_message();
@@ -373,9 +538,25 @@ shared<A4Message> InputStreamImpl::next(bool skip_metadata) {
 
     if (msg and handle_metadata(msg) && skip_metadata) 
         return next(skip_metadata);
+    if (msg and not _zone_filters.empty() and not msg->metadata() and not zone_block_matches())
+        return skip_zone_block() ? next(skip_metadata) : shared<A4Message>();
     return msg;
 }
 
+/// True if the regular messages of the current block can match the zone
+/// filters. Entry i of a zone map is the block after i metadata messages.
+inline
+bool InputStreamImpl::zone_block_matches() {
+    int32_t entry = _current_metadata_index + (_current_metadata_refers_forward ? 1 : 0);
+    if (_zone_header == _current_header_index && _zone_entry == entry)
+        return true;
+    if (!block_may_match(_current_header_index, entry))
+        return false;
+    _zone_header = _current_header_index;
+    _zone_entry = entry;
+    return true;
+}
+
 inline
 shared<A4Message> InputStreamImpl::next_bare_message() {
     shared<A4Message> msg = next_message();
@@ -0,0 +1,267 @@
+#include <sstream>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <boost/thread.hpp>
+
+#include <a4/dynamic_message.h>
+
+#include "merge_plan.h"
+
+using google::protobuf::Descriptor;
+using google::protobuf::EnumValueDescriptor;
+using google::protobuf::FieldDescriptor;
+using google::protobuf::Message;
+using google::protobuf::Reflection;
+
+namespace a4{ namespace io{
+
+    typedef boost::unique_lock<boost::mutex> Lock;
+
+    // Typed access to the fields of one cpp_type. Key is what values are
+    // compared and hashed by.
+#define A4_SCALAR_ACCESS(TYPE, NAME) \
+    struct NAME##Access { \
+        typedef TYPE Key; \
+        static TYPE get(const Message& m, const FieldDescriptor* f) { \
+            return m.GetReflection()->Get##NAME(m, f); } \
+        static void set(Message& m, const FieldDescriptor* f, TYPE const& v) { \
+            m.GetReflection()->Set##NAME(&m, f, v); } \
+        static TYPE key(const Message& m, const FieldDescriptor* f) { return get(m, f); } \
+        static TYPE key(const Message& m, const FieldDescriptor* f, int i) { \
+            return m.GetReflection()->GetRepeated##NAME(m, f, i); } \
+        static void add_from(Message& m1, const Message& m2, const FieldDescriptor* f, int i) { \
+            m1.GetReflection()->Add##NAME(&m1, f, key(m2, f, i)); } \
+    };
+
+    A4_SCALAR_ACCESS(int32_t, Int32)
+    A4_SCALAR_ACCESS(int64_t, Int64)
+    A4_SCALAR_ACCESS(uint32_t, UInt32)
+    A4_SCALAR_ACCESS(uint64_t, UInt64)
+    A4_SCALAR_ACCESS(double, Double)
+    A4_SCALAR_ACCESS(float, Float)
+    A4_SCALAR_ACCESS(bool, Bool)
+    A4_SCALAR_ACCESS(std::string, String)
+    A4_SCALAR_ACCESS(const EnumValueDescriptor*, Enum)
+#undef A4_SCALAR_ACCESS
+
+    // Submessages are compared by their serialization
+    struct MessageAccess {
+        typedef std::string Key;
+        static std::string key(const Message& m, const FieldDescriptor* f) {
+            return m.GetReflection()->GetMessage(m, f).SerializeAsString(); }
+        static std::string key(const Message& m, const FieldDescriptor* f, int i) {
+            return m.GetReflection()->GetRepeatedMessage(m, f, i).SerializeAsString(); }
+        static void add_from(Message& m1, const Message& m2, const FieldDescriptor* f, int i) {
+            m1.GetReflection()->AddMessage(&m1, f)->CopyFrom(m2.GetReflection()->GetRepeatedMessage(m2, f, i)); }
+    };
+
+    template <typename T> struct Add {
+        static T apply(const T& a, const T& b) { return a + b; }
+    };
+
+    template <typename T> struct Multiply {
+        static T apply(const T& a, const T& b) { return a * b; }
+    };
+    template <> struct Multiply<std::string> {
+        static std::string apply(const std::string& a, const std::string& b) { return a + b; }
+    };
+    template <> struct Multiply<bool> {
+        static bool apply(const bool& a, const bool& b) { return a && b; }
+    };
+
+    static bool present(const Message& m, const FieldDescriptor* f) {
+        const Reflection* r = m.GetReflection();
+        return f->is_repeated() ? r->FieldSize(m, f) != 0 : r->HasField(m, f);
+    }
+
+    static std::string field_string(const Message& m, const FieldDescriptor* f) {
+        ConstDynamicField field(m, f);
+        if (!field.repeated())
+            return field.value().str();
+        std::stringstream ss;
+        for (int i = 0; i < field.size(); i++)
+            ss << (i ? ", " : "") << field.value(i).str();
+        return ss.str();
+    }
+
+    template <class A>
+    static void block_if_different(Message& m1, const Message& m2, const FieldDescriptor* f) {
+        bool equal = true;
+        if (f->is_repeated()) {
+            int size = m1.GetReflection()->FieldSize(m1, f);
+            equal = (size == m2.GetReflection()->FieldSize(m2, f));
+            for (int i = 0; equal && i < size; i++)
+                equal = (A::key(m1, f, i) == A::key(m2, f, i));
+        } else {
+            equal = (A::key(m1, f) == A::key(m2, f));
+        }
+        if (!equal)
+            throw a4::Fatal("Trying to merge metadata objects with different entries in ", f->full_name(), ":",
+                            field_string(m1, f), " != ", field_string(m2, f));
+    }
+
+    template <class A, class Op>
+    static void combine(Message& m1, const Message& m2, const FieldDescriptor* f) {
+        A::set(m1, f, Op::apply(A::get(m1, f), A::get(m2, f)));
+    }
+
+    template <class A>
+    static void append(Message& m1, const Message& m2, const FieldDescriptor* f) {
+        int size = m2.GetReflection()->FieldSize(m2, f);
+        for (int i = 0; i < size; i++)
+            A::add_from(m1, m2, f, i);
+    }
+
+    template <class A>
+    static void union_with(Message& m1, const Message& m2, const FieldDescriptor* f) {
+        std::unordered_set<typename A::Key> seen;
+        int size1 = m1.GetReflection()->FieldSize(m1, f);
+        for (int i = 0; i < size1; i++)
+            seen.insert(A::key(m1, f, i));
+        int size2 = m2.GetReflection()->FieldSize(m2, f);
+        for (int i = 0; i < size2; i++) {
+            if (seen.insert(A::key(m2, f, i)).second)
+                A::add_from(m1, m2, f, i);
+        }
+    }
+
+    template <class A>
+    static void unionize_field(Message& m, const FieldDescriptor* f) {
+        const Reflection* r = m.GetReflection();
+        std::unordered_set<typename A::Key> seen;
+        int size = r->FieldSize(m, f), kept = 0;
+        for (int i = 0; i < size; i++) {
+            if (seen.insert(A::key(m, f, i)).second) {
+                if (i != kept)
+                    r->SwapElements(&m, f, i, kept);
+                kept++;
+            }
+        }
+        for (; size > kept; size--)
+            r->RemoveLast(&m, f);
+    }
+
+    static void not_repeated(Message&, const Message&, const FieldDescriptor* f) {
+        FATAL("MERGE_UNION/APPEND is not applicable to non-repeated field ", f->full_name());
+    }
+
+    static void not_implemented_repeated(Message&, const Message&, const FieldDescriptor* f) {
+        FATAL("Not implemented: ", MetadataMergeOptions_Name(f->options().GetExtension(merge)),
+              " with repeated field ", f->full_name());
+    }
+
+    static void not_applicable(Message&, const Message&, const FieldDescriptor* f) {
+        FATAL(MetadataMergeOptions_Name(f->options().GetExtension(merge)),
+              " is not applicable to field ", f->full_name(), " of this type");
+    }
+
+    static void drop(Message&, const Message&, const FieldDescriptor*) {}
+
+    template <class A>
+    static void choose_collection(MetadataMergeOptions option, const FieldDescriptor* f,
+                                  MergePlan::MergeFunction& merge_function, MergePlan::UnionizeFunction& unionize_function) {
+        switch (option) {
+            case MERGE_BLOCK_IF_DIFFERENT:
+                merge_function = &block_if_different<A>;
+                break;
+            case MERGE_UNION:
+                merge_function = f->is_repeated() ? &union_with<A> : &not_repeated;
+                if (f->is_repeated())
+                    unionize_function = &unionize_field<A>;
+                break;
+            case MERGE_APPEND:
+                merge_function = f->is_repeated() ? &append<A> : &not_repeated;
+                break;
+            case MERGE_DROP:
+                merge_function = &drop;
+                break;
+            default:
+                merge_function = &not_applicable;
+        }
+    }
+
+    template <class A>
+    static void choose_arithmetic(MetadataMergeOptions option, const FieldDescriptor* f,
+                                  MergePlan::MergeFunction& merge_function, MergePlan::UnionizeFunction& unionize_function) {
+        typedef typename A::Key T;
+        switch (option) {
+            case MERGE_ADD:
+                merge_function = f->is_repeated() ? &not_implemented_repeated : &combine<A, Add<T> >;
+                break;
+            case MERGE_MULTIPLY:
+                merge_function = f->is_repeated() ? &not_implemented_repeated : &combine<A, Multiply<T> >;
+                break;
+            default:
+                choose_collection<A>(option, f, merge_function, unionize_function);
+        }
+    }
+
+    MergePlan::MergePlan(const Descriptor* d) {
+        for (int i = 0; i < d->field_count(); i++) {
+            Step step;
+            step.field = d->field(i);
+            step.option = step.field->options().GetExtension(a4::io::merge);
+            step.merge = NULL;
+            step.unionize = NULL;
+            if (!MetadataMergeOptions_IsValid(step.option))
+                throw a4::Fatal("Unknown merge strategy: ", step.option, ". Recompilation should fix it.");
+            switch (step.field->cpp_type()) {
+                case FieldDescriptor::CPPTYPE_INT32:
+                    choose_arithmetic<Int32Access>(step.option, step.field, step.merge, step.unionize); break;
+                case FieldDescriptor::CPPTYPE_INT64:
+                    choose_arithmetic<Int64Access>(step.option, step.field, step.merge, step.unionize); break;
+                case FieldDescriptor::CPPTYPE_UINT32:
+                    choose_arithmetic<UInt32Access>(step.option, step.field, step.merge, step.unionize); break;
+                case FieldDescriptor::CPPTYPE_UINT64:
+                    choose_arithmetic<UInt64Access>(step.option, step.field, step.merge, step.unionize); break;
+                case FieldDescriptor::CPPTYPE_DOUBLE:
+                    choose_arithmetic<DoubleAccess>(step.option, step.field, step.merge, step.unionize); break;
+                case FieldDescriptor::CPPTYPE_FLOAT:
+                    choose_arithmetic<FloatAccess>(step.option, step.field, step.merge, step.unionize); break;
+                case FieldDescriptor::CPPTYPE_BOOL:
+                    choose_arithmetic<BoolAccess>(step.option, step.field, step.merge, step.unionize); break;
+                case FieldDescriptor::CPPTYPE_STRING:
+                    choose_arithmetic<StringAccess>(step.option, step.field, step.merge, step.unionize); break;
+                case FieldDescriptor::CPPTYPE_ENUM:
+                    choose_collection<EnumAccess>(step.option, step.field, step.merge, step.unionize); break;
+                case FieldDescriptor::CPPTYPE_MESSAGE:
+                    choose_collection<MessageAccess>(step.option, step.field, step.merge, step.unionize); break;
+                default:
+                    FATAL("Unknown type ", step.field->cpp_type());
+            }
+            _steps.push_back(step);
+        }
+    }
+
+    shared<const MergePlan> MergePlan::get(const Descriptor* d) {
+        // Dynamic descriptors can be freed and their address reused,
+        // their plans are cached by whoever owns them (see ProtoClassPool)
+        if (d->file()->pool() != google::protobuf::DescriptorPool::generated_pool())
+            return shared<const MergePlan>(new MergePlan(d));
+
+        static boost::mutex mutex;
+        static std::unordered_map<const Descriptor*, shared<const MergePlan>> plans;
+        Lock lock(mutex);
+        shared<const MergePlan>& plan = plans[d];
+        if (!plan)
+            plan.reset(new MergePlan(d));
+        return plan;
+    }
+
+    void MergePlan::merge(Message& m1, const Message& m2) const {
+        foreach(const Step& step, _steps) {
+            if (!present(m1, step.field) && !present(m2, step.field))
+                continue;
+            step.merge(m1, m2, step.field);
+        }
+    }
+
+    void MergePlan::unionize(Message& m) const {
+        foreach(const Step& step, _steps) {
+            if (step.unionize)
+                step.unionize(m, step.field);
+        }
+    }
+
+};};
@@ -0,0 +1,52 @@
+#ifndef _A4_MERGE_PLAN_H_
+#define _A4_MERGE_PLAN_H_
+
+#include <vector>
+
+#include <google/protobuf/message.h>
+#include <google/protobuf/descriptor.h>
+
+#include <a4/types.h>
+
+#include <a4/io/A4.pb.h>
+
+namespace a4{ namespace io{
+
+    /// How to merge two messages of one class according to the "merge" field
+    /// options (see A4Message::operator+=). The options are looked up and the
+    /// typed merge function of every field is chosen only once per class, so
+    /// merging does not go through FieldContent and its variant.
+    class MergePlan {
+        public:
+            /// Plan for the given class. Plans of compiled-in classes are built
+            /// on first use and shared by all threads, others are built anew;
+            /// use ProtoClassPool::merge_plan() to cache those.
+            static shared<const MergePlan> get(const google::protobuf::Descriptor* d);
+
+            /// Merge m2 into m1, both have to be of the planned class
+            void merge(google::protobuf::Message& m1, const google::protobuf::Message& m2) const;
+
+            /// Remove duplicates from the MERGE_UNION fields, keeping the first of each
+            void unionize(google::protobuf::Message& m) const;
+
+            typedef void (*MergeFunction)(google::protobuf::Message& m1,
+                                          const google::protobuf::Message& m2,
+                                          const google::protobuf::FieldDescriptor* f);
+            typedef void (*UnionizeFunction)(google::protobuf::Message& m,
+                                             const google::protobuf::FieldDescriptor* f);
+
+        private:
+            MergePlan(const google::protobuf::Descriptor* d);
+
+            struct Step {
+                const google::protobuf::FieldDescriptor* field;
+                MetadataMergeOptions option;
+                MergeFunction merge;
+                UnionizeFunction unionize;
+            };
+            std::vector<Step> _steps;
+    };
+
+};};
+
+#endif
@@ -9,6 +9,9 @@
 #include <a4/io/A4.pb.h>
 
 #include <a4/dynamic_message.h>
+#include <a4/field_path.h>
+#include "frame_reader.h"
+#include "merge_plan.h"
 #include "proto_class_pool.h"
 
 using google::protobuf::DynamicMessageFactory;
@@ -21,26 +24,27 @@ namespace a4{ namespace io{
 
     void A4Message::invalidate_stream() const {
         if (not _instream_read) {
-            auto coded_in = _coded_in.lock();
-            if (not coded_in->ReadString(&_bytes, _size)) {
+            auto frames = _frames.lock();
+            if (not frames->ReadString(&_bytes, _size)) {
                 FATAL("Invalidating stream failed!");
-                coded_in->PushLimit(0);
                 _valid_bytes = false;
             } else {
                 _valid_bytes = true;
                 _instream_read = true;
             }
-            _coded_in.reset();
-            coded_in.reset();
+            _frames.reset();
+            frames.reset();
         }
     }
     
     /// Explicit copying is allowed
     A4Message::A4Message(const A4Message& m)
             : _class_id(m._class_id), _descriptor(m._descriptor),
-            _pool(m._pool), _size(0), _valid_bytes(), _coded_in(),
-            _bytes(), _message(), _instream_read(true)
+            _pool(m._pool), _size(0), _valid_bytes(), _frames(),
+            _bytes(), _message(), _instream_read(true), _consumed(false)
     {
+        if (m._consumed)
+            FATAL("Can not copy a message that was written to an output unread!");
         m.invalidate_stream();
         _descriptor = m._descriptor;
         _size = m._size;
@@ -54,9 +58,9 @@ namespace a4{ namespace io{
     }
     
     /// Constructs an unread A4Message connected to a ProtoClassPool
-    A4Message::A4Message(uint32_t class_id, size_t size, weak_shared<google::protobuf::io::CodedInputStream> coded_in, shared<ProtoClassPool> pool)
+    A4Message::A4Message(uint32_t class_id, size_t size, weak_shared<FrameReader> frames, shared<ProtoClassPool> pool)
             : _class_id(class_id), _descriptor(pool->descriptor(class_id)),
-            _pool(pool), _size(size), _valid_bytes(false), _coded_in(coded_in), _bytes(), _message(), _instream_read(false)
+            _pool(pool), _size(size), _valid_bytes(false), _frames(frames), _bytes(), _message(), _instream_read(false), _consumed(false)
     {
         assert_valid();
     }
@@ -64,7 +68,7 @@ namespace a4{ namespace io{
     /// Constructs an read A4Message connected to a ProtoClassPool
     A4Message::A4Message(uint32_t class_id, shared<Message> msg, shared<ProtoClassPool> pool)
             : _class_id(class_id), _descriptor(msg->GetDescriptor()),
-              _pool(pool), _size(0), _valid_bytes(false), _coded_in(), _bytes(), _message(msg), _instream_read(true)
+              _pool(pool), _size(0), _valid_bytes(false), _frames(), _bytes(), _message(msg), _instream_read(true), _consumed(false)
     { 
         assert_valid();
     }
@@ -74,7 +78,7 @@ namespace a4{ namespace io{
                        bool metadata)
             : _class_id(metadata ? NO_CLASS_ID_METADATA : NO_CLASS_ID),
               _descriptor(msg->GetDescriptor()), _pool(), _size(0),
-              _valid_bytes(false), _coded_in(), _instream_read(true)
+              _valid_bytes(false), _frames(), _instream_read(true), _consumed(false)
     {
         assert_valid();
     }
@@ -84,7 +88,7 @@ namespace a4{ namespace io{
                         bool metadata) 
             : _class_id(metadata ? NO_CLASS_ID_METADATA : NO_CLASS_ID),
               _descriptor(msg.GetDescriptor()), _pool(), _size(0),
-              _valid_bytes(false), _coded_in(), _bytes(), _message(msg.New()), _instream_read(true)
+              _valid_bytes(false), _frames(), _bytes(), _message(msg.New()), _instream_read(true), _consumed(false)
     {
         _message->CopyFrom(msg);
         assert_valid();
@@ -93,19 +97,41 @@ namespace a4{ namespace io{
     A4Message::~A4Message() {
     }
 
+    void A4Message::recycle(uint32_t class_id, shared<Message> msg, shared<ProtoClassPool> pool) {
+        _class_id = class_id;
+        _descriptor = msg->GetDescriptor();
+        _pool = pool;
+        _size = 0;
+        _valid_bytes = false;
+        _frames.reset();
+        _bytes.clear();
+        _message = msg;
+        _instream_read = true;
+        _consumed = false;
+        assert_valid();
+    }
+
+    void A4Message::consume() const {
+        _frames.reset();
+        _instream_read = true;
+        _consumed = true;
+    }
+
     const google::protobuf::Message* A4Message::message() const {
         assert_valid();
         if (_message) return _message.get();
 
         if (_valid_bytes) {
             _message = _pool->parse_message(_class_id, _bytes);
-        } else if (not _coded_in.expired()) {
-            auto coded_in = _coded_in.lock();
-            assert(coded_in);
-            _message = _pool->parse_message(_class_id, coded_in, _size);
+        } else if (not _frames.expired()) {
+            auto frames = _frames.lock();
+            assert(frames);
+            _message = _pool->parse_message(_class_id, frames, _size);
             _instream_read = true;
-            coded_in.reset();
-            _coded_in.reset();
+            frames.reset();
+            _frames.reset();
+        } else if (_consumed) {
+            FATAL("Can not read a message that was written to an output unread!");
         } else {
             FATAL("Called message() on empty A4Message!");
         }
@@ -118,7 +144,9 @@ namespace a4{ namespace io{
     }
 
     const std::string& A4Message::bytes() const {
-        if (not _coded_in.expired()) {
+        if (_consumed)
+            FATAL("Can not read a message that was written to an output unread!");
+        if (not _frames.expired()) {
             invalidate_stream();
         }
         if (not _valid_bytes) {
@@ -130,7 +158,7 @@ namespace a4{ namespace io{
     }
     
     size_t A4Message::bytesize() const {
-        if (not _coded_in.expired()) {
+        if (not _frames.expired()) {
             return _size;
         } else if (_valid_bytes) {
             return _bytes.size();
@@ -233,43 +261,8 @@ namespace a4{ namespace io{
         // invalidate the bytes since we are going to update this message
         _valid_bytes = false;
 
-        for (int i = 0; i < d->field_count(); i++) {
-            MetadataMergeOptions merge_opts = d->field(i)->options().GetExtension(merge);
-
-            DynamicField f1(*_message, d->field(i));
-            ConstDynamicField f2(*m2->_message, d->field(i));
-            
-            if (!f1.present() && !f2.present())
-                continue;
-
-            switch(merge_opts) {
-                case MERGE_BLOCK_IF_DIFFERENT:
-                    if(!(f1 == f2)) {
-                        //DEBUG("this=", message()->DebugString());
-                        //DEBUG("msg2=", m2->_message->DebugString());
-                        throw a4::Fatal("Trying to merge metadata objects with different entries in ", f1.name(), ":", f1.value().str(), " != ", f2.value().str());
-                    }
-                    // NOOP!
-                    //f1.set(f1.value());
-                    break;
-                case MERGE_ADD:
-                    inplace_add_fields(f1, f2);
-                    break;
-                case MERGE_MULTIPLY:
-                    inplace_multiply_fields(f1, f2);
-                    break;
-                case MERGE_UNION:
-                    inplace_append_fields(f1, f2);
-                    break;
-                case MERGE_APPEND:
-                    inplace_append_fields(f1, f2);
-                    break;
-                case MERGE_DROP:
-                    break;
-                default:
-                    throw a4::Fatal("Unknown merge strategy: ", merge_opts, ". Recompilation should fix it.");
-            }
-        }
+        shared<const MergePlan> plan = _pool ? _pool->merge_plan(d) : MergePlan::get(d);
+        plan->merge(*_message, *m2->_message);
         assert_valid();
         return *this;
     }
@@ -278,36 +271,10 @@ namespace a4{ namespace io{
     void A4Message::unionize() {
         assert_valid();
         if (not _message) return;
-        Message& m = *_message;
         _valid_bytes = false;
-        const auto* refl = m.GetReflection();
-        //const auto* desc = m.GetDescriptor();
-        
-        std::vector<const FieldDescriptor*> filled_fields;
-        refl->ListFields(m, &filled_fields);
-        
-        foreach (const auto* field, filled_fields) {
-            MetadataMergeOptions merge_opts = field->options().GetExtension(merge);
-            
-            DynamicField thisfield(m, field);
-            
-            switch (merge_opts) {
-                case MERGE_UNION:
-                {
-                    assert(thisfield.repeated());
-                    //if (thisfield.message()) FATAL("Can't merge union field with complex type");
-                    std::set<FieldContent> unioned;
-                    for (int i = 0; i < thisfield.size(); i++)
-                        unioned.insert(thisfield.value(i));
-                    thisfield.clear();
-                    foreach (auto& value, unioned)
-                        thisfield.add(value);
-                    break;
-                }
-                default:
-                    break;
-            }
-        }
+        const Descriptor* d = _message->GetDescriptor();
+        shared<const MergePlan> plan = _pool ? _pool->merge_plan(d) : MergePlan::get(d);
+        plan->unionize(*_message);
         assert_valid();
     }
     
@@ -326,6 +293,12 @@ namespace a4{ namespace io{
         }
     }
     
+    std::string A4Message::field_as_string(const FieldPath& path) const {
+        assert(descriptor() == path.descriptor());
+        assert_valid();
+        return path.str(*message());
+    }
+    
     bool A4Message::check_key_mergable(const A4Message& rhs, const std::string& field_name) const {
         assert(descriptor() == message()->GetDescriptor());
         assert_valid();
@@ -412,10 +385,12 @@ namespace a4{ namespace io{
             assert(_instream_read);
             return true;
         }
-        if (not _coded_in.expired()) {
+        if (not _frames.expired()) {
             assert(not _instream_read);
             return true;
         }
+        if (_consumed)
+            return true;
         assert(false);
     }
 #endif
@@ -12,6 +12,8 @@
 #include <a4/output.h>
 #include <a4/output_stream.h>
 
+#include "section_sink.h"
+
 using namespace a4::io;
 using std::ios;
 
@@ -21,7 +23,9 @@ A4Output::A4Output(std::string output_file, std::string description) :
     _closed(false),
     _regular_file(true),
     _output_file(output_file),
-    _description(description)
+    _description(description),
+    _section_bytes(0),
+    _queued_sections(0)
 {
     struct stat buffer;
     
@@ -58,16 +62,39 @@ void A4Output::report_finished(A4Output* output, OutputStream* s) {
         s->close();
 }
 
+void A4Output::set_shared_file(uint64_t section_bytes) {
+    Lock lock(_mutex);
+    if (!_filenames.empty())
+        FATAL("set_shared_file() has to be called before get_stream()");
+    if (_regular_file) {
+        _section_bytes = section_bytes;
+        _queued_sections = 0;
+    }
+}
+
+void A4Output::set_single_writer(uint64_t section_bytes, size_t queued_sections) {
+    Lock lock(_mutex);
+    if (!_filenames.empty())
+        FATAL("set_single_writer() has to be called before get_stream()");
+    _section_bytes = section_bytes;
+    _queued_sections = queued_sections ? queued_sections : 1;
+}
+
 /// Create a new output stream. For each call we create an independent output
 /// stream pointing to a different file, unless the destination is a fifo, in
-/// which case we only allow one call to `get_stream()`.
+/// which case we only allow one call to `get_stream()`. Streams writing
+/// sections to a shared destination have no file of their own.
 shared<OutputStream> A4Output::get_stream(std::string postfix, bool forward_metadata) {
     Lock lock(_mutex);
     int count = _filenames[postfix].size() + 1;
     
     // Determine filename
     std::string filename; 
-    if (!_regular_file) {
+    if (!_regular_file && _queued_sections) {
+        if (postfix != "")
+            FATAL("Cannot split output stream on a fifo output");
+        filename = _output_file + "[" + boost::lexical_cast<std::string>(count) + "]";
+    } else if (!_regular_file) {
         // Destination is non-regular so we should write to it directly.
         if (count != 1)
             FATAL("Can only create one output stream on a fifo output");
@@ -84,6 +111,20 @@ shared<OutputStream> A4Output::get_stream(std::string postfix, bool forward_meta
     }
     
     shared<OutputStream> os(new OutputStream(filename, _description));
+    if (_section_bytes) {
+        // Streams append sections to the destination itself
+        shared<SectionSink>& sink = _sinks[postfix];
+        if (!sink) {
+            std::string out = _output_file;
+            if (postfix != "")
+                out += "." + postfix;
+            if (_queued_sections)
+                sink.reset(new SectionQueue(out, _queued_sections));
+            else
+                sink.reset(new SharedOutputFile(out));
+        }
+        os->set_section_sink(sink, _section_bytes);
+    }
     
     if (forward_metadata)
         os->set_forward_metadata();
@@ -91,7 +132,7 @@ shared<OutputStream> A4Output::get_stream(std::string postfix, bool forward_meta
     _out_streams[postfix].push_back(os);
     _filenames[postfix].push_back(filename);
 
-    if (!_regular_file) os->open();
+    if (!_regular_file && !_section_bytes) os->open();
 
     #if defined(HAVE_LAMBDA) and defined(HAVE_NOEXCEPT)
     auto cb = [&](OutputStream* x) noexcept { report_finished(this, x); };
@@ -116,6 +157,14 @@ bool A4Output::close() {
             if (s->opened()) 
                 s->close();
     
+    if (_section_bytes) {
+        // All sections are in place once the destinations are closed
+        bool success = true;
+        foreach(auto sink, _sinks)
+            success = sink.second->close() && success;
+        return success;
+    }
+
     if (!_regular_file) {
         // We're writing to exactly one output, no filename fixup to do.
         return true;
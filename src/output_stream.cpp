@@ -5,6 +5,9 @@
 #include <vector>
 #include <iostream>
 #include <errno.h>
+#include <algorithm>
+#include <cmath>
+#include <limits>
 
 #include <google/protobuf/message.h>
 #include <google/protobuf/descriptor.h>
@@ -23,9 +26,13 @@
 
 #include "gzip_stream.h"
 #include "compressed_stream.h"
+#include "frame_reader.h"
+#include "section_sink.h"
+#include "thread_pool.h"
 
 using std::string;
 using google::protobuf::io::FileOutputStream;
+using google::protobuf::io::StringOutputStream;
 using google::protobuf::io::CodedOutputStream;
 using google::protobuf::FileDescriptor;
 using namespace a4::io;
@@ -33,6 +40,10 @@ using namespace a4::io;
 const string START_MAGIC = "A4STREAM";
 const string END_MAGIC = "KTHXBYE4";
 const uint32_t HIGH_BIT = 1<<31;
+/// Multiple of the section size at which shared file sections end at an event,
+/// and its minimum, so that the ProtoClasses of small sections do not reach it
+const uint64_t SECTION_HARD_LIMIT = 8;
+const uint64_t SECTION_HARD_LIMIT_MIN = 1024*1024;
 
 
 OutputStream::OutputStream(const string &output_file, 
@@ -42,6 +53,8 @@ OutputStream::OutputStream(const string &output_file,
     _fileno(-1),
     _compression(true),
     _compression_level(9),
+    _compression_threads(0),
+    _compression_blocks_in_flight(0),
 #ifdef HAVE_SNAPPY    
     _compression_type(SNAPPY),
 #else
@@ -50,6 +63,18 @@ OutputStream::OutputStream(const string &output_file,
     _opened(false),
     _closed(false),
     _metadata_refers_forward(false),
+    _event_index_interval(0),
+    _event_count(0),
+    _section_start(0),
+    _section_bytes(0),
+    _zone_map_descriptor(NULL),
+    _section_bytes_limit(0),
+    _sections_finished(0),
+    _events_cut_from_metadata(false),
+    _chunk_bytes(0),
+    _chunk_events(0),
+    _chunk_start(0),
+    _events_in_chunk(0),
     _next_class_id(0),
     _next_metadata_class_id(1)
 {
@@ -63,9 +88,23 @@ OutputStream::OutputStream(shared<google::protobuf::io::ZeroCopyOutputStream> ou
     _description(description),
     _fileno(0),
     _compression(true),
+    _compression_threads(0),
+    _compression_blocks_in_flight(0),
     _opened(false),
     _closed(false),
-    _metadata_refers_forward(false)
+    _metadata_refers_forward(false),
+    _event_index_interval(0),
+    _event_count(0),
+    _section_start(0),
+    _section_bytes(0),
+    _zone_map_descriptor(NULL),
+    _section_bytes_limit(0),
+    _sections_finished(0),
+    _events_cut_from_metadata(false),
+    _chunk_bytes(0),
+    _chunk_events(0),
+    _chunk_start(0),
+    _events_in_chunk(0)
 {
     _raw_out = out;
     _class_id_counts.resize(200);
@@ -81,6 +120,11 @@ bool OutputStream::open() {
     _opened = true;
     _compressed_out.reset();
 
+    if (_section_sink) {
+        start_section();
+        return true;
+    }
+
     if (_fileno == -1) {
         int fd = ::open(_output_name.c_str(), O_WRONLY | O_TRUNC | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
         if (fd < 0) {
@@ -104,6 +148,8 @@ bool OutputStream::close() {
     if(_closed) return true;
     assert(_opened);
     _closed = true;
+    if (_section_sink)
+        return finish_section();
     if (_compressed_out) stop_compression();
     write_footer();
     _coded_out.reset();
@@ -136,6 +182,11 @@ uint32_t OutputStream::find_class_id(const google::protobuf::Descriptor* d, bool
         if (metadata != (i->second % 2 == 1)) {
             FATAL("Sorry, you can use the same Message class (", d->full_name() ,") either for metadata or for content, but not both.");
         }
+        // Every section of a shared file has its own ProtoClasses
+        if (_section_sink && !have_written_classid(i->second)) {
+            write_protoclass(i->second, d);
+            set_written_classid(i->second);
+        }
         return i->second;
     }
     uint32_t class_id = 0;
@@ -149,6 +200,7 @@ uint32_t OutputStream::find_class_id(const google::protobuf::Descriptor* d, bool
     if (_next_metadata_class_id == 101) _next_metadata_class_id += 100; // skip the 100's, since the a4 messages are there.
     if (_next_class_id == 100) _next_class_id += 100; // skip the 100's, since the a4 messages are there.
     write_protoclass(class_id, d);
+    set_written_classid(class_id);
     _class_id[d->full_name()] = class_id;
     assert((class_id % 2) == metadata);
     return class_id;
@@ -157,25 +209,271 @@ uint32_t OutputStream::find_class_id(const google::protobuf::Descriptor* d, bool
 bool OutputStream::write(const google::protobuf::Message &msg)
 {
     if (!_opened) if(!open()) { return false; };
+    if (_section_sink && !finish_section_at_event()) return false;
     uint32_t class_id = find_class_id(msg.GetDescriptor(), false);
+    start_event();
+    if (!_zone_maps.empty()) update_zone_maps(msg);
     return write(class_id, msg);
 }
 
 bool OutputStream::write(shared<const A4Message> msg)
 {
     if (!_opened) if(!open()) { return false; };
+    if (_section_sink && !finish_section_at_event()) return false;
     uint32_t class_id = find_class_id(msg->descriptor(), false);
+    start_event();
+    if (!_zone_maps.empty()) {
+        msg->bytes(); // keep the serialized message for write()
+        update_zone_maps(*msg->message());
+    }
     return write(class_id, msg);
 }
 
+/// Bookkeeping before a regular message is written
+void OutputStream::start_event() {
+    if (_chunk_bytes || _chunk_events)
+        start_chunk_if_full();
+    if (_event_index_interval && _event_count % _event_index_interval == 0)
+        add_event_index_position();
+    _event_count++;
+    _events_in_chunk++;
+}
+
+/// Start a new chunk if the current one has reached the configured size,
+/// and record where it starts. Compressed chunks are compressed sections.
+void OutputStream::start_chunk_if_full() {
+    uint64_t bytes;
+    if (_compressed_out)
+        bytes = _section_bytes + _coded_out->ByteCount();
+    else
+        bytes = _raw_out->ByteCount() - _chunk_start; // approximate, includes buffers
+    if (!((_chunk_bytes && bytes >= _chunk_bytes) || (_chunk_events && _events_in_chunk >= _chunk_events)))
+        return;
+    if (_compressed_out) {
+        stop_compression();
+        start_compression();
+    }
+    EventIndexPosition p = current_position();
+    _chunk_start = p.section_offset;
+    _events_in_chunk = 0;
+    chunk_positions.push_back(p);
+}
+
+/// Position of the next event
+OutputStream::EventIndexPosition OutputStream::current_position() {
+    EventIndexPosition p;
+    p.event = _event_count;
+    p.metadata_index = metadata_positions.size();
+    if (_compressed_out) {
+        p.section_offset = _section_start;
+        p.inner_offset = _section_bytes + _coded_out->ByteCount();
+    } else {
+        _coded_out.reset();
+        p.section_offset = _raw_out->ByteCount();
+        p.inner_offset = 0;
+        _coded_out.reset(new CodedOutputStream(_raw_out.get()));
+    }
+    return p;
+}
+
+/// Remember where the next event starts, for the event index in the footer.
+void OutputStream::add_event_index_position() {
+    event_index_positions.push_back(current_position());
+}
+
+OutputStream& OutputStream::set_zone_map_fields(const std::vector<std::string>& fields) {
+    assert(!_opened);
+    _zone_maps.clear();
+    _zone_map_descriptor = NULL;
+    foreach (const std::string& field, fields) {
+        ZoneMapColumn z;
+        z.field = field;
+        _zone_maps.push_back(z);
+    }
+    start_zone_map_block();
+    return *this;
+}
+
+/// Start new zone map entries, for the messages after the next metadata.
+void OutputStream::start_zone_map_block() {
+    foreach (ZoneMapColumn& z, _zone_maps) {
+        z.min.push_back(std::numeric_limits<double>::infinity());
+        z.max.push_back(-std::numeric_limits<double>::infinity());
+        z.null_count.push_back(0);
+    }
+}
+
+/// Bounds of a 64 bit integer as doubles, rounded outwards
+template<typename T>
+static void integer_bounds(T value, double& lo, double& hi) {
+    lo = hi = static_cast<double>(value);
+    if (value > (T(1) << 53) || value < -static_cast<double>(T(1) << 53)) {
+        lo = std::nextafter(lo, -std::numeric_limits<double>::infinity());
+        hi = std::nextafter(hi, std::numeric_limits<double>::infinity());
+    }
+}
+
+/// Add the values of a regular message to the current zone map entries
+void OutputStream::update_zone_maps(const google::protobuf::Message& m) {
+    using google::protobuf::FieldDescriptor;
+    if (m.GetDescriptor() != _zone_map_descriptor) {
+        _zone_map_descriptor = m.GetDescriptor();
+        _zone_map_fields.clear();
+        foreach (const ZoneMapColumn& z, _zone_maps) {
+            const FieldDescriptor* f = _zone_map_descriptor->FindFieldByName(z.field);
+            if (f && (f->is_repeated() || f->cpp_type() == FieldDescriptor::CPPTYPE_STRING
+                      || f->cpp_type() == FieldDescriptor::CPPTYPE_MESSAGE))
+                FATAL("Zone map field ", f->full_name(), " is not a numeric field");
+            _zone_map_fields.push_back(f);
+        }
+    }
+    const google::protobuf::Reflection* r = m.GetReflection();
+    for (size_t i = 0; i < _zone_maps.size(); i++) {
+        ZoneMapColumn& z = _zone_maps[i];
+        const FieldDescriptor* f = _zone_map_fields[i];
+        if (!f || !r->HasField(m, f)) {
+            z.null_count.back()++;
+            continue;
+        }
+        double lo, hi;
+        switch (f->cpp_type()) {
+            case FieldDescriptor::CPPTYPE_INT32: lo = hi = r->GetInt32(m, f); break;
+            case FieldDescriptor::CPPTYPE_UINT32: lo = hi = r->GetUInt32(m, f); break;
+            case FieldDescriptor::CPPTYPE_INT64: integer_bounds(r->GetInt64(m, f), lo, hi); break;
+            case FieldDescriptor::CPPTYPE_UINT64: integer_bounds(r->GetUInt64(m, f), lo, hi); break;
+            case FieldDescriptor::CPPTYPE_FLOAT: lo = hi = r->GetFloat(m, f); break;
+            case FieldDescriptor::CPPTYPE_DOUBLE: lo = hi = r->GetDouble(m, f); break;
+            case FieldDescriptor::CPPTYPE_BOOL: lo = hi = r->GetBool(m, f); break;
+            case FieldDescriptor::CPPTYPE_ENUM: lo = hi = r->GetEnum(m, f)->number(); break;
+            default: FATAL("Control should not reach here.");
+        }
+        if (std::isnan(lo)) {
+            z.null_count.back()++;
+            continue;
+        }
+        z.min.back() = std::min(z.min.back(), lo);
+        z.max.back() = std::max(z.max.back(), hi);
+    }
+}
+
 bool OutputStream::metadata(const google::protobuf::Message &msg) {
     if (!_opened) if(!open()) { return false; };
+    // Sections of a shared file end at metadata, so that every block
+    // is in the same section as its metadata
+    if (_section_sink && _metadata_refers_forward)
+        if (!finish_section_if_full()) return false;
+    if (_events_cut_from_metadata) {
+        WARNING("Metadata of ", _output_name, " does not refer to the events of its previous section");
+        _events_cut_from_metadata = false;
+    }
     uint32_t class_id = find_class_id(msg.GetDescriptor(), true);
     metadata_positions.push_back(get_bytes_written());
-    return write(class_id, msg);
+    // metadata ends the current chunk
+    _chunk_start = metadata_positions.back();
+    _events_in_chunk = 0;
+    start_zone_map_block();
+    if (!write(class_id, msg)) return false;
+    if (_section_sink && !_metadata_refers_forward)
+        return finish_section_if_full();
+    return true;
+}
+
+OutputStream& OutputStream::set_section_sink(shared<SectionSink> sink, uint64_t section_bytes) {
+    assert(!_opened);
+    _section_sink = sink;
+    _section_bytes_limit = section_bytes;
+    _fileno = 0;
+    return *this;
+}
+
+/// Start a new section of a shared file in the section buffer,
+/// with all state that is stored per header reset
+void OutputStream::start_section() {
+    metadata_positions.clear();
+    protoclass_positions.clear();
+    event_index_positions.clear();
+    chunk_positions.clear();
+    _event_count = 0;
+    _section_start = _section_bytes = 0;
+    _chunk_start = _events_in_chunk = 0;
+    _written_file_descriptor_set.clear();
+    _written_classids.clear();
+    std::fill(_class_id_counts.begin(), _class_id_counts.end(), 0);
+    foreach (ZoneMapColumn& z, _zone_maps) {
+        z.min.clear();
+        z.max.clear();
+        z.null_count.clear();
+    }
+    start_zone_map_block();
+
+    _section_buffer.clear();
+    _raw_out.reset(new StringOutputStream(&_section_buffer));
+    _coded_out.reset(new CodedOutputStream(_raw_out.get()));
+    write_header(_description);
+    if (_compression) start_compression();
+}
+
+/// Write the footer of the current section and append it to the shared file.
+/// A section without messages is dropped, unless it would be the only one.
+bool OutputStream::finish_section() {
+    bool empty = _event_count == 0 && metadata_positions.empty();
+    if (_compressed_out) stop_compression();
+    write_footer();
+    _coded_out.reset();
+    _raw_out.reset();
+    bool ok = true;
+    if (!empty || !_sections_finished)
+        ok = _section_sink->append(_section_buffer);
+    _sections_finished++;
+    _section_buffer.clear();
+    return ok;
+}
+
+/// Bytes written to the current section so far
+uint64_t OutputStream::section_size() {
+    uint64_t bytes = _raw_out->ByteCount();
+    if (_compressed_out) bytes += _section_bytes + _coded_out->ByteCount();
+    return bytes;
+}
+
+/// Append the current section and start a new one if it has reached the
+/// configured size. The next section is started right away, since the
+/// stream is known to continue.
+bool OutputStream::finish_section_if_full() {
+    if (section_size() < _section_bytes_limit)
+        return true;
+    if (!finish_section())
+        return false;
+    start_section();
+    return true;
+}
+
+/// Called before the class of a regular message is looked up, which writes
+/// its ProtoClass to the section that the message goes to.
+/// Sections usually end at metadata. Before the first forward metadata the
+/// events have no metadata, so a full section can end at any event. Other
+/// sections end at an event only once they reach the hard limit, which
+/// separates the events after it from the metadata of the section.
+bool OutputStream::finish_section_at_event() {
+    bool free_events = _metadata_refers_forward && metadata_positions.empty();
+    uint64_t limit = _section_bytes_limit;
+    if (!free_events)
+        limit = std::max(limit * SECTION_HARD_LIMIT, SECTION_HARD_LIMIT_MIN);
+    if (_event_count == 0 || section_size() < limit)
+        return true;
+    if (!free_events && _metadata_refers_forward) {
+        WARNING("Section of ", _output_name, " reached ", limit, " bytes, the following events have no metadata");
+    } else if (!free_events) {
+        _events_cut_from_metadata = true;
+    }
+    if (!finish_section())
+        return false;
+    start_section();
+    return true;
 }
 
 void OutputStream::reset_coded_stream() {
+    if (_compressed_out) _section_bytes += _coded_out->ByteCount();
     _coded_out.reset();
     if (_compressed_out) 
         _coded_out.reset(new CodedOutputStream(_compressed_out.get()));
@@ -194,6 +492,17 @@ OutputStream& OutputStream::set_compression(CompressionType t, int level) {
     return *this;
 }
 
+OutputStream& OutputStream::set_compression_threads(int threads, int blocks_in_flight) {
+    if (_compressed_out) FATAL("set_compression_threads() has to be called before writing!");
+    if (threads != _compression_threads)
+        _compression_pool.reset();
+    _compression_threads = threads;
+    _compression_blocks_in_flight = blocks_in_flight > 0 ? blocks_in_flight : 2*threads;
+    if (_compression_threads > 0 && !_compression_pool)
+        _compression_pool.reset(new ThreadPool(_compression_threads));
+    return *this;
+}
+
 bool OutputStream::start_compression() {
     if (_compressed_out) return false;
     StartCompressedSection cs_header;
@@ -201,11 +510,43 @@ bool OutputStream::start_compression() {
     if (_compression_type == SNAPPY) cs_header.set_compression(StartCompressedSection_Compression_SNAPPY);
     else if (_compression_type == ZLIB) cs_header.set_compression(StartCompressedSection_Compression_ZLIB);
     else if (_compression_type == LZ4) cs_header.set_compression(StartCompressedSection_Compression_LZ4);
-    
+
+    _coded_out.reset();
+    _section_start = _raw_out->ByteCount();
+    _section_bytes = 0;
+    _coded_out.reset(new CodedOutputStream(_raw_out.get()));
+    _events_in_chunk = 0;
     if (!write(_fixed_class_id<StartCompressedSection>(), cs_header))
         FATAL("Failed to start compression");
     _coded_out.reset();
 
+    if (_compression_pool) {
+        switch (_compression_type) {
+        case SNAPPY:
+#ifdef HAVE_SNAPPY
+            _compressed_out.reset(new ParallelBlockCompressionOutputStream(_raw_out.get(),
+                &SnappyRawCompress, &SnappyMaxCompressedLength,
+                _compression_pool, _compression_blocks_in_flight));
+#else
+            FATAL("Snappy compression not compiled in!");
+#endif
+            break;
+        case LZ4:
+            _compressed_out.reset(new ParallelBlockCompressionOutputStream(_raw_out.get(),
+                &LZ4RawCompress, &LZ4MaxCompressedLength,
+                _compression_pool, _compression_blocks_in_flight));
+            break;
+        case ZLIB:
+            _compressed_out.reset(new ParallelZlibOutputStream(_raw_out.get(),
+                _compression_level, _compression_pool, _compression_blocks_in_flight));
+            break;
+        default:
+            FATAL("Control should not reach here.");
+        }
+        _coded_out.reset(new CodedOutputStream(_compressed_out.get()));
+        return true;
+    }
+
     switch (_compression_type) {
     case SNAPPY:
     {
@@ -273,6 +614,29 @@ bool OutputStream::write_footer() {
             cc->set_count(_class_id_counts[i]);
         }
     }
+    footer.set_event_count(_event_count);
+    foreach (const EventIndexPosition& p, event_index_positions) {
+        EventIndexEntry* e = footer.add_event_index();
+        e->set_event(p.event);
+        e->set_section_offset(p.section_offset);
+        e->set_inner_offset(p.inner_offset);
+        e->set_metadata_index(p.metadata_index);
+    }
+    foreach (const EventIndexPosition& p, chunk_positions) {
+        EventIndexEntry* e = footer.add_chunk();
+        e->set_event(p.event);
+        e->set_section_offset(p.section_offset);
+        e->set_metadata_index(p.metadata_index);
+    }
+    foreach (const ZoneMapColumn& z, _zone_maps) {
+        ZoneMap* zm = footer.add_zone_map();
+        zm->set_field(z.field);
+        for (size_t i = 0; i < z.min.size(); i++) {
+            zm->add_min(z.min[i]);
+            zm->add_max(z.max[i]);
+            zm->add_null_count(z.null_count[i]);
+        }
+    }
     write(_fixed_class_id<StreamFooter>(), footer);
     _coded_out->WriteLittleEndian32(footer.ByteSize());
     _coded_out->WriteString(END_MAGIC);
@@ -363,11 +727,21 @@ bool OutputStream::write(uint32_t class_id, const google::protobuf::Message &msg
     if (_coded_out->ByteCount() > 100000000) reset_coded_stream();
     _class_id_counts[class_id]++;
 
-    string message;
-    if (!msg.SerializeToString(&message))
-        return false;
+    // ByteSize() caches the sizes needed for serialization
+    uint32_t size = msg.ByteSize();
+    int header_size = (class_id == 0) ? 4 : 8;
+    uint8_t* buffer = _coded_out->GetDirectBufferForNBytesAndAdvance(header_size + size);
+    if (buffer) {
+        if (class_id == 0) {
+            buffer = CodedOutputStream::WriteLittleEndian32ToArray(size, buffer);
+        } else {
+            buffer = CodedOutputStream::WriteLittleEndian32ToArray(size | HIGH_BIT, buffer);
+            buffer = CodedOutputStream::WriteLittleEndian32ToArray(class_id, buffer);
+        }
+        msg.SerializeWithCachedSizesToArray(buffer);
+        return true;
+    }
 
-    uint32_t size = message.size();
     if (class_id == 0) {
         _coded_out->WriteLittleEndian32(size);
     } else {
@@ -375,7 +749,7 @@ bool OutputStream::write(uint32_t class_id, const google::protobuf::Message &msg
         _coded_out->WriteLittleEndian32(class_id);
     }
     msg.SerializeWithCachedSizes(_coded_out.get());
-    return true;
+    return !_coded_out->HadError();
 }
 
 bool OutputStream::write(uint32_t class_id, shared<const A4Message> msg)
@@ -390,27 +764,24 @@ bool OutputStream::write(uint32_t class_id, shared<const A4Message> msg)
         _coded_out->WriteLittleEndian32(size | HIGH_BIT );
         _coded_out->WriteLittleEndian32(class_id);
     }
-    /*
-    if (not msg->_instream_read) {
-        auto coded_in = msg->_coded_in.lock();
-        int to_copy = msg->_size;
-        const void* this_data = NULL;
-        int this_step = 0;
-        do {
-            if (not coded_in->GetDirectBufferPointer(&this_data, &this_step)) {
-                return false;
-            }
-            assert(this_step > 0);
-            this_step = this_step > to_copy ? to_copy : this_step;
-            _coded_out->WriteRaw(this_data, this_step);
-            to_copy -= this_step;
-        } while (to_copy > 0);
-        msg->_coded_in.reset(); // invalidate message
-        msg->_instream_read = true;
+    if (not msg->_instream_read and not msg->_frames.expired()) {
+        // Unread message: copy the bytes straight from the input buffer
+        auto frames = msg->_frames.lock();
+        int to_copy = size;
+        while (to_copy > 0) {
+            const void* data = NULL;
+            int step = 0;
+            if (not frames->GetDirectBufferPointer(&data, &step))
+                FATAL("Unexpected end of input while copying unread message!");
+            step = std::min(step, to_copy);
+            _coded_out->WriteRaw(data, step);
+            frames->Skip(step);
+            to_copy -= step;
+        }
+        msg->consume();
     } else {
         _coded_out->WriteString(msg->bytes());
-    }*/
-    _coded_out->WriteString(msg->bytes());
+    }
     return true;
 }
 
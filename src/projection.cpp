@@ -0,0 +1,99 @@
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/message.h>
+#include <google/protobuf/wire_format_lite.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+
+#include "projection.h"
+
+using google::protobuf::Descriptor;
+using google::protobuf::FieldDescriptor;
+using google::protobuf::internal::WireFormatLite;
+using google::protobuf::io::CodedInputStream;
+using google::protobuf::io::CodedOutputStream;
+using google::protobuf::io::StringOutputStream;
+
+namespace a4{ namespace io{
+
+    shared<Projection> Projection::resolve(const Descriptor* d,
+                                           const std::vector<std::string>& paths) {
+        shared<Projection> projection(new Projection());
+        foreach (const std::string& path, paths)
+            projection->add_path(d, path);
+        if (projection->_fields.empty())
+            return shared<Projection>();
+        return projection;
+    }
+
+    /// Add a path to the selection. Returns false if its first field is not in d.
+    bool Projection::add_path(const Descriptor* d, const std::string& path) {
+        size_t dot = path.find('.');
+        const FieldDescriptor* field = d->FindFieldByName(path.substr(0, dot));
+        if (!field)
+            return false;
+
+        auto it = _fields.find(field->number());
+        if (dot == std::string::npos) {
+            // The complete field is selected
+            _fields[field->number()].reset();
+            return true;
+        }
+        if (field->cpp_type() != FieldDescriptor::CPPTYPE_MESSAGE)
+            FATAL("Field ", field->full_name(), " in projection '", path, "' has no sub fields");
+        if (it != _fields.end() && !it->second)
+            return true; // already selected completely
+
+        shared<Projection> sub = (it != _fields.end()) ? it->second : shared<Projection>(new Projection());
+        if (!sub->add_path(field->message_type(), path.substr(dot + 1)))
+            FATAL("Unknown field in projection '", path, "'");
+        _fields[field->number()] = sub;
+        return true;
+    }
+
+    bool Projection::parse(const uint8_t* data, int size, google::protobuf::Message* msg,
+                           std::string* scratch) const {
+        scratch->clear();
+        {
+            CodedInputStream in(data, size);
+            StringOutputStream string_out(scratch);
+            CodedOutputStream out(&string_out);
+            if (!filter(&in, &out))
+                return false;
+        }
+        return msg->ParseFromString(*scratch);
+    }
+
+    /// Copy the selected fields from in to out, up to the current limit of in.
+    bool Projection::filter(CodedInputStream* in, CodedOutputStream* out) const {
+        while (uint32_t tag = in->ReadTag()) {
+            auto it = _fields.find(WireFormatLite::GetTagFieldNumber(tag));
+            if (it == _fields.end()) {
+                if (!WireFormatLite::SkipField(in, tag))
+                    return false;
+            } else if (!it->second || WireFormatLite::GetTagWireType(tag) !=
+                                      WireFormatLite::WIRETYPE_LENGTH_DELIMITED) {
+                if (!WireFormatLite::SkipField(in, tag, out))
+                    return false;
+            } else {
+                // Sub message of which only some fields are selected
+                uint32_t length;
+                if (!in->ReadVarint32(&length))
+                    return false;
+                std::string sub;
+                {
+                    CodedInputStream::Limit limit = in->PushLimit(length);
+                    StringOutputStream string_out(&sub);
+                    CodedOutputStream sub_out(&string_out);
+                    if (!it->second->filter(in, &sub_out))
+                        return false;
+                    in->PopLimit(limit);
+                }
+                out->WriteTag(tag);
+                out->WriteVarint32(sub.size());
+                out->WriteString(sub);
+            }
+        }
+        return true;
+    }
+
+};};
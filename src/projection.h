@@ -0,0 +1,45 @@
+#ifndef _A4_PROJECTION_H_
+#define _A4_PROJECTION_H_
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <a4/types.h>
+
+namespace google{ namespace protobuf{
+    class Descriptor;
+    class Message;
+    namespace io{ class CodedInputStream; class CodedOutputStream; };
+};};
+
+namespace a4{ namespace io{
+
+    /// Selection of the fields of a message class that are parsed.
+    /// The other fields are skipped in the wire format without being decoded.
+    class Projection {
+        public:
+            /// Resolve field paths of the form "field" or "field.sub_field"
+            /// against the descriptor. Paths whose first field is not in the
+            /// class are ignored; returns an empty pointer if none is left.
+            static shared<Projection> resolve(const google::protobuf::Descriptor* d,
+                                              const std::vector<std::string>& paths);
+
+            /// Parse the message in data into msg, keeping only the selected fields.
+            /// `scratch` holds the filtered wire format.
+            bool parse(const uint8_t* data, int size, google::protobuf::Message* msg,
+                       std::string* scratch) const;
+
+        private:
+            bool add_path(const google::protobuf::Descriptor* d, const std::string& path);
+            bool filter(google::protobuf::io::CodedInputStream* in,
+                        google::protobuf::io::CodedOutputStream* out) const;
+
+            /// Selected field numbers, with the projection of sub messages of
+            /// which only some fields are selected (empty if the field is kept)
+            std::map<int, shared<Projection>> _fields;
+    };
+
+};};
+
+#endif
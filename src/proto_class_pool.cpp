@@ -1,6 +1,12 @@
+#include <functional>
+#include <unordered_map>
+
 #include <boost/bind.hpp>
+#include <boost/thread.hpp>
 using boost::bind;
 
+#include "frame_reader.h"
+#include "merge_plan.h"
 #include "proto_class_pool.h"
 
 using google::protobuf::Descriptor;
@@ -11,17 +17,105 @@ using google::protobuf::FileDescriptor;
 
 namespace a4{ namespace io{
 
+    /// The descriptors of the files of one ProtoClass, built in a pool on top
+    /// of the pool of the ProtoClasses before it, and the factory for their
+    /// dynamic messages. Immutable once built, apart from the merge plans
+    /// cached for the classes of it and its parents.
+    struct ProtoClassPool::Schema {
+        shared<const Schema> parent;
+        std::string protoclass;
+        size_t hash;
+        shared<DescriptorPool> descriptor_pool;
+        shared<DynamicMessageFactory> message_factory;
+        mutable boost::mutex merge_plans_mutex;
+        mutable std::unordered_map<const Descriptor*, shared<const MergePlan>> merge_plans;
+    };
+
+    typedef boost::unique_lock<boost::mutex> Lock;
+    static boost::mutex schema_mutex;
+    static std::unordered_map<size_t, shared<const ProtoClassPool::Schema>> schema_cache;
+    // The cache is emptied when it grows beyond this, schemas in use stay alive
+    static const size_t max_cached_schemas = 4096;
+
+    /// Get the schema for protoclass following parent, from the cache
+    /// or by building its files
+    shared<const ProtoClassPool::Schema> ProtoClassPool::schema_for(
+        shared<const Schema> parent, const ProtoClass& protoclass)
+    {
+        std::string serialized = protoclass.SerializeAsString();
+        size_t hash = std::hash<std::string>()(serialized);
+        if (parent)
+            hash ^= parent->hash + 0x9e3779b97f4a7c15ULL + (hash << 6) + (hash >> 2);
+        {
+            Lock lock(schema_mutex);
+            auto it = schema_cache.find(hash);
+            if (it != schema_cache.end() && it->second->parent == parent
+                && it->second->protoclass == serialized)
+                return it->second;
+        }
+
+        shared<Schema> schema(new Schema());
+        schema->parent = parent;
+        schema->hash = hash;
+        // The pool must be kept alive as long as messages of these classes
+        // are around (one might need to dynamically merge metadata, for example)
+        if (parent)
+            schema->descriptor_pool.reset(new DescriptorPool(parent->descriptor_pool.get()));
+        else
+            schema->descriptor_pool.reset(new DescriptorPool());
+        foreach(const FileDescriptorProto& fdp, protoclass.file_descriptor())
+            schema->descriptor_pool->BuildFile(fdp);
+        schema->message_factory.reset(new DynamicMessageFactory(schema->descriptor_pool.get()));
+        schema->protoclass.swap(serialized);
+
+        Lock lock(schema_mutex);
+        if (schema_cache.size() >= max_cached_schemas)
+            schema_cache.clear();
+        auto inserted = schema_cache.insert(std::make_pair(hash, schema));
+        if (!inserted.second && inserted.first->second->parent == parent
+            && inserted.first->second->protoclass == schema->protoclass)
+            return inserted.first->second; // built by another thread meanwhile
+        return schema;
+    }
+
+    size_t ProtoClassPool::cached_schemas() {
+        Lock lock(schema_mutex);
+        return schema_cache.size();
+    }
+
     ProtoClassPool::ProtoClassPool() {
-        // This descriptor pool must be kept alive as long as messages
-        // generated in this stream block are around (one might need to
-        // dynamically merge metadata, for example)
-        _descriptor_pool.reset(new DescriptorPool());
-        _message_factory.reset(new DynamicMessageFactory(_descriptor_pool.get()));
     }
 
     ProtoClassPool::~ProtoClassPool() {
-        _message_factory.reset();
-        _descriptor_pool.reset();
+        _schema.reset();
+    }
+
+    const Message* ProtoClassPool::prototype(const Descriptor* d) const {
+        if (d->file()->pool() == DescriptorPool::generated_pool())
+            return google::protobuf::MessageFactory::generated_factory()->GetPrototype(d);
+        // The factory of the schema that built the class, shared by all pools
+        for (const Schema* schema = _schema.get(); schema; schema = schema->parent.get())
+            if (d->file()->pool() == schema->descriptor_pool.get())
+                return schema->message_factory->GetPrototype(d);
+        FATAL("Class ", d->full_name(), " is not known to this pool");
+    }
+
+    shared<const MergePlan> ProtoClassPool::merge_plan(const Descriptor* d) const {
+        if (!_schema || d->file()->pool() == google::protobuf::DescriptorPool::generated_pool())
+            return MergePlan::get(d);
+        // The schema keeps the descriptors alive as long as the plans
+        Lock lock(_schema->merge_plans_mutex);
+        shared<const MergePlan>& plan = _schema->merge_plans[d];
+        if (!plan)
+            plan = MergePlan::get(d);
+        return plan;
+    }
+
+    std::vector<const FileDescriptor*> ProtoClassPool::get_filedescriptors() {
+        std::vector<const FileDescriptor*> result;
+        foreach (auto& fd_name, _encountered_file_descriptors)
+            result.push_back(_schema->descriptor_pool->FindFileByName(fd_name));
+        return result;
     }
     
     void ProtoClassPool::verify_class_id(uint32_t class_id) {
@@ -50,23 +144,24 @@ namespace a4{ namespace io{
     }
     
     shared<google::protobuf::Message> ProtoClassPool::get_new_message(const Descriptor* d) const {
-        return shared<google::protobuf::Message>(_message_factory->GetPrototype(d)->New());
+        return shared<google::protobuf::Message>(prototype(d)->New());
     }
 
     shared<google::protobuf::Message> ProtoClassPool::parse_message(uint32_t class_id, 
-                                   shared<google::protobuf::io::CodedInputStream> coded_in,
-                                   size_t size)
+                                   shared<FrameReader> frames,
+                                   size_t size, shared<google::protobuf::Message> recycled,
+                                   const Projection* projection)
     {
-        assert(coded_in);
-        //std::cerr << "Parse from stream " << coded_in.get() << "\tSZ " << size << "\tID " << class_id << std::endl;
-        auto msg = get_new_message(class_id);
-        auto lim = coded_in->PushLimit(size);
-        if (not msg->ParseFromCodedStream(coded_in.get())) {
+        assert(frames);
+        //std::cerr << "Parse from stream " << frames.get() << "\tSZ " << size << "\tID " << class_id << std::endl;
+        // Parsing clears the message, but keeps its allocations
+        auto msg = recycled ? recycled : get_new_message(class_id);
+        bool ok = projection ? frames->ParseMessage(msg.get(), size, *projection)
+                             : frames->ParseMessage(msg.get(), size);
+        if (not ok) {
             FATAL("Could not parse from stream!");
-            coded_in->PushLimit(0); // Prevent the stream from reading further
             return shared<google::protobuf::Message>();
         }
-        coded_in->PopLimit(lim);
         return msg;
     }
 
@@ -147,12 +242,12 @@ namespace a4{ namespace io{
             // Check if we already have this FD (unneccessary, should never be the case)
             assert(_encountered_file_descriptors.count(fdp.name()) == 0);
             _encountered_file_descriptors.insert(fdp.name());
-            _descriptor_pool->BuildFile(fdp);
         }
+        _schema = schema_for(_schema, protoclass);
 
         // First, find the generated descriptor
         //std::cout << "Looking for " << protoclass.full_name() << std::endl;
-        const Descriptor* gd = _descriptor_pool->FindMessageTypeByName(protoclass.full_name());
+        const Descriptor* gd = _schema->descriptor_pool->FindMessageTypeByName(protoclass.full_name());
         if (!gd) {
             FATAL("Couldn't find protoclass in pool: ", protoclass.full_name());
         }
@@ -176,8 +271,7 @@ namespace a4{ namespace io{
             _dynamic_descriptor[class_id] = gd;
         } else { // Use dynamic reading
             // WARNING("No compiled version of ", protoclass.full_name(), " found!");
-            const Message* prototype = _message_factory->GetPrototype(gd);
-            _class_id_reader[class_id] = bind(&ProtoClassPool::new_protoclass, this, prototype);
+            _class_id_reader[class_id] = bind(&ProtoClassPool::new_protoclass, this, prototype(gd));
             _class_id_descriptor[class_id] = gd;
             _dynamic_descriptor[class_id] = gd;
         }
@@ -16,8 +16,15 @@
 
 namespace a4{ namespace io{
 
+    class FrameReader;
+    class MergePlan;
+    class Projection;
+
     /// Keeps track of ProtoClass classes and Metadata classes and offsets in a single
     /// block between Header and Footer.
+    /// The descriptors built from the ProtoClasses are shared by all pools in the
+    /// process that read the same ProtoClasses in the same order, so that files
+    /// with the same schema build them only once.
     class ProtoClassPool {
         public:
             ProtoClassPool();
@@ -26,21 +33,27 @@ namespace a4{ namespace io{
             void add_protoclass(const ProtoClass& protoclass);
             void verify_class_id(uint32_t class_id);
             shared<google::protobuf::Message> get_new_message(uint32_t class_id);
+            /// New message of a class of this pool or a compiled-in class, from
+            /// the prototypes shared by all pools with the same schema
             shared<google::protobuf::Message> get_new_message(const google::protobuf::Descriptor* d) const;
+            /// Parse a message of the given class from the stream. If given, the
+            /// message `recycled` (which has to be of that class) is parsed into,
+            /// and only the fields selected by `projection` are parsed.
             shared<google::protobuf::Message> parse_message(uint32_t class_id, 
-                                   shared<google::protobuf::io::CodedInputStream> coded_in,
-                                           size_t size);
+                                   shared<FrameReader> frames,
+                                           size_t size,
+                                           shared<google::protobuf::Message> recycled=shared<google::protobuf::Message>(),
+                                           const Projection* projection=NULL);
             shared<google::protobuf::Message> parse_message(uint32_t class_id, 
                                             const std::string& bytes);
             const google::protobuf::Descriptor* descriptor(uint32_t class_id);
             const google::protobuf::Descriptor* dynamic_descriptor(uint32_t class_id);
             
-            std::vector<const google::protobuf::FileDescriptor*> get_filedescriptors() {
-                std::vector<const google::protobuf::FileDescriptor*> result;
-                foreach (auto& fd_name, _encountered_file_descriptors)
-                    result.push_back(_descriptor_pool->FindFileByName(fd_name));
-                return result;
-            }
+            std::vector<const google::protobuf::FileDescriptor*> get_filedescriptors();
+
+            /// Merge plan for a class of this pool or a compiled-in class, cached
+            /// as long as the descriptors of the pool are alive (see MergePlan)
+            shared<const MergePlan> merge_plan(const google::protobuf::Descriptor* d) const;
 
             bool check_match(uint32_t class_id, const google::protobuf::Descriptor* d) {
                 if (class_id < _class_id_descriptor.size() && _class_id_descriptor[class_id] == d) return true;
@@ -48,15 +61,24 @@ namespace a4{ namespace io{
             }
     
         
+            /// Number of shared schemas in the process-wide cache
+            static size_t cached_schemas();
+
+            /// \internal Descriptors of one ProtoClass, shared between pools
+            struct Schema;
+        
         private:
+            static shared<const Schema> schema_for(shared<const Schema> parent, const ProtoClass& protoclass);
+
             shared<Message> new_protoclass(const google::protobuf::Message* prototype);
+            const google::protobuf::Message* prototype(const google::protobuf::Descriptor* d) const;
             std::set<std::string> _encountered_file_descriptors;
             std::vector<internal::new_protoclass_func> _class_id_reader;
             std::vector<const google::protobuf::Message*> _class_id_prototype;
             std::vector<const google::protobuf::Descriptor*> _class_id_descriptor;
             std::vector<const google::protobuf::Descriptor*> _dynamic_descriptor;
-            shared<google::protobuf::DescriptorPool> _descriptor_pool;
-            shared<google::protobuf::DynamicMessageFactory> _message_factory;
+            // schema after the last added ProtoClass, keeps the ones before alive
+            shared<const Schema> _schema;
     };
 
 };};
@@ -0,0 +1,149 @@
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <boost/bind.hpp>
+
+#include "section_sink.h"
+
+typedef boost::unique_lock<boost::mutex> Lock;
+
+namespace a4{ namespace io{
+
+    static int open_output(const std::string& name) {
+        int fd = ::open(name.c_str(), O_WRONLY | O_TRUNC | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+        if (fd < 0)
+            ERROR("Could not open '", name, "' - error: ", strerror(errno));
+        return fd;
+    }
+
+    SharedOutputFile::SharedOutputFile(const std::string& name) :
+        _name(name), _end(0), _error(false)
+    {
+        _fd = open_output(name);
+        if (_fd < 0)
+            _error = true;
+    }
+
+    SharedOutputFile::~SharedOutputFile() {
+        close();
+    }
+
+    bool SharedOutputFile::append(std::string& section) {
+        if (_fd == -1)
+            return false;
+        uint64_t offset = _end.fetch_add(section.size());
+        const char* data = section.data();
+        size_t left = section.size();
+        while (left > 0) {
+            ssize_t written = pwrite(_fd, data, left, offset);
+            if (written < 0 && errno == EINTR)
+                continue;
+            if (written <= 0) {
+                // The reserved region stays a hole, the file is corrupt
+                ERROR("Could not write to '", _name, "' - error: ", strerror(errno));
+                _error = true;
+                return false;
+            }
+            data += written;
+            left -= written;
+            offset += written;
+        }
+        return true;
+    }
+
+    bool SharedOutputFile::close() {
+        if (_fd == -1)
+            return !_error;
+        if (::close(_fd) != 0) {
+            ERROR("Error on closing '", _name, "' - error: ", strerror(errno));
+            _error = true;
+        }
+        _fd = -1;
+        return !_error;
+    }
+
+    SectionQueue::SectionQueue(const std::string& name, size_t max_sections) :
+        _name(name), _max_sections(max_sections ? max_sections : 1),
+        _closing(false), _error(false)
+    {
+        _fd = open_output(name);
+        if (_fd < 0)
+            _error = true;
+        else
+            _writer = boost::thread(boost::bind(&SectionQueue::run, this));
+    }
+
+    SectionQueue::~SectionQueue() {
+        close();
+    }
+
+    bool SectionQueue::append(std::string& section) {
+        Lock lock(_mutex);
+        while (_sections.size() >= _max_sections && !_error && !_closing)
+            _not_full.wait(lock);
+        if (_error || _closing)
+            return false;
+        _sections.push_back(std::string());
+        _sections.back().swap(section);
+        _not_empty.notify_one();
+        return true;
+    }
+
+    void SectionQueue::run() {
+        std::string section;
+        while (true) {
+            {
+                Lock lock(_mutex);
+                while (_sections.empty() && !_closing)
+                    _not_empty.wait(lock);
+                if (_sections.empty())
+                    return;
+                section.swap(_sections.front());
+                _sections.pop_front();
+                _not_full.notify_all();
+            }
+            const char* data = section.data();
+            size_t left = section.size();
+            while (left > 0) {
+                ssize_t written = ::write(_fd, data, left);
+                if (written < 0 && errno == EINTR)
+                    continue;
+                if (written <= 0) {
+                    ERROR("Could not write to '", _name, "' - error: ", strerror(errno));
+                    Lock lock(_mutex);
+                    _error = true;
+                    _sections.clear();
+                    _not_full.notify_all();
+                    return;
+                }
+                data += written;
+                left -= written;
+            }
+            section.clear();
+        }
+    }
+
+    bool SectionQueue::close() {
+        {
+            Lock lock(_mutex);
+            if (_closing)
+                return !_error;
+            _closing = true;
+            _not_empty.notify_one();
+            _not_full.notify_all();
+        }
+        if (_writer.joinable())
+            _writer.join();
+        if (_fd != -1 && ::close(_fd) != 0) {
+            ERROR("Error on closing '", _name, "' - error: ", strerror(errno));
+            _error = true;
+        }
+        _fd = -1;
+        return !_error;
+    }
+
+};};
@@ -0,0 +1,79 @@
+#ifndef _A4_SECTION_SINK_H_
+#define _A4_SECTION_SINK_H_
+
+#include <atomic>
+#include <deque>
+#include <string>
+
+#include <boost/thread.hpp>
+
+#include <a4/types.h>
+
+namespace a4{ namespace io{
+
+    /// Destination that several OutputStreams append whole, self-contained
+    /// sections (header to footer) to at the same time, see
+    /// OutputStream::set_section_sink().
+    class SectionSink {
+        public:
+            virtual ~SectionSink() {};
+            /// Append a section (threadsafe). The contents of section may be
+            /// taken over, it is cleared by the caller afterwards.
+            virtual bool append(std::string& section) = 0;
+            /// Close the destination, false if any append or the close failed
+            virtual bool close() = 0;
+    };
+
+    /// Regular file that sections are appended to in parallel. Each append
+    /// reserves a region at the end of the file and writes it with pwrite(),
+    /// so the sections of different threads never have to be copied together.
+    class SharedOutputFile : public SectionSink {
+        public:
+            /// Create or truncate the file
+            SharedOutputFile(const std::string& name);
+            ~SharedOutputFile();
+
+            bool append(std::string& section);
+            bool close();
+
+            bool good() const { return !_error; }
+            const std::string& name() const { return _name; }
+            uint64_t size() const { return _end; }
+
+        private:
+            std::string _name;
+            int _fd;
+            std::atomic<uint64_t> _end;
+            std::atomic<bool> _error;
+    };
+
+    /// Bounded queue of sections that one writer thread writes to a file
+    /// in order. Appending blocks while the queue is full. Works with
+    /// FIFOs and other files that can only be written sequentially.
+    class SectionQueue : public SectionSink {
+        public:
+            /// Open the file and start the writer
+            SectionQueue(const std::string& name, size_t max_sections);
+            /// Closes the queue if needed
+            ~SectionQueue();
+
+            bool append(std::string& section);
+            /// Write all queued sections, then stop the writer and close the file
+            bool close();
+
+        private:
+            void run();
+
+            std::string _name;
+            int _fd;
+            size_t _max_sections;
+            std::deque<std::string> _sections;
+            bool _closing, _error;
+            boost::mutex _mutex;
+            boost::condition_variable _not_empty, _not_full;
+            boost::thread _writer;
+    };
+
+};};
+
+#endif
@@ -0,0 +1,52 @@
+#include <iostream>
+#include <vector>
+#include <stdlib.h>
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include <a4/io/A4Stream.pb.h>
+#include <a4/output_stream.h>
+
+using namespace std;
+using namespace a4::io;
+using boost::posix_time::microsec_clock;
+
+// Write benchmark: events/sec for single and batched writes
+int main(int argc, char ** argv) {
+    if (argc < 2 || argc > 4) {
+        cout << "Usage: " << argv[0] << " <filename> [events] [compression]" << endl;
+        cout << " where [compression] is e.g. UNCOMPRESSED (default), LZ4 or ZLIB" << endl;
+        return -1;
+    }
+    const uint64_t N = argc > 2 ? atol(argv[2]) : 10*1000*1000;
+    const string compression = argc > 3 ? argv[3] : "UNCOMPRESSED";
+    const int batch = 1000;
+
+    {
+        OutputStream w(argv[1], "TestEvent");
+        w.set_compression(compression);
+        TestEvent e;
+        auto start = microsec_clock::universal_time();
+        for(uint64_t i = 0; i < N; i++) {
+            e.set_event_number(i);
+            w.write(e);
+        }
+        w.close();
+        double s = (microsec_clock::universal_time() - start).total_microseconds() / 1e6;
+        cout << "write(msg):        " << N/s << " events/sec" << endl;
+    }
+    {
+        OutputStream w(argv[1], "TestEvent");
+        w.set_compression(compression);
+        vector<TestEvent> events(batch);
+        auto start = microsec_clock::universal_time();
+        for(uint64_t i = 0; i < N; i += batch) {
+            for (int j = 0; j < batch; j++)
+                events[j].set_event_number(i + j);
+            w.write(events.begin(), events.end());
+        }
+        w.close();
+        double s = (microsec_clock::universal_time() - start).total_microseconds() / 1e6;
+        cout << "write(begin, end): " << N/s << " events/sec" << endl;
+    }
+}
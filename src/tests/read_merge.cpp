@@ -0,0 +1,58 @@
+#include <iostream>
+#include <string>
+
+#include <a4/message.h>
+#include <a4/input_stream.h>
+#include <a4/io/A4Stream.pb.h>
+
+using namespace std;
+using namespace a4::io;
+
+// Check that the events of the merged file are byte by byte those of the
+// inputs, in order, and print the count and the merged metadata.
+int main(int argc, char ** argv) {
+    if (argc < 3) {
+        cerr << "Usage: " << argv[0] << " merged input(s)" << endl;
+        return 1;
+    }
+    InputStream merged(argv[1]);
+    merged.set_hint_copy(true);
+
+    int cnt = 0;
+    for (int i = 2; i < argc; i++) {
+        InputStream in(argv[i]);
+        in.set_hint_copy(true);
+        while (shared<A4Message> expected = in.next()) {
+            shared<A4Message> msg = merged.next();
+            if (!msg || msg->class_id() != expected->class_id() || msg->bytes() != expected->bytes()) {
+                cerr << "Event " << cnt << " differs from " << argv[i] << endl;
+                return 1;
+            }
+            cnt++;
+        }
+        if (in.error())
+            return 1;
+    }
+    if (merged.next() || merged.error()) {
+        cerr << "The merged file has more events" << endl;
+        return 1;
+    }
+    cout << "events " << cnt << endl;
+
+    InputStream md(argv[1]);
+    foreach (const auto& header, md.all_metadata()) {
+        foreach (const auto& metadata, header) {
+            // not a registered class, so it is read with the descriptor from the file
+            TestMergeMetaData m;
+            if (!m.ParseFromString(metadata->bytes()))
+                return 1;
+            cout << "meta_data " << m.meta_data() << endl;
+            cout << "comments";
+            for (int i = 0; i < m.comments_size(); i++)
+                cout << " " << m.comments(i);
+            cout << endl;
+            cout << "runs " << m.run_size() << endl;
+        }
+    }
+    return md.error() ? 1 : 0;
+}
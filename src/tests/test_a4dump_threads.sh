@@ -0,0 +1,25 @@
+#!/bin/bash
+# Check that a4dump --threads reads every message of the inputs exactly once
+set -e
+set -u
+
+A4DUMP=${A4DUMP:-a4dump}
+
+mkdir -p testdumpthreads
+pushd testdumpthreads
+
+FILES=""
+for i in $(seq 16); do
+    ../write_bw test_dump_threads_$i.a4
+    FILES="$FILES test_dump_threads_$i.a4"
+done
+
+$A4DUMP -S -a -j 4 $FILES > stats.txt 2> threads.txt
+
+# 16 files of 1000 events each
+TOTAL=$(sed -n 's/.*Thread [0-9]* read \([0-9]*\) messages.*/\1/p' threads.txt | awk '{ n += $1 } END { print n }')
+test "$TOTAL" -eq 16000
+
+rm -f $FILES stats.txt threads.txt
+
+popd
@@ -0,0 +1,46 @@
+#!/bin/bash
+# Check that a4merge copies the events unchanged and merges the metadata,
+# and that it fails instead of hanging on an unreadable input
+set -e
+set -u
+
+A4MERGE=${A4MERGE:-a4merge}
+
+mkdir -p testmerge
+pushd testmerge
+
+FILES=""
+for k in 1 2 3 4 5 6; do
+    if [ $((k % 2)) -eq 0 ]; then DIR=fw; else DIR=bw; fi
+    ../write_merge test_merge_$k.a4 $k $DIR
+    FILES="$FILES test_merge_$k.a4"
+done
+
+for j in 1 4 8; do
+    rm -f merged.a4
+    timeout 120 $A4MERGE -j $j -o merged.a4 $FILES
+    ../read_merge merged.a4 $FILES > merged.txt
+    grep -qx "events 6000" merged.txt
+    # one merged metadata message: MERGE_ADD, MERGE_APPEND in input order, MERGE_UNION
+    test "$(grep -c "^meta_data" merged.txt)" -eq 1
+    grep -qx "meta_data 12" merged.txt
+    grep -qx "comments 1.0 1.1 2.0 2.1 3.0 3.1 4.0 4.1 5.0 5.1 6.0 6.1" merged.txt
+    grep -qx "runs 6" merged.txt
+done
+
+# a missing and a corrupt input make a4merge fail, not hang
+echo "not an a4 file" > test_merge_corrupt.a4
+for BAD in "test_merge_missing.a4" "test_merge_corrupt.a4"; do
+    for j in 1 4; do
+        set +e
+        timeout 120 $A4MERGE -j $j -o failed.a4 test_merge_1.a4 test_merge_2.a4 $BAD $FILES 2> /dev/null
+        RESULT=$?
+        set -e
+        test $RESULT -ne 0
+        test $RESULT -ne 124
+    done
+done
+
+rm -f $FILES merged.a4 merged.txt failed.a4 test_merge_corrupt.a4
+
+popd
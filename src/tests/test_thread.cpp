@@ -96,4 +96,27 @@ int main(int argc, char ** argv) {
         t8.join();
         t9.join();
     }
+    {
+        A4Input in;
+        in.set_work_stealing(4);
+        in.add_file("test_thread.a4", false);
+        in.add_file("test_thread.a4", false);
+        in.add_file("test_thread.a4", false);
+        in.add_file("test_thread.a4", false);
+        in.add_file("test_thread.a4", false);
+        boost::thread t1(no_read, boost::ref(in));
+        boost::thread t2(my_read, boost::ref(in));
+        boost::thread t3(my_read, boost::ref(in));
+        boost::thread t4(my_read, boost::ref(in));
+        boost::thread t5(my_read, boost::ref(in));
+        boost::thread t6(my_read, boost::ref(in));
+        boost::thread t7(my_read, boost::ref(in));
+        t1.join();
+        t2.join();
+        t3.join();
+        t4.join();
+        t5.join();
+        t6.join();
+        t7.join();
+    }
 }
@@ -0,0 +1,45 @@
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#include <a4/output_stream.h>
+#include <a4/io/A4Stream.pb.h>
+
+using namespace std;
+using namespace a4::io;
+
+// Write 1000 TestEvents numbered from 1000*k in two blocks with
+// TestMergeMetaData, for the a4merge tests.
+int main(int argc, char ** argv) {
+    if (argc != 4) {
+        cerr << "Usage: " << argv[0] << " file k fw|bw" << endl;
+        return 1;
+    }
+    std::string fn = argv[1];
+    int k = atoi(argv[2]);
+    bool forward = std::string(argv[3]) == "fw";
+
+    OutputStream w(fn, "TestEvent");
+    if (forward)
+        w.set_forward_metadata();
+
+    const int N = 500;
+    TestEvent e;
+    for (int b = 0; b < 2; b++) {
+        TestMergeMetaData m;
+        m.set_meta_data(1);
+        m.add_run(k);
+        std::stringstream comment;
+        comment << k << "." << b;
+        m.add_comments(comment.str());
+        if (forward)
+            w.metadata(m);
+        for(int i = 0; i < N; i++) {
+            e.set_event_number(1000*k + N*b + i);
+            e.set_event_data(i * 0.5);
+            w.write(e);
+        }
+        if (!forward)
+            w.metadata(m);
+    }
+}
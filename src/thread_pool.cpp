@@ -0,0 +1,49 @@
+#include <boost/bind.hpp>
+#include <boost/thread/locks.hpp>
+
+#include "thread_pool.h"
+
+namespace a4{ namespace io{
+
+    typedef boost::unique_lock<boost::mutex> Lock;
+
+    ThreadPool::ThreadPool(int threads) : _size(threads), _stop(false) {
+        assert(threads > 0);
+        for (int i = 0; i < threads; i++)
+            _threads.create_thread(boost::bind(&ThreadPool::run, this));
+    }
+
+    ThreadPool::~ThreadPool() {
+        {
+            Lock lock(_mutex);
+            _stop = true;
+        }
+        _task_available.notify_all();
+        _threads.join_all();
+    }
+
+    void ThreadPool::submit(Task task) {
+        {
+            Lock lock(_mutex);
+            _tasks.push_back(task);
+        }
+        _task_available.notify_one();
+    }
+
+    void ThreadPool::run() {
+        while (true) {
+            Task task;
+            {
+                Lock lock(_mutex);
+                while (_tasks.empty() && !_stop)
+                    _task_available.wait(lock);
+                if (_tasks.empty())
+                    return; // stopping and nothing left to do
+                task = _tasks.front();
+                _tasks.pop_front();
+            }
+            task();
+        }
+    }
+
+};};
@@ -0,0 +1,42 @@
+#ifndef _A4_THREAD_POOL_H_
+#define _A4_THREAD_POOL_H_
+
+#include <deque>
+
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
+
+#include <a4/types.h>
+
+namespace a4{ namespace io{
+
+    /// Fixed number of worker threads executing queued tasks in FIFO order.
+    /// Used by the streams to move (de)compression off the reading or
+    /// writing thread. Tasks must not throw.
+    class ThreadPool {
+        public:
+            typedef boost::function<void ()> Task;
+
+            ThreadPool(int threads);
+            /// Finishes all queued tasks, then joins the workers.
+            ~ThreadPool();
+
+            /// Queue a task for execution on one of the workers.
+            void submit(Task task);
+
+            int size() const { return _size; }
+
+        private:
+            void run();
+
+            int _size;
+            bool _stop;
+            std::deque<Task> _tasks;
+            boost::mutex _mutex;
+            boost::condition_variable _task_available;
+            boost::thread_group _threads;
+    };
+
+};};
+
+#endif
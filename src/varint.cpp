@@ -0,0 +1,280 @@
+#include "varint.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define A4_VARINT_X86 1
+#include <immintrin.h>
+#endif
+
+namespace a4{ namespace io{
+
+    // Scalar kernels
+
+    static size_t count_scalar(const uint8_t* begin, const uint8_t* end) {
+        size_t n = 0;
+        for (const uint8_t* p = begin; p < end; p++)
+            n += *p < 0x80;
+        return n;
+    }
+
+    template<typename T>
+    static inline int64_t decode_tail(const uint8_t* p, const uint8_t* end, T* out, int64_t n) {
+        while (p < end) {
+            uint64_t v;
+            p = read_varint(p, end, &v);
+            if (!p)
+                return -1;
+            out[n++] = T(v);
+        }
+        return n;
+    }
+
+    static int64_t decode32_scalar(const uint8_t* begin, const uint8_t* end, uint32_t* out) {
+        return decode_tail(begin, end, out, 0);
+    }
+
+    static int64_t decode64_scalar(const uint8_t* begin, const uint8_t* end, uint64_t* out) {
+        return decode_tail(begin, end, out, 0);
+    }
+
+    static void zigzag32_scalar(uint32_t* values, size_t n) {
+        for (size_t i = 0; i < n; i++)
+            values[i] = (values[i] >> 1) ^ -(values[i] & 1);
+    }
+
+    static void zigzag64_scalar(uint64_t* values, size_t n) {
+        for (size_t i = 0; i < n; i++)
+            values[i] = (values[i] >> 1) ^ -(values[i] & 1);
+    }
+
+    static const VarintKernels scalar_kernels = {
+        "scalar", count_scalar, decode32_scalar, decode64_scalar,
+        zigzag32_scalar, zigzag64_scalar
+    };
+
+#ifdef A4_VARINT_X86
+
+    // SSE4.1 kernels: sixteen bytes without continuation bits are sixteen
+    // values, which are zero extended with pmovzx. Other varints are decoded
+    // one by one until the next such run.
+
+    __attribute__((target("sse4.1")))
+    static size_t count_sse4(const uint8_t* begin, const uint8_t* end) {
+        const uint8_t* p = begin;
+        size_t continued = 0;
+        for (; end - p >= 16; p += 16) {
+            __m128i in = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+            continued += __builtin_popcount(_mm_movemask_epi8(in));
+        }
+        return (p - begin) - continued + count_scalar(p, end);
+    }
+
+    __attribute__((target("sse4.1")))
+    static int64_t decode32_sse4(const uint8_t* begin, const uint8_t* end, uint32_t* out) {
+        const uint8_t* p = begin;
+        int64_t n = 0;
+        while (end - p >= 16) {
+            __m128i in = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+            unsigned mask = _mm_movemask_epi8(in);
+            if (mask == 0) {
+                __m128i* o = reinterpret_cast<__m128i*>(out + n);
+                _mm_storeu_si128(o, _mm_cvtepu8_epi32(in));
+                _mm_storeu_si128(o + 1, _mm_cvtepu8_epi32(_mm_srli_si128(in, 4)));
+                _mm_storeu_si128(o + 2, _mm_cvtepu8_epi32(_mm_srli_si128(in, 8)));
+                _mm_storeu_si128(o + 3, _mm_cvtepu8_epi32(_mm_srli_si128(in, 12)));
+                p += 16;
+                n += 16;
+                continue;
+            }
+            for (int i = __builtin_ctz(mask); i > 0; i--)
+                out[n++] = *p++;
+            uint64_t v;
+            p = read_varint(p, end, &v);
+            if (!p)
+                return -1;
+            out[n++] = uint32_t(v);
+        }
+        return decode_tail(p, end, out, n);
+    }
+
+    __attribute__((target("sse4.1")))
+    static int64_t decode64_sse4(const uint8_t* begin, const uint8_t* end, uint64_t* out) {
+        const uint8_t* p = begin;
+        int64_t n = 0;
+        while (end - p >= 16) {
+            __m128i in = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+            unsigned mask = _mm_movemask_epi8(in);
+            if (mask == 0) {
+                __m128i* o = reinterpret_cast<__m128i*>(out + n);
+                for (int i = 0; i < 8; i++) {
+                    _mm_storeu_si128(o + i, _mm_cvtepu8_epi64(in));
+                    in = _mm_srli_si128(in, 2);
+                }
+                p += 16;
+                n += 16;
+                continue;
+            }
+            for (int i = __builtin_ctz(mask); i > 0; i--)
+                out[n++] = *p++;
+            uint64_t v;
+            p = read_varint(p, end, &v);
+            if (!p)
+                return -1;
+            out[n++] = v;
+        }
+        return decode_tail(p, end, out, n);
+    }
+
+    __attribute__((target("sse4.1")))
+    static void zigzag32_sse4(uint32_t* values, size_t n) {
+        const __m128i one = _mm_set1_epi32(1);
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4) {
+            __m128i* p = reinterpret_cast<__m128i*>(values + i);
+            __m128i v = _mm_loadu_si128(p);
+            __m128i sign = _mm_sub_epi32(_mm_setzero_si128(), _mm_and_si128(v, one));
+            _mm_storeu_si128(p, _mm_xor_si128(_mm_srli_epi32(v, 1), sign));
+        }
+        zigzag32_scalar(values + i, n - i);
+    }
+
+    __attribute__((target("sse4.1")))
+    static void zigzag64_sse4(uint64_t* values, size_t n) {
+        const __m128i one = _mm_set1_epi64x(1);
+        size_t i = 0;
+        for (; i + 2 <= n; i += 2) {
+            __m128i* p = reinterpret_cast<__m128i*>(values + i);
+            __m128i v = _mm_loadu_si128(p);
+            __m128i sign = _mm_sub_epi64(_mm_setzero_si128(), _mm_and_si128(v, one));
+            _mm_storeu_si128(p, _mm_xor_si128(_mm_srli_epi64(v, 1), sign));
+        }
+        zigzag64_scalar(values + i, n - i);
+    }
+
+    static const VarintKernels sse4_kernels = {
+        "sse4.1", count_sse4, decode32_sse4, decode64_sse4,
+        zigzag32_sse4, zigzag64_sse4
+    };
+
+    // AVX2 kernels: the same with thirty-two bytes at a time
+
+    __attribute__((target("avx2")))
+    static size_t count_avx2(const uint8_t* begin, const uint8_t* end) {
+        const uint8_t* p = begin;
+        size_t continued = 0;
+        for (; end - p >= 32; p += 32) {
+            __m256i in = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+            continued += __builtin_popcount(unsigned(_mm256_movemask_epi8(in)));
+        }
+        return (p - begin) - continued + count_scalar(p, end);
+    }
+
+    __attribute__((target("avx2")))
+    static int64_t decode32_avx2(const uint8_t* begin, const uint8_t* end, uint32_t* out) {
+        const uint8_t* p = begin;
+        int64_t n = 0;
+        while (end - p >= 32) {
+            __m256i in = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+            unsigned mask = _mm256_movemask_epi8(in);
+            if (mask == 0) {
+                __m256i* o = reinterpret_cast<__m256i*>(out + n);
+                for (int i = 0; i < 4; i++) {
+                    __m128i bytes = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(p + 8*i));
+                    _mm256_storeu_si256(o + i, _mm256_cvtepu8_epi32(bytes));
+                }
+                p += 32;
+                n += 32;
+                continue;
+            }
+            for (int i = __builtin_ctz(mask); i > 0; i--)
+                out[n++] = *p++;
+            uint64_t v;
+            p = read_varint(p, end, &v);
+            if (!p)
+                return -1;
+            out[n++] = uint32_t(v);
+        }
+        return decode_tail(p, end, out, n);
+    }
+
+    __attribute__((target("avx2")))
+    static int64_t decode64_avx2(const uint8_t* begin, const uint8_t* end, uint64_t* out) {
+        const uint8_t* p = begin;
+        int64_t n = 0;
+        while (end - p >= 32) {
+            __m256i in = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+            unsigned mask = _mm256_movemask_epi8(in);
+            if (mask == 0) {
+                __m256i* o = reinterpret_cast<__m256i*>(out + n);
+                for (int i = 0; i < 8; i++) {
+                    int32_t four;
+                    memcpy(&four, p + 4*i, 4);
+                    __m128i bytes = _mm_cvtsi32_si128(four);
+                    _mm256_storeu_si256(o + i, _mm256_cvtepu8_epi64(bytes));
+                }
+                p += 32;
+                n += 32;
+                continue;
+            }
+            for (int i = __builtin_ctz(mask); i > 0; i--)
+                out[n++] = *p++;
+            uint64_t v;
+            p = read_varint(p, end, &v);
+            if (!p)
+                return -1;
+            out[n++] = v;
+        }
+        return decode_tail(p, end, out, n);
+    }
+
+    __attribute__((target("avx2")))
+    static void zigzag32_avx2(uint32_t* values, size_t n) {
+        const __m256i one = _mm256_set1_epi32(1);
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            __m256i* p = reinterpret_cast<__m256i*>(values + i);
+            __m256i v = _mm256_loadu_si256(p);
+            __m256i sign = _mm256_sub_epi32(_mm256_setzero_si256(), _mm256_and_si256(v, one));
+            _mm256_storeu_si256(p, _mm256_xor_si256(_mm256_srli_epi32(v, 1), sign));
+        }
+        zigzag32_scalar(values + i, n - i);
+    }
+
+    __attribute__((target("avx2")))
+    static void zigzag64_avx2(uint64_t* values, size_t n) {
+        const __m256i one = _mm256_set1_epi64x(1);
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4) {
+            __m256i* p = reinterpret_cast<__m256i*>(values + i);
+            __m256i v = _mm256_loadu_si256(p);
+            __m256i sign = _mm256_sub_epi64(_mm256_setzero_si256(), _mm256_and_si256(v, one));
+            _mm256_storeu_si256(p, _mm256_xor_si256(_mm256_srli_epi64(v, 1), sign));
+        }
+        zigzag64_scalar(values + i, n - i);
+    }
+
+    static const VarintKernels avx2_kernels = {
+        "avx2", count_avx2, decode32_avx2, decode64_avx2,
+        zigzag32_avx2, zigzag64_avx2
+    };
+
+#endif
+
+    std::vector<const VarintKernels*> supported_varint_kernels() {
+        std::vector<const VarintKernels*> kernels;
+        kernels.push_back(&scalar_kernels);
+#ifdef A4_VARINT_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("sse4.1"))
+            kernels.push_back(&sse4_kernels);
+        if (__builtin_cpu_supports("avx2"))
+            kernels.push_back(&avx2_kernels);
+#endif
+        return kernels;
+    }
+
+    const VarintKernels& varint_kernels() {
+        static const VarintKernels* best = supported_varint_kernels().back();
+        return *best;
+    }
+
+};};
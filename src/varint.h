@@ -0,0 +1,64 @@
+#ifndef _A4_VARINT_H_
+#define _A4_VARINT_H_
+
+#include <vector>
+
+#include <a4/types.h>
+
+namespace a4{ namespace io{
+
+    /// Bulk decoding of packed repeated fields in the protobuf wire format,
+    /// used by ColumnBatch to fill columns without parsing the messages.
+    /// There is a scalar implementation and, on x86, SSE4.1 and AVX2 ones
+    /// that decode runs of one byte varints sixteen or thirty-two at a time.
+    /// The best one the CPU supports is selected at runtime.
+    /// Fixed width values (fixed32, fixed64, float, double) are in host
+    /// byte order on little endian machines and are simply copied.
+    struct VarintKernels {
+        const char* name;
+
+        /// Number of varints in [begin, end), the bytes without continuation bit
+        size_t (*count)(const uint8_t* begin, const uint8_t* end);
+
+        /// Decode the varints in [begin, end) into out, which needs room for
+        /// count(begin, end) values. 32 bit values keep the low bits of longer
+        /// varints, like negative int32. Returns the number of values or -1
+        /// if the last varint is truncated or a varint is longer than 10 bytes.
+        int64_t (*decode32)(const uint8_t* begin, const uint8_t* end, uint32_t* out);
+        int64_t (*decode64)(const uint8_t* begin, const uint8_t* end, uint64_t* out);
+
+        /// Undo the zigzag encoding of sint32/sint64 values in place
+        void (*zigzag32)(uint32_t* values, size_t n);
+        void (*zigzag64)(uint64_t* values, size_t n);
+    };
+
+    /// The fastest kernels for this CPU
+    const VarintKernels& varint_kernels();
+
+    /// All kernels this CPU can run, starting with the scalar ones
+    std::vector<const VarintKernels*> supported_varint_kernels();
+
+    /// Decode a single varint. Returns the position after it, or NULL if it
+    /// is truncated or longer than 10 bytes.
+    inline const uint8_t* read_varint(const uint8_t* p, const uint8_t* end, uint64_t* value) {
+        if (likely(p < end && *p < 0x80)) {
+            *value = *p;
+            return p + 1;
+        }
+        uint64_t result = 0;
+        for (int shift = 0; shift < 70; shift += 7) {
+            if (unlikely(p == end))
+                return NULL;
+            uint8_t b = *p++;
+            result |= uint64_t(b & 0x7f) << shift;
+            if (!(b & 0x80)) {
+                *value = result;
+                return p;
+            }
+        }
+        return NULL;
+    }
+
+};};
+
+#endif
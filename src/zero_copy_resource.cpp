@@ -1,6 +1,25 @@
+#include <a4/config.h>
+
 #include <sys/stat.h>
 #include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+// Detect io_uring if the configuration does not say
+#if !defined(HAVE_LINUX_IO_URING_H) && defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_LINUX_IO_URING_H 1
+#endif
+#endif
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
 
 #include <boost/algorithm/string.hpp>
 
@@ -54,6 +73,23 @@ namespace a4{ namespace io{
         ::close(no);
     }
 
+    void ZeroCopyStreamResource::readahead(size_t position, size_t size) {
+        if (_readahead == 0) return;
+        // Only advise again once half of the window has been read
+        if (position + _readahead/2 <= _readahead_until) return;
+        size_t start = std::max(position, _readahead_until);
+        size_t end = std::min(position + _readahead, size);
+        if (start < end) advise(start, end - start);
+        _readahead_until = end;
+    }
+
+    int ZeroCopyStreamResource::next_size(size_t available) const {
+        size_t limit = INT_MAX;
+        if (_readahead)
+            limit = std::min(limit, std::max<size_t>(_readahead/2, 1));
+        return std::min(available, limit);
+    }
+
     UnixFileMMap::UnixFileMMap(std::string name) : _name(name), _size(0), _position(0), _mmap(0), _error(false), _open(false) {};
 
     UnixFileMMap::~UnixFileMMap() { if (!_error) close(); };
@@ -84,12 +120,9 @@ namespace a4{ namespace io{
         if (_error) return false;
         if (!_open && !open()) return false;
         if (_size == _position) return false;
+        readahead(_position, _size);
         *data = (uint8_t*)_mmap + _position;
-        if ((_size - _position) > INT_MAX) {
-            *size = INT_MAX;
-        } else {
-            *size = _size - _position;
-        }
+        *size = next_size(_size - _position);
         _position += *size;
         return true;
     }
@@ -114,6 +147,7 @@ namespace a4{ namespace io{
         if (!_open && !open()) return false;
         if (position > _size) return false;
         _position = position;
+        _readahead_until = position;
         return true;
     }
 
@@ -131,13 +165,21 @@ namespace a4{ namespace io{
         assert(_open);
         UNIQUE<UnixFileMMap> f(new UnixFileMMap(_name));
         f->_file = _file;
+        f->_size = _size;
         f->_position = offset;
-        f->_mmap = (uint8_t*)_mmap + offset;
+        f->_mmap = _mmap;
         f->_error = _error;
         f->_open = _open;
+        f->_readahead = _readahead;
         return std::move(f);
     };
 
+    void UnixFileMMap::advise(size_t offset, size_t length) {
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t start = offset - offset % page;
+        madvise((uint8_t*)_mmap + start, length + offset - start, MADV_WILLNEED);
+    }
+
     UnixFilePartMMap::UnixFilePartMMap(std::string name) : UnixFileMMap(name), _mmap_offset(0), _mmap_blocksize(1<<28) {}
 
     bool UnixFilePartMMap::open() {
@@ -167,7 +209,7 @@ namespace a4{ namespace io{
     void UnixFilePartMMap::remap() {
         if (_mmap) munmap(_mmap, _mmap_blocksize);
         _mmap = ::mmap(NULL, _mmap_blocksize, PROT_READ, MAP_PRIVATE, _file->no, _mmap_offset);
-        if (mmap == MAP_FAILED) {
+        if (_mmap == MAP_FAILED) {
             FATAL("ERROR - Could not mmap '", _name, "': ", strerror(errno));
         }
     }
@@ -187,11 +229,9 @@ namespace a4{ namespace io{
             _mmap_offset = (_position/_mmap_blocksize)*_mmap_blocksize;
             remap();
         }
+        readahead(_position, _size);
         *data = (uint8_t*)_mmap + _position - _mmap_offset;
-        *size = _mmap_blocksize - (_position - _mmap_offset);
-        if (ssize_t(ssize_t(_size) - _position) < *size) {
-            *size = _size - _position;
-        }
+        *size = next_size(std::min(_mmap_offset + _mmap_blocksize, _size) - _position);
         _position += *size;
         return true;
     }
@@ -199,7 +239,288 @@ namespace a4{ namespace io{
     UNIQUE<ZeroCopyStreamResource> UnixFilePartMMap::Clone(size_t offset) {
         return UNIQUE<ZeroCopyStreamResource>();
     };
+
+    // The next window is not mapped yet, so advise on the file instead
+    void UnixFilePartMMap::advise(size_t offset, size_t length) {
+        posix_fadvise(_file->no, offset, length, POSIX_FADV_WILLNEED);
+    }
         
+    UnixFileURing::UnixFileURing(std::string name, int block_size, int queue_depth) :
+        _name(name), _fd(-1), _size(0), _position(0), _open(false), _error(false), _reads_lost(false),
+        _block_size(block_size), _slots(queue_depth), _buffers(NULL),
+        _head(0), _queued(0), _next_offset(0), _ring_fd(-1), _fixed_buffers(false),
+        _sq_ring(NULL), _cq_ring(NULL), _sqes(NULL), _sq_ring_size(0), _cq_ring_size(0), _sqes_size(0) {}
+
+    UnixFileURing::~UnixFileURing() {
+        close_ring();
+        // The kernel may still write into buffers of reads that were never reaped
+        if (!_reads_lost)
+            free(_buffers);
+        if (_fd >= 0) ::close(_fd);
+    }
+
+    bool UnixFileURing::open() {
+        if (_error) return false;
+        _fd = ::open(_name.c_str(), O_RDONLY);
+        struct stat buffer;
+        if (_fd < 0 || fstat(_fd, &buffer) == -1) {
+            ERROR("Could not open '", _name, "' - reason: ", strerror(errno));
+            _error = true;
+            return false;
+        }
+        _size = buffer.st_size;
+        if (posix_memalign((void**)&_buffers, sysconf(_SC_PAGESIZE), _slots.size()*_block_size) != 0) {
+            ERROR("Could not allocate read buffers for '", _name, "'");
+            _error = true;
+            return false;
+        }
+        if (!setup_ring()) {
+            close_ring();
+            _slots.resize(1); // pread fallback reads only on demand
+        }
+        _open = true;
+        return true;
+    }
+
+#ifdef HAVE_LINUX_IO_URING_H
+    bool UnixFileURing::setup_ring() {
+        struct io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        _ring_fd = syscall(__NR_io_uring_setup, _slots.size(), &params);
+        if (_ring_fd < 0) return false;
+
+        _sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        _cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        _sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+        _sq_ring = ::mmap(NULL, _sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring_fd, IORING_OFF_SQ_RING);
+        _cq_ring = ::mmap(NULL, _cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring_fd, IORING_OFF_CQ_RING);
+        _sqes = ::mmap(NULL, _sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring_fd, IORING_OFF_SQES);
+        if (_sq_ring == MAP_FAILED || _cq_ring == MAP_FAILED || _sqes == MAP_FAILED) return false;
+
+        char* sq = (char*)_sq_ring;
+        _sq_head = (unsigned*)(sq + params.sq_off.head);
+        _sq_tail = (unsigned*)(sq + params.sq_off.tail);
+        _sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+        _sq_array = (unsigned*)(sq + params.sq_off.array);
+        char* cq = (char*)_cq_ring;
+        _cq_head = (unsigned*)(cq + params.cq_off.head);
+        _cq_tail = (unsigned*)(cq + params.cq_off.tail);
+        _cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+        _cqes = cq + params.cq_off.cqes;
+
+        _iovecs.resize(_slots.size());
+        for (size_t i = 0; i < _slots.size(); i++) {
+            _iovecs[i].iov_base = buffer(i);
+            _iovecs[i].iov_len = _block_size;
+        }
+        // Registering may fail due to RLIMIT_MEMLOCK, then use plain readv
+        _fixed_buffers = syscall(__NR_io_uring_register, _ring_fd, IORING_REGISTER_BUFFERS,
+                                 &_iovecs[0], _iovecs.size()) == 0;
+        return true;
+    }
+
+    void UnixFileURing::close_ring() {
+        drain();
+        if (_sqes && _sqes != MAP_FAILED) munmap(_sqes, _sqes_size);
+        if (_cq_ring && _cq_ring != MAP_FAILED) munmap(_cq_ring, _cq_ring_size);
+        if (_sq_ring && _sq_ring != MAP_FAILED) munmap(_sq_ring, _sq_ring_size);
+        _sqes = _cq_ring = _sq_ring = NULL;
+        if (_ring_fd >= 0) ::close(_ring_fd);
+        _ring_fd = -1;
+    }
+
+    /// Queue reads for all free slots and submit them with a single system call
+    void UnixFileURing::submit_reads() {
+        unsigned to_submit = 0;
+        const unsigned first_tail = *_sq_tail;
+        const size_t first_slot = (_head + _queued) % _slots.size();
+        unsigned tail = first_tail;
+        while (_queued < _slots.size() && _next_offset < _size) {
+            size_t i = (_head + _queued) % _slots.size();
+            Slot& slot = _slots[i];
+            slot.offset = _next_offset;
+            slot.length = std::min(_block_size, _size - _next_offset);
+            slot.pending = true;
+            slot.failed = false;
+            _next_offset += slot.length;
+            _queued++;
+
+            unsigned index = tail & *_sq_mask;
+            struct io_uring_sqe* sqe = (struct io_uring_sqe*)_sqes + index;
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->fd = _fd;
+            sqe->off = slot.offset;
+            sqe->user_data = i;
+            if (_fixed_buffers) {
+                sqe->opcode = IORING_OP_READ_FIXED;
+                sqe->addr = (uint64_t)buffer(i);
+                sqe->len = slot.length;
+                sqe->buf_index = i;
+            } else {
+                _iovecs[i].iov_len = slot.length;
+                sqe->opcode = IORING_OP_READV;
+                sqe->addr = (uint64_t)&_iovecs[i];
+                sqe->len = 1;
+            }
+            _sq_array[index] = index;
+            tail++;
+            to_submit++;
+        }
+        if (to_submit == 0) return;
+        __atomic_store_n(_sq_tail, tail, __ATOMIC_RELEASE);
+        if (syscall(__NR_io_uring_enter, _ring_fd, to_submit, 0, 0, NULL, 0) < 0) {
+            ERROR("Could not submit reads for '", _name, "': ", strerror(errno));
+            // Take back the entries of this submission the kernel has not
+            // consumed, so that they are not submitted later. Reads already
+            // in flight are still reaped by wait_for().
+            unsigned consumed = __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE) - first_tail;
+            if (consumed > to_submit) consumed = 0;
+            __atomic_store_n(_sq_tail, first_tail + consumed, __ATOMIC_RELEASE);
+            for (unsigned k = consumed; k < to_submit; k++) {
+                Slot& slot = _slots[(first_slot + k) % _slots.size()];
+                slot.pending = false;
+                slot.failed = true;
+            }
+        }
+    }
+
+    /// Reap completions until the given slot has finished
+    bool UnixFileURing::wait_for(size_t slot) {
+        while (_slots[slot].pending) {
+            unsigned head = *_cq_head;
+            if (head == __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE)) {
+                // also submit what the kernel has not taken yet
+                unsigned unsubmitted = *_sq_tail - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE);
+                if (syscall(__NR_io_uring_enter, _ring_fd, unsubmitted, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+                    ERROR("Could not wait for reads of '", _name, "': ", strerror(errno));
+                    return false;
+                }
+                continue;
+            }
+            struct io_uring_cqe* cqe = (struct io_uring_cqe*)_cqes + (head & *_cq_mask);
+            Slot& done = _slots[cqe->user_data];
+            done.pending = false;
+            if (cqe->res < 0) {
+                ERROR("Could not read from '", _name, "': ", strerror(-cqe->res));
+                done.failed = true;
+            } else if (size_t(cqe->res) < done.length) {
+                // Short read, get the rest synchronously
+                done.failed = !read_sync(cqe->user_data, cqe->res);
+            }
+            __atomic_store_n(_cq_head, head + 1, __ATOMIC_RELEASE);
+        }
+        return !_slots[slot].failed;
+    }
+#else
+    bool UnixFileURing::setup_ring() { return false; }
+    void UnixFileURing::close_ring() {}
+    void UnixFileURing::submit_reads() {}
+    bool UnixFileURing::wait_for(size_t) { return false; }
+#endif
+
+    /// Read the rest of the slot with pread(), starting after done bytes
+    bool UnixFileURing::read_sync(size_t slot, size_t done) {
+        Slot& s = _slots[slot];
+        while (done < s.length) {
+            ssize_t res = pread(_fd, buffer(slot) + done, s.length - done, s.offset + done);
+            if (res < 0 && errno == EINTR) continue;
+            if (res <= 0) {
+                ERROR("Could not read from '", _name, "': ", res < 0 ? strerror(errno) : "unexpected end of file");
+                return false;
+            }
+            done += res;
+        }
+        return true;
+    }
+
+    /// Wait for all reads in flight, the kernel may still write into the buffers.
+    /// If that fails, the buffers can not be reused and the stream fails.
+    void UnixFileURing::drain() {
+        if (_ring_fd < 0) return;
+        for (size_t i = 0; i < _slots.size(); i++) {
+            if (_slots[i].pending && !wait_for(i) && _slots[i].pending) {
+                _reads_lost = true;
+                _error = true;
+                return;
+            }
+        }
+    }
+
+    bool UnixFileURing::Next(const void** data, int* size) {
+        if (_error) return false;
+        if (!_open && !open()) return false;
+        while (_position < _size) {
+            if (_ring_fd >= 0) {
+                submit_reads();
+                if (_queued == 0 || !wait_for(_head)) break;
+            } else if (_queued == 0) {
+                Slot& slot = _slots[_head];
+                slot.offset = _next_offset;
+                slot.length = std::min(_block_size, _size - _next_offset);
+                if (!read_sync(_head, 0)) break;
+                _next_offset += slot.length;
+                _queued = 1;
+            }
+            Slot& slot = _slots[_head];
+            if (_position < slot.offset + slot.length) {
+                *data = buffer(_head) + (_position - slot.offset);
+                *size = slot.offset + slot.length - _position;
+                _position += *size;
+                return true;
+            }
+            // Slot is used up, recycle it
+            _head = (_head + 1) % _slots.size();
+            _queued--;
+        }
+        if (_position < _size) _error = true;
+        return false;
+    }
+
+    void UnixFileURing::BackUp(int count) {
+        assert(count >= 0 && size_t(count) <= _position);
+        _position -= count;
+    }
+
+    bool UnixFileURing::Skip(int count) {
+        if (count < 0) return false;
+        if (!_open && !open()) return false;
+        if (_position + count > _size) {
+            Seek(_size);
+            return false;
+        }
+        if (_position + count > _next_offset)
+            return Seek(_position + count);
+        _position += count;
+        return true;
+    }
+
+    bool UnixFileURing::Seek(size_t position) {
+        if (_error) return false;
+        if (!_open && !open()) return false;
+        if (position > _size) return false;
+        drain();
+        if (_error) return false;
+        _head = 0;
+        _queued = 0;
+        _next_offset = position;
+        _position = position;
+        return true;
+    }
+
+    bool UnixFileURing::SeekBack(size_t position) {
+        if (!_open && !open()) return false;
+        if (position > _size) return false;
+        return Seek(_size - position);
+    }
+
+    /// The clone opens the file and sets up its ring on first use
+    UNIQUE<ZeroCopyStreamResource> UnixFileURing::Clone(size_t offset) {
+        if (_open && offset > _size) return UNIQUE<ZeroCopyStreamResource>();
+        UNIQUE<UnixFileURing> f(new UnixFileURing(_name, _block_size, _slots.size()));
+        f->_position = f->_next_offset = offset;
+        return std::move(f);
+    }
+
     UnixStream::UnixStream() {};
 
     UnixStream::UnixStream(int file_descriptor, int block_size) {
@@ -214,8 +535,18 @@ namespace a4{ namespace io{
     UnixFile::UnixFile(std::string filename, int block_size) {
         _file.reset(new OpenFile(filename.c_str(), O_RDONLY, false));
         _impl.reset(new google::protobuf::io::FileInputStream(_file->no, block_size));
+        posix_fadvise(_file->no, 0, 0, POSIX_FADV_SEQUENTIAL);
     };
 
+    bool UnixFile::Next(const void** data, int* size) {
+        readahead(_impl->ByteCount(), SIZE_MAX);
+        return _impl->Next(data, size);
+    }
+
+    // Fails harmlessly with ESPIPE on FIFOs
+    void UnixFile::advise(size_t offset, size_t length) {
+        posix_fadvise(_file->no, offset, length, POSIX_FADV_WILLNEED);
+    }
     class RemoteCopyingFile : public google::protobuf::io::CopyingInputStream {
         public:
             RemoteCopyingFile(std::string filename);
@@ -383,6 +714,8 @@ namespace a4{ namespace io{
         } else if (proto == "nomm://") {
             url = url.substr(7);
             try_mmap = false;
+        } else if (url.substr(0,8) == "uring://") {
+            return UNIQUE<UnixFileURing>(new UnixFileURing(url.substr(8)));
         }
 
         struct stat buffer;
@@ -2,9 +2,11 @@
 #define _A4_ZERO_COPY_RESOURCE_H_
 
 #include <string>
+#include <vector>
 
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 
 #include <google/protobuf/io/zero_copy_stream.h>
 
@@ -36,6 +38,24 @@ namespace a4{ namespace io{
             virtual UNIQUE<ZeroCopyStreamResource> Clone(size_t offset) {
                 return UNIQUE<ZeroCopyStreamResource>();
             };
+
+            /// Have the kernel read up to the given number of bytes ahead of the
+            /// current position in the background. Zero disables readahead.
+            void set_readahead(size_t bytes) { _readahead = bytes; };
+
+        protected:
+            ZeroCopyStreamResource() : _readahead(16*1024*1024), _readahead_until(0) {};
+
+            /// Start reading the given range in the background, where supported
+            virtual void advise(size_t, size_t) {};
+            /// Keep the readahead window in front of the given position
+            void readahead(size_t position, size_t size);
+            /// Size of a buffer returned by Next() with the given number of bytes
+            /// available. At most half the readahead window, so that readahead()
+            /// is called again before the consumer reads past the window.
+            int next_size(size_t available) const;
+
+            size_t _readahead, _readahead_until;
     };
 
     struct OpenFile {
@@ -73,6 +93,8 @@ namespace a4{ namespace io{
             virtual UNIQUE<ZeroCopyStreamResource> Clone(size_t offset);
 
         protected:
+            virtual void advise(size_t offset, size_t length);
+
             std::string _name;
             shared<OpenFile> _file;
             size_t _size;
@@ -91,12 +113,79 @@ namespace a4{ namespace io{
             bool Next(const void** data, int* size);
             virtual UNIQUE<ZeroCopyStreamResource> Clone(size_t offset);
 
+        protected:
+            virtual void advise(size_t offset, size_t length);
+
         private:
             void remap();
             size_t _mmap_offset;
             size_t _mmap_blocksize;
     };
 
+    /// Reads a file on disk through io_uring, keeping several reads into
+    /// registered buffers in flight. Falls back to pread() if io_uring
+    /// is not compiled in or not supported by the kernel.
+    class UnixFileURing : public ZeroCopyStreamResource {
+        public:
+            UnixFileURing(std::string name, int block_size = 1<<20, int queue_depth = 8);
+            virtual ~UnixFileURing();
+
+            bool Next(const void** data, int* size);
+            void BackUp(int count);
+            bool Skip(int count);
+
+            bool seekable() const { return true; };
+            bool Seek(size_t position);
+            bool SeekBack(size_t position);
+            size_t Tell() const { return _position; };
+            google::protobuf::int64 ByteCount() const { return _position; };
+
+            virtual UNIQUE<ZeroCopyStreamResource> Clone(size_t offset);
+
+            /// True if reads go through io_uring
+            bool uring() const { return _ring_fd >= 0; };
+
+        private:
+            struct Slot {
+                size_t offset;
+                size_t length;
+                bool pending;
+                bool failed;
+            };
+            bool open();
+            bool setup_ring();
+            void close_ring();
+            void submit_reads();
+            bool wait_for(size_t slot);
+            bool read_sync(size_t slot, size_t done);
+            void drain();
+            char* buffer(size_t slot) { return _buffers + slot*_block_size; };
+
+            std::string _name;
+            int _fd;
+            size_t _size, _position;
+            bool _open, _error;
+            bool _reads_lost; // reads in flight that could not be reaped
+
+            size_t _block_size;
+            std::vector<Slot> _slots;
+            char* _buffers;
+            size_t _head;        // slot containing the read position
+            size_t _queued;      // slots with reads starting from _head
+            size_t _next_offset; // file offset of the next read to submit
+
+            int _ring_fd;
+            bool _fixed_buffers;
+            void* _sq_ring;
+            void* _cq_ring;
+            void* _sqes;
+            size_t _sq_ring_size, _cq_ring_size, _sqes_size;
+            unsigned *_sq_head, *_sq_tail, *_sq_mask, *_sq_array;
+            unsigned *_cq_head, *_cq_tail, *_cq_mask;
+            void* _cqes;
+            std::vector<struct iovec> _iovecs;
+    };
+
     class UnixStream : public ZeroCopyStreamResource {
         public:
             UnixStream();
@@ -114,7 +203,9 @@ namespace a4{ namespace io{
     class UnixFile : public UnixStream {
         public:
             UnixFile(std::string filename, int block_size = -1);
+            bool Next(const void** data, int* size);
         protected:
+            virtual void advise(size_t offset, size_t length);
             UNIQUE<OpenFile> _file;
     };
     